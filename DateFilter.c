@@ -1,13 +1,20 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
+#include <string.h>
 #include <strings.h>
+#include <errno.h>
 #include <time.h> // Included only to track duration of test
 #include <libgen.h> // filename manipulation
+#include <glob.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/stat.h>
 #include "TreeSet.h"
+#include "TreeTrace.h"
 
-/* DataFilter - reads in a file of ISO 8601 dates in Zulu time or with a TZ adjustment, applies the adjustment to the time, then prints the original input to an output file
-(called <input filename>_output.txt ) as long as it is unique in the original file. */
+/* DataFilter - reads in one or more files of ISO 8601 dates in Zulu time or with a TZ adjustment, applies the adjustment to the time, then prints the original input
+to an output file per input file (called <input filename>_output.txt ) as long as it is unique across all the input files, taken in the order they are given. */
 
 static unsigned int verbose_enabled = 0;
 
@@ -30,8 +37,20 @@ static void verbose_printf (unsigned int level, const char *format, ...)
 #define CENTURY_INDEX 101
 #define CENTURY_RANGE 100
 
+// Per year counters for the -c cold year cache.
+typedef struct year_stats {
+    unsigned long long lookups;       // timestamps checked against the year
+    unsigned long long blob_hits;     // duplicates answered from the year's cold blob without rehydrating it
+    unsigned int       rehydrations;  // cold blobs turned back into trees to take a new timestamp
+    unsigned int       evictions;     // times the tree was compressed into a cold blob
+} year_stats;
+
 typedef struct century {
     struct Tree *year[CENTURY_RANGE];
+    struct FrozenTree *history[CENTURY_RANGE];  // timestamps preloaded with -p, read only
+    struct FrozenTree *cold[CENTURY_RANGE];     // -c: least recently used years compressed out of year[], rehydrated on a new timestamp
+    unsigned long long last_access[CENTURY_RANGE];
+    year_stats stats[CENTURY_RANGE];
 } century;
 
 century *centuries[CENTURY_INDEX] = {NULL};
@@ -40,6 +59,53 @@ century *centuries[CENTURY_INDEX] = {NULL};
 static size_t memory_usage = 0;
 #endif
 
+// -m: bytes all year trees may use together before spilling to disk (0 for no limit), checked every BUDGET_CHECK_INTERVAL timestamps.
+static size_t tree_memory_budget = 0;
+static unsigned int budget_check_countdown = 0;
+#define BUDGET_CHECK_INTERVAL 4096
+
+// -c: bytes the live year trees may use together before the least recently used years are compressed into cold blobs (0 for no cap).
+static size_t year_cache_cap = 0;
+static unsigned long long year_access_tick = 0;
+
+// -h: count every occurrence of each timestamp in counter_bits wide counters (TREE_OPTION_COUNTERS), 0 for plain bitmaps. -b picks 4 or 8 bits.
+static unsigned int count_bits = 0;
+
+// -r: digits of the seconds fraction kept when comparing timestamps (0 to 6, 3 for milliseconds), see MakeTSKey.
+static unsigned int fraction_digits = 0;
+static unsigned int fraction_scale = 1000000;   // microseconds per kept fraction unit
+static unsigned int fraction_node_units = 0;    // fraction units per year tree node (10, 100 or 1000)
+static unsigned int fraction_node_bits = 0;     // bits holding a sub bit index of fraction_node_units
+static unsigned int fraction_high_bits = 0;     // bits holding the units above a node, past 3 digits
+
+// -a: year trees tuned (TuneTree) from a sample of the input and the -p history; years outside the sample take the tuning of the busiest one.
+static TreeTuning fallback_tuning;
+static int fallback_tuned = 0;
+
+/* Bits needed to hold 10^digits - 1 (the fraction units of up to 3 digits), same as TreeSet's CountBitSize of 10^digits. */
+static const unsigned int decimal_digit_bits[4] = {0, 4, 7, 10};
+
+/* Select the resolution timestamps are deduplicated at: digits of the seconds fraction, 0 (whole seconds) to 6 (microseconds). Must be called
+   before any year tree exists. */
+void SetFractionDigits (unsigned int digits)
+{
+   fraction_digits = (digits > 6)?6:digits;
+   fraction_scale = 1;
+   for (unsigned int idx=fraction_digits;idx<6;idx++)
+      fraction_scale *= 10;
+   fraction_node_units = 1;
+   for (unsigned int idx=0;(idx<fraction_digits) && (idx<3);idx++)
+      fraction_node_units *= 10;
+   fraction_node_bits = decimal_digit_bits[(fraction_digits<3)?fraction_digits:3];
+   fraction_high_bits = (fraction_digits>3)?decimal_digit_bits[fraction_digits-3]:0;
+}
+
+/* Bits per node of a year tree: a minute of seconds, or at sub second resolution one node per second (up to 3 digits) or per millisecond. */
+static unsigned int YearNodeBits (void)
+{
+   return (fraction_digits > 0)?fraction_node_units:60;
+}
+
 /*(Create key for bit for the TreeSet (year covered by arrays containing the TreeSet struct) */
 static unsigned int MakeKey(int month, int day, int hour, int minute, int second)
 {
@@ -49,23 +115,33 @@ static unsigned int MakeKey(int month, int day, int hour, int minute, int second
    return (month<<22) + (day<<17) + (hour<<12) + (minute<<6) + second;
 }
 
-/* Check if a TS is already set in our TreeSet, then set it as present if it was not.
-   Return true if already present, false if not. */
-unsigned int CheckInsertTSPresent (int year, int month, int day, int hour, int minute, int second)
+/* Bit offset in a year tree for a timestamp at the -r resolution. Whole seconds use MakeKey as it is. Otherwise the fraction, cut to
+   fraction_digits, is appended below MakeKey: its last (up to) 3 digits become the sub bit of a dense node of fraction_node_units bits and any
+   digits above those extend the node key, so each node holds a whole second (or millisecond) and time ordered input stays on the finger. */
+static unsigned long long MakeTSKey (int month, int day, int hour, int minute, int second, int microsecond)
 {
-  struct Tree *year_tree = NULL;
-  unsigned int key = MakeKey (month, day, hour, minute, second);
+   unsigned long long key = MakeKey(month, day, hour, minute, second);
+   unsigned int units;
+
+   if (fraction_digits == 0)
+      return key;
+   units = (unsigned int) microsecond / fraction_scale;
+   key = (key << fraction_high_bits) | (units / fraction_node_units);
+   return (key << fraction_node_bits) | (units % fraction_node_units);
+}
 
-  unsigned int already_present = 0;
+/* Find the century struct covering the given year, creating it if needed. Returns NULL if out of memory. */
+static century *YearCentury (int year)
+{
   // Increment year by 1 to allow for year -1 and year 10000 due to time offset
   int century_idx = (year+1) / 100;
-  int year_idx = (year+1) % 100;
 
-   /* Find or create the decade struct and tree root for the given year */
-   verbose_printf (2,"index year=%d so Century idx=%d[%p], year_idx=%d\n", year+1, century_idx, centuries[century_idx], year_idx);
+   /* Find or create the decade struct for the given year */
    if (centuries[century_idx] == NULL)
    {
       centuries[century_idx] = malloc(sizeof(century));
+      if (!centuries[century_idx])
+         return NULL;
       memset (centuries[century_idx], 0, sizeof(century));
       #ifdef TESTSET_PROFILE
       memory_usage += sizeof(century);
@@ -74,25 +150,246 @@ unsigned int CheckInsertTSPresent (int year, int month, int day, int hour, int m
       verbose_printf (2,"allocated a year range at %d, %p\n", century_idx, centuries[century_idx]);
    }
 
-   if (centuries[century_idx])
+   return centuries[century_idx];
+}
+
+static TreeOptions YearTreeOptions (void)
+{
+   TreeOptions options;
+
+   memset(&options, 0, sizeof(options));
+   options.memory_budget = tree_memory_budget;
+   options.counter_bits = count_bits;
+   if (tree_memory_budget)
+      options.flags |= TREE_OPTION_SPILL;
+   if (count_bits)
+      options.flags |= TREE_OPTION_COUNTERS;
+   return options;
+}
+
+/* A new year tree: thawed from cold if given, else with tuning (NULL for the -a fallback, if any) or the fixed YearNodeBits. */
+static struct Tree *CreateYearTree (struct FrozenTree *cold, const TreeTuning *tuning)
+{
+   TreeOptions options = YearTreeOptions();
+
+   // A thawed year keeps the counter layout (and node width) it was frozen with.
+   if (cold)
+      return ThawTree(cold, (tree_memory_budget)?&options:NULL);
+   if (!tuning && fallback_tuned)
+      tuning = &fallback_tuning;
+   if (tuning)
+      return CreateTreeFromTuning(tuning, &options);
+   if (options.flags)
+       return CreateTreeWithOptions(YearNodeBits(), &options);
+   return CreateTree(YearNodeBits());
+}
+
+/* Keep the live year trees within year_cache_cap by compressing the least recently used ones, other than current_tree, into cold blobs (a
+   FrozenTree, delta encoded keys plus packed bitmaps). Years with nodes spilled by -m stay as they are, FreezeTree does not take them. The
+   candidates are put in a min heap on last_access once per check, so each eviction takes the next one in O(log years). */
+typedef struct year_slot {
+   century *year_century;
+   int      year_idx;
+} year_slot;
+
+static unsigned long long YearSlotAccess (const year_slot *slot)
+{
+   return slot->year_century->last_access[slot->year_idx];
+}
+
+static void YearHeapSiftDown (year_slot *heap, unsigned int count, unsigned int idx)
+{
+   for (;;)
+   {
+      unsigned int smallest = idx, child = (2 * idx) + 1;
+
+      if ((child < count) && (YearSlotAccess(&heap[child]) < YearSlotAccess(&heap[smallest])))
+         smallest = child;
+      if ((child + 1 < count) && (YearSlotAccess(&heap[child + 1]) < YearSlotAccess(&heap[smallest])))
+         smallest = child + 1;
+      if (smallest == idx)
+         return;
+      year_slot swap = heap[idx];
+      heap[idx] = heap[smallest];
+      heap[smallest] = swap;
+      idx = smallest;
+   }
+}
+
+static void EvictColdYears (struct Tree *current_tree)
+{
+   size_t total = 0;
+   year_slot *heap;
+   unsigned int heap_count = 0, live_count = 0;
+
+   for (int i=0;i<CENTURY_INDEX;i++)
    {
-       year_tree = centuries[century_idx]->year[year_idx];
-       if (!year_tree)
+      for (int j=0;centuries[i] && (j<CENTURY_RANGE);j++)
+      {
+         if (centuries[i]->year[j])
+         {
+            total += TreeMemoryUsage(centuries[i]->year[j]);
+            live_count++;
+         }
+      }
+   }
+   if (total <= year_cache_cap)
+      return;
+
+   heap = malloc(live_count * sizeof(year_slot));
+   if (!heap)
+   {
+      printf ("Out of memory choosing year trees to compress, the cap is not kept this time.\n");
+      return;
+   }
+   for (int i=0;i<CENTURY_INDEX;i++)
+   {
+      for (int j=0;centuries[i] && (j<CENTURY_RANGE);j++)
+      {
+         struct Tree *year_tree = centuries[i]->year[j];
+         if (!year_tree || (year_tree == current_tree) || (TreeSpillRuns(year_tree) > 0))
+            continue;
+         heap[heap_count].year_century = centuries[i];
+         heap[heap_count++].year_idx = j;
+      }
+   }
+   for (unsigned int idx=heap_count/2;idx-->0;)
+      YearHeapSiftDown(heap, heap_count, idx);
+
+   while ((total > year_cache_cap) && (heap_count > 0))
+   {
+      century *lru_century = heap[0].year_century;
+      int lru_idx = heap[0].year_idx;
+
+      heap[0] = heap[--heap_count];
+      YearHeapSiftDown(heap, heap_count, 0);
+
+      struct Tree *year_tree = lru_century->year[lru_idx];
+      size_t tree_bytes = TreeMemoryUsage(year_tree);
+      struct FrozenTree *cold = FreezeTree(year_tree);
+      total -= tree_bytes;
+      if (!cold)
+         continue;   // left live, as memory that cannot be freed this time
+      verbose_printf(1, "Year trees use %lu bytes, over the cap of %lu, year tree of %lu bytes compressed to %lu.\n", (unsigned long) (total + tree_bytes),
+                     (unsigned long) year_cache_cap, (unsigned long) tree_bytes, (unsigned long) FrozenTreeBytes(cold));
+      DestroyTree(year_tree);
+      lru_century->year[lru_idx] = NULL;
+      lru_century->cold[lru_idx] = cold;
+      lru_century->stats[lru_idx].evictions++;
+   }
+   free(heap);
+}
+
+/* Keep the year trees together within tree_memory_budget. Every year but the one just written is spilled to disk in full (input is mostly
+   time ordered, so those years are likely finished); the current year keeps itself within the budget by spilling its own cold half. */
+static void EnforceMemoryBudget (struct Tree *current_tree)
+{
+   size_t total = 0;
+
+   for (int pass=0;pass<2;pass++)
+   {
+      for (int i=0;i<CENTURY_INDEX;i++)
+      {
+         for (int j=0;centuries[i] && (j<CENTURY_RANGE);j++)
+         {
+            struct Tree *year_tree = centuries[i]->year[j];
+            if (!year_tree)
+               continue;
+            if (pass == 0)
+               total += TreeMemoryUsage(year_tree);
+            else if (year_tree != current_tree)
+               SpillTree(year_tree, 100);
+         }
+      }
+      if (total <= tree_memory_budget)
+         break;
+      verbose_printf(1, "Year trees use %lu bytes, over the budget of %lu, spilling all but the current year.\n", (unsigned long) total, (unsigned long) tree_memory_budget);
+   }
+}
+
+/* The live tree of a year, created (or rehydrated from the year's cold blob) if there is none. Returns NULL if out of memory. */
+static struct Tree *LiveYearTree (century *year_century, int year_idx)
+{
+   struct Tree *year_tree = year_century->year[year_idx];
+   struct FrozenTree *cold = year_century->cold[year_idx];
+
+   if (!year_tree)
+   {
+       year_century->year[year_idx] = year_tree = CreateYearTree(cold, NULL);
+       if (cold && year_tree)
        {
-           centuries[century_idx]->year[year_idx] = year_tree = CreateTree(60);
+           DestroyFrozenTree(cold);
+           year_century->cold[year_idx] = NULL;
+           year_century->stats[year_idx].rehydrations++;
        }
    }
+   return year_tree;
+}
+
+/* Check if a TS is already set in our TreeSet, then set it as present if it was not.
+   Return true if already present, false if not. */
+unsigned int CheckInsertTSPresent (int year, int month, int day, int hour, int minute, int second, int microsecond)
+{
+  struct Tree *year_tree = NULL;
+  century *year_century = YearCentury(year);
+  int year_idx = (year+1) % 100;
+  unsigned long long key = MakeTSKey (month, day, hour, minute, second, microsecond);
+
+  unsigned int already_present = 0;
+  unsigned int in_history = 0;
+
+   // Timestamps from the history file are only ever read, from the year's frozen index. When counting, a history hit is still counted below.
+   if (year_century && FrozenCheckBit(year_century->history[year_idx], key))
+   {
+       if (!count_bits)
+       {
+           TREE_TRACE(TREE_TRACE_TS_CHECK, key, (unsigned int) year, 1 | 2);
+           return 1;
+       }
+       in_history = 2;
+   }
+
+   if (year_century)
+   {
+       year_century->last_access[year_idx] = ++year_access_tick;
+       year_century->stats[year_idx].lookups++;
+
+       // A cold year answers duplicates from its blob, and is only rehydrated for a timestamp it has not seen.
+       // When counting, every occurrence has to reach a counter, so a cold year is always rehydrated.
+       struct FrozenTree *cold = year_century->cold[year_idx];
+       if (cold && !count_bits && FrozenCheckBit(cold, key))
+       {
+           year_century->stats[year_idx].blob_hits++;
+           TREE_TRACE(TREE_TRACE_TS_CHECK, key, (unsigned int) year, 1 | 4);
+           return 1;
+       }
+
+       year_tree = LiveYearTree(year_century, year_idx);
+   }
 
-   SetBit (year_tree, key, 1, &already_present);
+   if (count_bits)
+       already_present = (IncrementBit(year_tree, key) > 0) || in_history;
+   else
+       SetBit64 (year_tree, key, 1, &already_present);
 
-   verbose_printf(1, "SetBit complete, bits prior setting=%d\n", already_present);
+   if ((tree_memory_budget || year_cache_cap) && (++budget_check_countdown >= BUDGET_CHECK_INTERVAL))
+   {
+       budget_check_countdown = 0;
+       if (year_cache_cap)
+           EvictColdYears(year_tree);
+       if (tree_memory_budget)
+           EnforceMemoryBudget(year_tree);
+   }
+
+   TREE_TRACE(TREE_TRACE_TS_CHECK, key, (unsigned int) year, already_present | in_history);
 
    return already_present;
 }
 
 /* Verify the buffer passed in is a ISO 8501 Zulu or TimeZone format before setting the year,month,day,hour,minute, and second fields to the
  * adjusted Zulu time. If the time is adjusted,  tz_adjusted will be set to 1. Otherwise, a 0 denoting no adjustment. Return true if the line parsed, false otherwise. */
-int parse_timestamp (char * buffer, unsigned int length, int *year, int *month, int *day, int *hour, int *minute, int *second, int *tz_adjusted)
+int parse_timestamp (char * buffer, unsigned int length, int *year, int *month, int *day, int *hour, int *minute, int *second, int *microsecond,
+                     int *tz_adjusted)
 {
    char abstract_format[30] = {0};
    char tzd[30] = {0};
@@ -100,14 +397,15 @@ int parse_timestamp (char * buffer, unsigned int length, int *year, int *month,
    unsigned int parse_failed = 0;
    unsigned int count = 0;
    unsigned int output_idx = 0;
+   unsigned int fraction_length = 0;
 
    if (buffer)
    {
-     // buffer must fall between these lengths to be valid.
-     if ((length < 20) || (length > 25))
+     // buffer must fall between these lengths to be valid (a seconds fraction adds up to 7).
+     if ((length < 20) || (length > 32))
      {
          parse_failed = 1;
-         verbose_printf (2,"Length of %d shorter than 20 or longer than 25, fail!\n",  length);
+         TREE_TRACE(TREE_TRACE_PARSE, length, 0, 2);
          return parse_failed;
      }
 
@@ -132,7 +430,13 @@ int parse_timestamp (char * buffer, unsigned int length, int *year, int *month,
      {
          abstract_format[output_idx++] = '0' + count;
      }
-     verbose_printf (2,"Format str:%s\n", abstract_format);
+
+     // A fraction of 3 to 6 digits may follow the seconds, drop it from the format so the patterns below cover it.
+     if ((strncmp(abstract_format, "4-2-2T2:2:2.", 12) == 0) && (abstract_format[12] >= '3') && (abstract_format[12] <= '6'))
+     {
+         fraction_length = abstract_format[12] - '0';
+         memmove(&abstract_format[11], &abstract_format[13], strlen(&abstract_format[13]) + 1);
+     }
 
      if (!parse_failed)
      {
@@ -143,7 +447,13 @@ int parse_timestamp (char * buffer, unsigned int length, int *year, int *month,
      if (!parse_failed && sscanf (buffer, "%4d-%2d-%2dT%2d:%2d:%2d%s", year, month, day, hour, minute, second, tzd))
      {
          char tz_sign;
-         verbose_printf (2,"year:%d month:%d day:%d, hour:%d minute:%d, second:%d (%s)\n", *year, *month, *day, *hour, *minute, *second, tzd);
+
+         // Take the fraction (scaled to microseconds) off the front of the time zone designator.
+         *microsecond = 0;
+         for (unsigned int idx=1;idx<=6;idx++)
+            *microsecond = (*microsecond * 10) + ((idx <= fraction_length)?(tzd[idx] - '0'):0);
+         if (fraction_length > 0)
+            memmove(tzd, &tzd[fraction_length + 1], strlen(&tzd[fraction_length + 1]) + 1);
 
          // Check for a timezone modification field and ripple the adjustments upward through day, month, year as needed.
          if (tzd[0] != 'Z')
@@ -152,7 +462,6 @@ int parse_timestamp (char * buffer, unsigned int length, int *year, int *month,
             {
                *tz_adjusted = ((adj_hr != 0) || (adj_min != 0))?1:0;
 
-               verbose_printf(2, " tz adjusted=%d (adj_hr:%d adj_min:%d)\n", *tz_adjusted, adj_hr, adj_min);
                if (tz_sign == '-')
                {
                    adj_hr = -adj_hr;
@@ -204,7 +513,6 @@ int parse_timestamp (char * buffer, unsigned int length, int *year, int *month,
                   (*year)--;
                   *month += 12;
                }
-               verbose_printf (2,"Adjusted year:%d month:%d day:%d, hour:%d minute:%d, second:%d\n\n", *year, *month, *day, *hour, *minute, *second);
             }
             else
             {
@@ -216,18 +524,678 @@ int parse_timestamp (char * buffer, unsigned int length, int *year, int *month,
              *tz_adjusted = 0;
          }
       }
+      TREE_TRACE(TREE_TRACE_PARSE, length, (parse_failed)?0:(unsigned int) *year, (parse_failed)?2:(unsigned int) *tz_adjusted);
    }
    return parse_failed;
 }
 
+#ifndef DATEFILTER_NO_MAIN // TreeSetBench links the parsing and filtering code above without this driver.
+
+/* Timestamps of a previous run, grouped per year and sorted so each year tree can be bulk loaded by BuildTreeFromSortedBits. */
+typedef struct history_entry {
+    int year;
+    unsigned long long key;
+} history_entry;
+
+static int CompareHistoryEntry (const void *a, const void *b)
+{
+    const history_entry *entry_a = a;
+    const history_entry *entry_b = b;
+
+    if (entry_a->year != entry_b->year)
+        return (entry_a->year < entry_b->year)?-1:1;
+    if (entry_a->key != entry_b->key)
+        return (entry_a->key < entry_b->key)?-1:1;
+    return 0;
+}
+
+/* Read a file of previously seen timestamps and mark all of them as present before filtering begins. Each year is bulk loaded and then frozen
+   (FreezeTree) into a compact read only index, new timestamps of that year go to a separate tree. Must run before any tree exists.
+   Returns the number of timestamps loaded. */
+static unsigned int PreloadHistory (const char *history_filename)
+{
+    FILE *fp_history = fopen(history_filename, "r");
+    history_entry *entries = NULL;
+    unsigned long long *offsets = NULL;
+    unsigned int entry_count = 0;
+    unsigned int entry_capacity = 0;
+    char buffer[255];
+    int year, month, day, hour, minute, second, microsecond, tz_adjusted;
+
+    if (!fp_history)
+    {
+        fprintf(stderr, "History file %s cannot be opened:%s\n", history_filename, strerror(errno));
+        exit(errno);
+    }
+
+    while (fgets(buffer, 255, fp_history))
+    {
+        unsigned int len = strlen(buffer);
+        if ((len>0) && (buffer[len-1]=='\n'))
+           buffer[--len] = 0;
+        if ((len>0) && (buffer[len-1]=='\r'))
+           buffer[--len] = 0;
+
+        if (parse_timestamp(buffer, len, &year, &month, &day, &hour, &minute, &second, &microsecond, &tz_adjusted))
+            continue;
+
+        if (entry_count == entry_capacity)
+        {
+            entry_capacity = (entry_capacity > 0)?entry_capacity*2:1024;
+            entries = realloc(entries, entry_capacity * sizeof(history_entry));
+            if (!entries)
+            {
+                fprintf(stderr, "Out of memory loading history file %s\n", history_filename);
+                exit(ENOMEM);
+            }
+        }
+        entries[entry_count].year = year;
+        entries[entry_count].key = MakeTSKey(month, day, hour, minute, second, microsecond);
+        entry_count++;
+    }
+    fclose(fp_history);
+
+    qsort(entries, entry_count, sizeof(history_entry), CompareHistoryEntry);
+    offsets = malloc((entry_count + 1) * sizeof(unsigned long long));
+    if (!offsets)
+    {
+        fprintf(stderr, "Out of memory loading history file %s\n", history_filename);
+        exit(ENOMEM);
+    }
+    for (unsigned int first=0, last=0;first<entry_count;first=last)
+    {
+        century *year_century = YearCentury(entries[first].year);
+        struct FrozenTree *history = NULL;
+
+        for (last=first;(last<entry_count) && (entries[last].year == entries[first].year);last++)
+            offsets[last-first] = entries[last].key;
+
+        // FreezeTree only takes a tree, and the bulk load is the linear way to get one from sorted offsets. The tree lives for one year at a
+        // time, so memory peaks at one year's tree next to the frozen years.
+        struct Tree *history_tree = BuildTreeFromSortedBits(offsets, last-first, YearNodeBits());
+        if (year_century && history_tree)
+            history = FreezeTree(history_tree);
+        DestroyTree(history_tree);
+        if (!history)
+        {
+            fprintf(stderr, "Out of memory loading year %d of history file %s\n", entries[first].year, history_filename);
+            exit(ENOMEM);
+        }
+        year_century->history[(entries[first].year+1) % 100] = history;
+        verbose_printf (1, "Preloaded %u timestamps for year %d.\n", last-first, entries[first].year);
+    }
+
+    free(offsets);
+    free(entries);
+    return entry_count;
+}
+
+#ifdef TESTSET_PROFILE
+/* Add up the statistics of every year tree. Returns the number of trees. */
+static unsigned int SumYearTreeStats (TreeStats *total)
+{
+    unsigned int tree_count = 0;
+    memset(total, 0, sizeof(TreeStats));
+
+    for (int i=0;i<CENTURY_INDEX;i++)
+    {
+       for (int j=0;centuries[i] && (j<CENTURY_RANGE);j++)
+       {
+          if (centuries[i]->year[j])
+          {
+             TreeStats year_stats;
+             GetTreeStats(centuries[i]->year[j], &year_stats);
+             total->lookups += year_stats.lookups;
+             total->hits += year_stats.hits;
+             total->inserts += year_stats.inserts;
+             total->rotations += year_stats.rotations;
+             total->recolorings += year_stats.recolorings;
+             total->bytes_allocated += year_stats.bytes_allocated;
+             total->nodes += year_stats.nodes;
+             total->bits_set += year_stats.bits_set;
+             tree_count++;
+          }
+       }
+    }
+    return tree_count;
+}
+#endif // TESTSET_PROFILE
+
+/* Input files are read and parsed by a pool of threads, in chunks of PARSE_CHUNK_LINES lines, while the main thread applies the dedup decisions
+   strictly in file order and then line order (so the result never depends on thread timing) and writes each file's <name>_output.txt. A parse
+   thread stops once PARSE_CHUNKS_AHEAD chunks of its file are waiting, so memory stays bounded however large the inputs are. */
+#define MAX_PARSE_THREADS 16
+#define PARSE_CHUNK_LINES 16384
+#define PARSE_CHUNKS_AHEAD 4
+
+typedef struct parsed_line {
+    size_t text_offset;   // into the chunk's text, until all lines are read, then text points at the line itself
+    char  *text;
+    int    parse_failed;
+    int    year, month, day, hour, minute, second, microsecond, tz_adjusted;
+} parsed_line;
+
+typedef struct parse_chunk {
+    struct parse_chunk *next;
+    char               *text;            // the chunk's lines, each NUL terminated
+    size_t              text_size;
+    parsed_line         lines[PARSE_CHUNK_LINES];
+    unsigned int        line_count;
+} parse_chunk;
+
+typedef struct input_file {
+    char         filename[300];
+    char         output_filename[300];
+    parse_chunk *first_chunk;     // parsed chunks not yet filtered, in file order
+    parse_chunk *last_chunk;
+    unsigned int chunks_waiting;
+    int          open_errno;      // non zero if the file could not be read
+    int          parsed;          // set (under parse_lock) once the last chunk is queued
+} input_file;
+
+static input_file *input_files = NULL;
+static unsigned int input_file_count = 0;
+static unsigned int next_file_to_parse = 0;
+static pthread_mutex_t parse_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t chunk_parsed = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t chunk_taken = PTHREAD_COND_INITIALIZER;
+
+static int AddInputFile (const char *filename)
+{
+    input_file *files = realloc(input_files, (input_file_count + 1) * sizeof(input_file));
+    if (!files)
+        return 0;
+    input_files = files;
+    memset(&input_files[input_file_count], 0, sizeof(input_file));
+    snprintf(input_files[input_file_count].filename, sizeof(input_files[input_file_count].filename), "%s", filename);
+    input_file_count++;
+    return 1;
+}
+
+/* Add the files named by a command line argument, expanding wildcards (in sorted order, as glob gives them). */
+static int AddInputFiles (const char *pattern)
+{
+    glob_t matches;
+    int result = 1;
+
+    if (!strpbrk(pattern, "*?["))
+        return AddInputFile(pattern);
+
+    if (glob(pattern, 0, NULL, &matches) != 0)
+    {
+        fprintf(stderr, "No input files match '%s'.\n", pattern);
+        return 0;
+    }
+    for (size_t idx=0;result && (idx<matches.gl_pathc);idx++)
+        result = AddInputFile(matches.gl_pathv[idx]);
+    globfree(&matches);
+    return result;
+}
+
+/* Name each input's output file after it (path and extension dropped, "_output.txt" added), before anything is filtered. Inputs with the same
+   name in different directories would write over each other's output, so a repeated name gets "_2", "_3", ... added until it is unique. */
+static int NameOutputFiles (void)
+{
+    for (unsigned int file_idx=0;file_idx<input_file_count;file_idx++)
+    {
+        input_file *file = &input_files[file_idx];
+        char base_name[sizeof(file->filename)];
+        unsigned int suffix = 1;
+        int unique = 0;
+
+        // basename may modify its argument (and hand back a pointer into it or static storage), so it works on a copy.
+        snprintf(base_name, sizeof(base_name), "%s", file->filename);
+        char *name = basename(base_name);
+        memmove(base_name, name, strlen(name) + 1);
+        char *output_ext = strrchr(base_name, '.');
+        if (output_ext)
+            *output_ext = 0;
+
+        while (!unique)
+        {
+            int length = (suffix == 1)?snprintf(file->output_filename, sizeof(file->output_filename), "%s_output.txt", base_name):
+                                       snprintf(file->output_filename, sizeof(file->output_filename), "%s_%u_output.txt", base_name, suffix);
+            if ((length < 0) || ((size_t) length >= sizeof(file->output_filename)))
+            {
+                fprintf(stderr, "Output file name for %s is too long.\n", file->filename);
+                return 0;
+            }
+            unique = 1;
+            for (unsigned int other_idx=0;unique && (other_idx<file_idx);other_idx++)
+                unique = (strcmp(input_files[other_idx].output_filename, file->output_filename) != 0);
+            suffix++;
+        }
+        if (suffix > 2)
+            printf ("Output for '%s' would overwrite an earlier input's, it goes to '%s' instead.\n", file->filename, file->output_filename);
+    }
+    return 1;
+}
+
+static void FreeChunk (parse_chunk *chunk)
+{
+    if (chunk)
+    {
+        free(chunk->text);
+        free(chunk);
+    }
+}
+
+/* Read and parse the next lines of the file (up to 254 characters at a time, as the filter always has). Returns NULL at the end of the file,
+   or with file->open_errno set if out of memory. */
+static parse_chunk *ReadChunk (input_file *file, FILE *fp_in)
+{
+    char buffer[255];
+    size_t text_capacity = 0;
+    parse_chunk *chunk = malloc(sizeof(parse_chunk));
+
+    if (!chunk)
+    {
+        file->open_errno = ENOMEM;
+        return NULL;
+    }
+    chunk->next = NULL;
+    chunk->text = NULL;
+    chunk->text_size = 0;
+    chunk->line_count = 0;
+
+    while ((chunk->line_count < PARSE_CHUNK_LINES) && fgets(buffer, 255, fp_in))
+    {
+        unsigned int len = strlen(buffer);
+
+        // remove any extra return lines (and the carriage return of files written on Windows)
+        if ((len>0) && (buffer[len-1]=='\n'))
+           buffer[--len] = 0;
+        if ((len>0) && (buffer[len-1]=='\r'))
+           buffer[--len] = 0;
+
+        if (chunk->text_size + len + 1 > text_capacity)
+        {
+            text_capacity = (text_capacity > 0)?text_capacity*2:(PARSE_CHUNK_LINES * 32);
+            char *text = realloc(chunk->text, text_capacity);
+            if (!text)
+            {
+                file->open_errno = ENOMEM;
+                FreeChunk(chunk);
+                return NULL;
+            }
+            chunk->text = text;
+        }
+
+        parsed_line *line = &chunk->lines[chunk->line_count++];
+        line->text_offset = chunk->text_size;
+        memcpy(chunk->text + chunk->text_size, buffer, len + 1);
+        chunk->text_size += len + 1;
+        line->parse_failed = parse_timestamp(buffer, len, &line->year, &line->month, &line->day, &line->hour, &line->minute, &line->second, &line->microsecond,
+                                             &line->tz_adjusted);
+    }
+
+    if (chunk->line_count == 0)
+    {
+        FreeChunk(chunk);
+        return NULL;
+    }
+    for (unsigned int idx=0;idx<chunk->line_count;idx++)
+        chunk->lines[idx].text = chunk->text + chunk->lines[idx].text_offset;
+    return chunk;
+}
+
+static void *ParseThread (void *arg)
+{
+    (void) arg;
+    for (;;)
+    {
+        pthread_mutex_lock(&parse_lock);
+        unsigned int file_idx = next_file_to_parse++;
+        pthread_mutex_unlock(&parse_lock);
+        if (file_idx >= input_file_count)
+            break;
+
+        // Files are handed out in order, so the file the main thread waits for is always being parsed or done; waiting for it to take
+        // chunks can never hold it up.
+        input_file *file = &input_files[file_idx];
+        FILE *fp_in = fopen(file->filename, "r");
+        parse_chunk *chunk;
+
+        if (!fp_in)
+            file->open_errno = errno;
+        while (fp_in && (chunk = ReadChunk(file, fp_in)))
+        {
+            pthread_mutex_lock(&parse_lock);
+            while (file->chunks_waiting >= PARSE_CHUNKS_AHEAD)
+                pthread_cond_wait(&chunk_taken, &parse_lock);
+            if (file->last_chunk)
+                file->last_chunk->next = chunk;
+            else
+                file->first_chunk = chunk;
+            file->last_chunk = chunk;
+            file->chunks_waiting++;
+            pthread_cond_broadcast(&chunk_parsed);
+            pthread_mutex_unlock(&parse_lock);
+        }
+        if (fp_in)
+            fclose(fp_in);
+
+        pthread_mutex_lock(&parse_lock);
+        file->parsed = 1;
+        pthread_cond_broadcast(&chunk_parsed);
+        pthread_mutex_unlock(&parse_lock);
+    }
+    return NULL;
+}
+
+/* Next chunk of the file from the parse threads, NULL once all of it has been taken. */
+static parse_chunk *TakeChunk (input_file *file)
+{
+    parse_chunk *chunk;
+
+    pthread_mutex_lock(&parse_lock);
+    while (!file->first_chunk && !file->parsed)
+        pthread_cond_wait(&chunk_parsed, &parse_lock);
+    chunk = file->first_chunk;
+    if (chunk)
+    {
+        file->first_chunk = chunk->next;
+        if (!file->first_chunk)
+            file->last_chunk = NULL;
+        file->chunks_waiting--;
+        pthread_cond_broadcast(&chunk_taken);
+    }
+    pthread_mutex_unlock(&parse_lock);
+    return chunk;
+}
+
+// -k: compact the year trees (CompactTree) after each input file.
+static unsigned int compact_between_files = 0;
+
+/* Relocate the nodes of every live year tree into cache friendly order. Years untouched since their last compaction cost nothing.
+   Returns the number of nodes in the compacted trees. */
+static unsigned long long CompactYearTrees (void)
+{
+   unsigned long long nodes = 0;
+
+   for (int i=0;i<CENTURY_INDEX;i++)
+      for (int j=0;centuries[i] && (j<CENTURY_RANGE);j++)
+         if (centuries[i]->year[j])
+            nodes += CompactTree(centuries[i]->year[j]);
+   return nodes;
+}
+
+/* Write a -h histogram as lines of "count timestamps", for each count seen. The top count of the counters also holds every timestamp seen
+   more often, so it is written as "n+". Returns the number of distinct timestamps. */
+static unsigned long long WriteCountHistogram (const char *filename, const unsigned long long *histogram)
+{
+   unsigned int count_max = (1u << count_bits) - 1;
+   unsigned long long distinct = 0;
+   FILE *fp = fopen(filename, "w");
+
+   if (!fp)
+   {
+      fprintf(stderr, "Histogram file %s could not be written:%s\n", filename, strerror(errno));
+      return 0;
+   }
+   for (unsigned int count=1;count<=count_max;count++)
+   {
+      if (histogram[count])
+         fprintf(fp, "%u%s %llu\n", count, (count == count_max)?"+":"", histogram[count]);
+      distinct += histogram[count];
+   }
+   fclose(fp);
+   return distinct;
+}
+
+static int DaysInMonth (int year, int month)
+{
+   static const int days[12] = {31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31};
+   int leap = ((year % 4) == 0) && (((year % 100) != 0) || ((year % 400) == 0));
+   return days[month - 1] + ((month == 2) && leap);
+}
+
+/* Mark every timestamp of a -w window "<start>,<end>" (two timestamps as accepted in the input, inclusive, at the -r resolution) as already
+   seen. Each minute of the window is one SetRange on its year tree, so neither the gaps MakeTSKey leaves between minutes, hours and days nor
+   those between seconds at -r get nodes. Returns the number of minutes marked, or 0 if the window does not parse. */
+static unsigned long long MarkWindowSeen (const char *window)
+{
+   int year[2], month[2], day[2], hour[2], minute[2], second[2], microsecond[2], tz_adjusted;
+   char start[80];
+   char *end;
+   unsigned long long minutes = 0;
+
+   if (strlen(window) >= sizeof(start))
+      return 0;
+   strcpy(start, window);
+   end = strchr(start, ',');
+   if (!end)
+      return 0;
+   *end++ = 0;
+   if (parse_timestamp(start, strlen(start), &year[0], &month[0], &day[0], &hour[0], &minute[0], &second[0], &microsecond[0], &tz_adjusted) ||
+       parse_timestamp(end, strlen(end), &year[1], &month[1], &day[1], &hour[1], &minute[1], &second[1], &microsecond[1], &tz_adjusted))
+      return 0;
+
+   unsigned long long first_key = MakeTSKey(month[0], day[0], hour[0], minute[0], second[0], microsecond[0]);
+   unsigned long long last_key = MakeTSKey(month[1], day[1], hour[1], minute[1], second[1], microsecond[1]);
+   if ((year[0] > year[1]) || ((year[0] == year[1]) && (first_key > last_key)))
+      return 0;
+
+   for (int y=year[0], mo=month[0], d=day[0], h=hour[0], mi=minute[0];;)
+   {
+      unsigned long long minute_first = MakeTSKey(mo, d, h, mi, 0, 0);
+      unsigned long long minute_last = MakeTSKey(mo, d, h, mi, 59, 999999);
+      int last = (y == year[1]) && (minute_last >= last_key);
+
+      // Past the end also stops at an end that is not a calendar date (the time zone adjustment can give day 31 of any month).
+      if ((y > year[1]) || ((y == year[1]) && (minute_first > last_key)))
+         break;
+      century *year_century = YearCentury(y);
+      struct Tree *year_tree = (year_century)?LiveYearTree(year_century, (y+1) % 100):NULL;
+      if (!year_tree)
+         return 0;
+      SetRange(year_tree, (minutes == 0)?first_key:minute_first, (last)?last_key:minute_last, 1);
+      minutes++;
+      if (last)
+         break;
+
+      if (++mi > 59)
+      {
+         mi = 0;
+         if (++h > 23)
+         {
+            h = 0;
+            if (++d > DaysInMonth(y, mo))
+            {
+               d = 1;
+               if (++mo > 12)
+               {
+                  mo = 1;
+                  y++;
+               }
+            }
+         }
+      }
+   }
+   return minutes;
+}
+
+/* Node widths a year tree can be tuned to (-a), narrowest (YearNodeBits) first: each covers one more field of MakeTSKey (a second, a minute,
+   an hour, ...), so every offset of a field's unit lies inside one window. Widths past MAX_BITMAP_PER_NODE are left out. Returns the count. */
+static unsigned int YearNodeWidths (unsigned int *widths)
+{
+   unsigned int field_bits[5], field_max[5], field_count = 0, shift = 0, count = 0;
+   unsigned long long last_offset = 0;
+
+   if (fraction_digits > 0)
+   {
+      field_bits[field_count] = fraction_node_bits;
+      field_max[field_count++] = fraction_node_units - 1;
+      if (fraction_high_bits)
+      {
+         unsigned int high_units = 1;
+         for (unsigned int idx=3;idx<fraction_digits;idx++)
+            high_units *= 10;
+         field_bits[field_count] = fraction_high_bits;
+         field_max[field_count++] = high_units - 1;
+      }
+   }
+   field_bits[field_count] = 6;    // second
+   field_max[field_count++] = 59;
+   field_bits[field_count] = 6;    // minute
+   field_max[field_count++] = 59;
+   field_bits[field_count] = 5;    // hour
+   field_max[field_count++] = 23;
+
+   for (unsigned int idx=0;(idx<field_count) && (count<TREE_TUNE_MAX_WIDTHS);idx++)
+   {
+      last_offset += (unsigned long long) field_max[idx] << shift;
+      shift += field_bits[idx];
+      if (last_offset + 1 >= MAX_BITMAP_PER_NODE)
+         break;
+      widths[count++] = (unsigned int) (last_offset + 1);
+   }
+   return count;
+}
+
+/* -a sample of the input: timestamps in input order, grouped per year for TuneTree. */
+#define TUNE_DEFAULT_SAMPLES 10000
+
+typedef struct tune_entry {
+   int year;
+   unsigned int order;
+   unsigned long long key;
+} tune_entry;
+
+static int CompareTuneEntry (const void *a, const void *b)
+{
+   const tune_entry *entry_a = a;
+   const tune_entry *entry_b = b;
+
+   if (entry_a->year != entry_b->year)
+      return (entry_a->year < entry_b->year)?-1:1;
+   return (entry_a->order > entry_b->order) - (entry_a->order < entry_b->order);
+}
+
+/* Tune the year trees (-a) from the first sample_target timestamps of the input plus any -p history, before filtering starts: each year in
+   the sample or the history gets a tree created with its own tuning, expecting its share of the timestamps projected for all the input
+   (from the input's size and the sampled bytes per timestamp). Other years later take the tuning of the year with the most samples.
+   Returns the number of year trees created. */
+static unsigned int TuneYearTrees (unsigned int sample_target, unsigned int *sampled)
+{
+   unsigned int widths[TREE_TUNE_MAX_WIDTHS];
+   unsigned int width_count = YearNodeWidths(widths);
+   tune_entry *entries = malloc((size_t) sample_target * sizeof(tune_entry));
+   unsigned long long *offsets = malloc(((size_t) sample_target + 1) * sizeof(unsigned long long));
+   unsigned int entry_count = 0, tuned = 0, busiest = 0;
+   unsigned long long input_bytes = 0, sampled_bytes = 0;
+   char buffer[255];
+   int year, month, day, hour, minute, second, microsecond, tz_adjusted;
+
+   *sampled = 0;
+   if (!entries || !offsets)
+   {
+      fprintf(stderr, "Out of memory for a sample of %u timestamps.\n", sample_target);
+      exit(ENOMEM);
+   }
+
+   for (unsigned int file_idx=0;file_idx<input_file_count;file_idx++)
+   {
+      struct stat file_stat;
+      FILE *fp_in;
+
+      if (stat(input_files[file_idx].filename, &file_stat) == 0)
+         input_bytes += (unsigned long long) file_stat.st_size;
+      fp_in = (entry_count < sample_target)?fopen(input_files[file_idx].filename, "r"):NULL;
+      while (fp_in && (entry_count < sample_target) && fgets(buffer, sizeof(buffer), fp_in))
+      {
+         unsigned int len = strlen(buffer);
+         sampled_bytes += len;
+         if ((len>0) && (buffer[len-1]=='\n'))
+            buffer[--len] = 0;
+         if ((len>0) && (buffer[len-1]=='\r'))
+            buffer[--len] = 0;
+         if (parse_timestamp(buffer, len, &year, &month, &day, &hour, &minute, &second, &microsecond, &tz_adjusted))
+            continue;
+         entries[entry_count].year = year;
+         entries[entry_count].order = entry_count;
+         entries[entry_count].key = MakeTSKey(month, day, hour, minute, second, microsecond);
+         entry_count++;
+      }
+      if (fp_in)
+         fclose(fp_in);
+   }
+   *sampled = entry_count;
+
+   // Timestamps the whole input holds, at the sample's bytes per timestamp (the sample itself if it took all of the input).
+   unsigned long long expected = entry_count;
+   if ((entry_count > 0) && (sampled_bytes < input_bytes))
+      expected = (unsigned long long) ((double) input_bytes * entry_count / sampled_bytes);
+
+   qsort(entries, entry_count, sizeof(tune_entry), CompareTuneEntry);
+   for (unsigned int first=0, last=0;first<entry_count;first=last)
+   {
+      century *year_century = YearCentury(entries[first].year);
+      int year_idx = (entries[first].year+1) % 100;
+      TreeTuningHints hints = {widths, width_count, offsets, 0, NULL, 0, YearTreeOptions()};
+      TreeTuning tuning;
+
+      for (last=first;(last<entry_count) && (entries[last].year == entries[first].year);last++)
+         offsets[last-first] = entries[last].key;
+      if (!year_century || year_century->year[year_idx])
+         continue;
+      hints.sample_count = last - first;
+      hints.sample_frozen = year_century->history[year_idx];
+      hints.expected_offsets = (unsigned long long) ((double) expected * (last - first) / entry_count);
+      if (!TuneTree(&hints, &tuning))
+         continue;
+      year_century->year[year_idx] = CreateYearTree(NULL, &tuning);
+      tuned += (year_century->year[year_idx] != NULL);
+      if (last - first > busiest)
+      {
+         busiest = last - first;
+         fallback_tuning = tuning;
+         fallback_tuned = 1;
+      }
+   }
+
+   // Years only in the history are tuned from it alone.
+   for (int i=0;i<CENTURY_INDEX;i++)
+   {
+      for (int j=0;centuries[i] && (j<CENTURY_RANGE);j++)
+      {
+         TreeTuningHints hints = {widths, width_count, NULL, 0, centuries[i]->history[j], 0, YearTreeOptions()};
+         TreeTuning tuning;
+
+         if (!centuries[i]->history[j] || centuries[i]->year[j] || !TuneTree(&hints, &tuning))
+            continue;
+         centuries[i]->year[j] = CreateYearTree(NULL, &tuning);
+         tuned += (centuries[i]->year[j] != NULL);
+         if (!fallback_tuned)
+         {
+            fallback_tuning = tuning;
+            fallback_tuned = 1;
+         }
+      }
+   }
+
+   free(offsets);
+   free(entries);
+   return tuned;
+}
+
+static double NowSeconds (void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double) now.tv_sec + ((double) now.tv_nsec / 1e9);
+}
+
 int main (int argc , char **argv)
 {
-    FILE *fp_in;
     FILE *fp_out;
-    char buffer[255];
-    char input_filename[300]="test.txt";
-    char output_filename[300] = "output.txt";
-    int year, month, day, hour, minute, second, tz_adjusted;
+    char *history_filename = NULL;
+    char *histogram_filename = NULL;
+    char *trace_filename = NULL;
+    char *window = NULL;
+    unsigned int tune_sample_target = 0;
+    unsigned int parse_threads = 0;
+    pthread_t threads[MAX_PARSE_THREADS];
 
     unsigned int ts_handled = 0;
     unsigned int duplicates_found = 0;
@@ -238,7 +1206,8 @@ int main (int argc , char **argv)
     for (int i = 1;i < argc; i++) {
         if (argv[i][0] != '-')
         {
-           strcpy (input_filename, argv[i]);
+           if (!AddInputFiles(argv[i]))
+               exit(ENOENT);
         }
         else
         {
@@ -247,113 +1216,256 @@ int main (int argc , char **argv)
                 verbose_enabled = (unsigned int) (argv[i][2] - '0');
 
             }
+            else if (argv[i][1] == 'p')
+            {
+                history_filename = &argv[i][2];
+            }
+            else if (argv[i][1] == 'j')
+            {
+                parse_threads = (unsigned int) strtoul(&argv[i][2], NULL, 10);
+            }
+            else if (argv[i][1] == 'm')
+            {
+                tree_memory_budget = (size_t) strtoull(&argv[i][2], NULL, 10) * 1024 * 1024;
+            }
+            else if (argv[i][1] == 'k')
+            {
+                compact_between_files = 1;
+            }
+            else if (argv[i][1] == 'r')
+            {
+                SetFractionDigits((unsigned int) strtoul(&argv[i][2], NULL, 10));
+            }
+            else if (argv[i][1] == 'c')
+            {
+                year_cache_cap = (size_t) strtoull(&argv[i][2], NULL, 10) * 1024 * 1024;
+            }
+            else if (argv[i][1] == 'h')
+            {
+                histogram_filename = &argv[i][2];
+                if (!count_bits)
+                    count_bits = 8;
+            }
+            else if (argv[i][1] == 'b')
+            {
+                count_bits = (unsigned int) strtoul(&argv[i][2], NULL, 10);
+            }
+            else if (argv[i][1] == 't')
+            {
+                trace_filename = &argv[i][2];
+            }
+            else if (argv[i][1] == 'w')
+            {
+                window = &argv[i][2];
+            }
+            else if (argv[i][1] == 'a')
+            {
+                tune_sample_target = (argv[i][2])?(unsigned int) strtoul(&argv[i][2], NULL, 10):TUNE_DEFAULT_SAMPLES;
+                if (tune_sample_target == 0)
+                    tune_sample_target = TUNE_DEFAULT_SAMPLES;
+            }
         }
     }
 
+    if ((input_file_count == 0) && !AddInputFile("test.txt"))
+        exit(ENOMEM);
+    if (!NameOutputFiles())
+        exit(ENAMETOOLONG);
+
+    if (count_bits && ((count_bits != 4) && (count_bits != 8)))
+    {
+        printf ("-b%u: counters of 4 or 8 bits are supported.\n", count_bits);
+        exit(EINVAL);
+    }
+    if (count_bits && !histogram_filename)
+        histogram_filename = "histogram.txt";
+    if (count_bits && window)
+    {
+        printf ("-w cannot be combined with counting (-h, -b): a window has no occurrences to count.\n");
+        exit(EINVAL);
+    }
+
     if (verbose_enabled > 0)
     {
        printf ("Verbose level set to %d\n", verbose_enabled);
        SetTSVerbose(verbose_enabled);
     }
 
-    fp_in=fopen(input_filename, "r");
+    // Each thread traces into its own ring, saved once the parse threads are done.
+    if (trace_filename)
+        TreeTraceStart(0);
 
-    if (!fp_in)
+    if (history_filename)
     {
-        fprintf(stderr, "Input file %s cannot be opened:%s\n", input_filename, strerror(errno));
-        exit(errno);
+        printf ("Preloaded %u timestamps from history file '%s'.\n", PreloadHistory(history_filename), history_filename);
     }
 
-    strcpy(output_filename, basename(input_filename));
-    char *output_ext = strrchr(output_filename, '.');
-    if (output_ext)
-        *output_ext = 0;
-    strcat(output_filename, "_output.txt");
-     printf ("Filtering file '%s' into '%s'.\n", input_filename, output_filename);
-
-    fp_out = fopen (output_filename, "w");
+    if (tune_sample_target)
+    {
+        unsigned int sampled;
+        unsigned int tuned = TuneYearTrees(tune_sample_target, &sampled);
+        printf ("Tuned %u year trees from %u sampled timestamps", tuned, sampled);
+        if (fallback_tuned)
+            printf (", other years get %u bits per node%s", fallback_tuning.bitmap_size_per_node,
+                    (fallback_tuning.flags & TREE_OPTION_HASH_INDEX)?" and a hash index":"");
+        printf (".\n");
+    }
 
-    if (!fp_out)
+    if (window)
     {
-       fprintf(stderr, "Output file test_output.txt failed to open!\n");
-       exit(errno);
+        unsigned long long minutes = MarkWindowSeen(window);
+        if (minutes == 0)
+        {
+            printf ("-w%s: expected two timestamps <start>,<end> with start not after end.\n", window);
+            exit(EINVAL);
+        }
+        printf ("Marked %llu minutes from -w%s as seen.\n", minutes, window);
+    }
 
+    if (parse_threads == 0)
+    {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        parse_threads = (cpus > 0)?(unsigned int) cpus:1;
     }
-    printf ("\n");
+    if (parse_threads > input_file_count)
+        parse_threads = input_file_count;
+    if (parse_threads > MAX_PARSE_THREADS)
+        parse_threads = MAX_PARSE_THREADS;
 
     // Used to measure rough duration of test only.
-    clock_t start_time = clock();
+    double start_time = NowSeconds();
 
-    while (fgets(buffer, 255, (FILE*)fp_in))
+    for (unsigned int idx=0;idx<parse_threads;idx++)
     {
-        int parse_failed = 0;
-        unsigned int len = strlen(buffer);
+        if (pthread_create(&threads[idx], NULL, ParseThread, NULL) != 0)
+        {
+            parse_threads = idx;
+            break;
+        }
+    }
 
-        lines_in_file++;
+    for (unsigned int file_idx=0;file_idx<input_file_count;file_idx++)
+    {
+        input_file *file = &input_files[file_idx];
+        FILE *fp_in = NULL;
+        parse_chunk *chunk;
 
-        // remove any extra return lines
-        if ((len>0) && (buffer[len-1]=='\n'))
+        if (parse_threads > 0)
+        {
+            chunk = TakeChunk(file);
+        }
+        else
+        {
+            fp_in = fopen(file->filename, "r");
+            if (!fp_in)
+                file->open_errno = errno;
+            chunk = (fp_in)?ReadChunk(file, fp_in):NULL;
+        }
+
+        if (file->open_errno)
         {
-           buffer[len-1] = 0;
-           len--;
+            fprintf(stderr, "Input file %s cannot be opened:%s\n", file->filename, strerror(file->open_errno));
+            exit(file->open_errno);
         }
 
-        verbose_printf (1, "Buffer read:%s\n", buffer);
+        printf ("Filtering file '%s' into '%s'.\n", file->filename, file->output_filename);
 
-        parse_failed = parse_timestamp(buffer, len, &year, &month, &day, &hour, &minute, &second, &tz_adjusted);
+        fp_out = fopen (file->output_filename, "w");
 
-        if (!parse_failed)
+        if (!fp_out)
         {
+           fprintf(stderr, "Output file %s failed to open!\n", file->output_filename);
+           exit(errno);
 
-            verbose_printf (2,"year:%d month:%d day:%d, hour:%d minute:%d, second:%d (adjusted=%s)\n", year, month, day, hour, minute, second, (tz_adjusted !=0)?"true":"false");
-
-            ts_handled++;
+        }
 
-            // Check if the absolute timestamp has been seen before printing to output file
-            if (CheckInsertTSPresent(year, month, day, hour, minute, second) == 1)
+        for (;chunk;FreeChunk(chunk), chunk = (parse_threads > 0)?TakeChunk(file):ReadChunk(file, fp_in))
+        {
+            for (unsigned int line_idx=0;line_idx<chunk->line_count;line_idx++)
             {
-               if (!tz_adjusted)
-                  verbose_printf (1,"Duplicate '%s' found, discarding (key=%d).\n", buffer, MakeKey (month, day,hour, minute, second));
-               else
-                  verbose_printf (1, "Duplicate '%s' found, discarding (%04d-%02d-%02dT%02d:%02d:%02dZ normalized, key=%d).\n", buffer, year, month, day, hour, minute, second, MakeKey (month, day,hour, minute, second));
+                parsed_line *line = &chunk->lines[line_idx];
+                char *buffer = line->text;
 
-               duplicates_found++;
-            }
-            else
-            {
-               fprintf (fp_out, "%s\n", buffer);
-               if (!tz_adjusted)
-                  verbose_printf (1, "NewEntry: '%s' added to output file (key=%d).\n", buffer, MakeKey (month, day,hour, minute, second));
-               else
-                  verbose_printf (1, "NewEntry: '%s' added to output file (%04d-%02d-%02dT%02d:%02d:%02dZ normalized, key=%d).\n", buffer, year, month, day, hour, minute, second, MakeKey (month, day,hour, minute, second));
+                lines_in_file++;
 
-               written_to_file++;
-            }
+                if (!line->parse_failed)
+                {
+                    ts_handled++;
+
+                    // Check if the absolute timestamp has been seen (in this or any earlier file) before printing to output file
+                    if (CheckInsertTSPresent(line->year, line->month, line->day, line->hour, line->minute, line->second, line->microsecond) == 1)
+                    {
+                       TREE_TRACE(TREE_TRACE_LINE, MakeTSKey(line->month, line->day, line->hour, line->minute, line->second, line->microsecond),
+                                  (unsigned int) line->year, 1);
+                       duplicates_found++;
+                    }
+                    else
+                    {
+                       fprintf (fp_out, "%s\n", buffer);
+                       TREE_TRACE(TREE_TRACE_LINE, MakeTSKey(line->month, line->day, line->hour, line->minute, line->second, line->microsecond),
+                                  (unsigned int) line->year, 0);
+                       written_to_file++;
+                    }
 
+                }
+                else
+                {
+                    TREE_TRACE(TREE_TRACE_LINE, 0, 0, 2);
+                    parse_failures++;
+                }
+                verbose_printf(1, "Processing done.\n====================\n");
+            }
         }
-        else
+        fclose(fp_out);
+        if (compact_between_files)
         {
-            verbose_printf (1, "Item '%s' failed parse, discarded.\n", buffer);
-            parse_failures++;
+            double compact_start = NowSeconds();
+            unsigned long long compacted = CompactYearTrees();
+            verbose_printf(1, "Compacted %llu year tree nodes in %f s after %s.\n", compacted, NowSeconds() - compact_start, file->filename);
+        }
+        if (fp_in)
+            fclose(fp_in);
+        if (file->open_errno)
+        {
+            fprintf(stderr, "Input file %s could not be read:%s\n", file->filename, strerror(file->open_errno));
+            exit(file->open_errno);
         }
-        verbose_printf(1, "Processing done.\n====================\n");
     }
-    clock_t stop_time = clock();
-    double run_time = (double) (stop_time - start_time) / CLOCKS_PER_SEC;
+    double run_time = NowSeconds() - start_time;
+    printf ("\n");
     verbose_printf (2,"\n\nEOF\n");
 
-    fclose(fp_in);
-    fclose(fp_out);
+    for (unsigned int idx=0;idx<parse_threads;idx++)
+        pthread_join(threads[idx], NULL);
+    free(input_files);
+
+    if (trace_filename)
+    {
+        TreeTraceStop();
+        unsigned long long traced = TreeTraceSave(trace_filename);
+        if (traced)
+            printf ("Trace of %llu records written to %s (decode with TreeTraceDump).\n", traced, trace_filename);
+        TreeTraceRelease();
+    }
 
 #ifdef TESTSET_PROFILE
-    printf ("DataFilter: RunTime:%f Mem Usage: %Iu TS Mem Usage:%Iu for %d nodes in system in %d trees.\n (%d lines of input => %d failed parse, %d ts parsed => %d written to file, %d discarded).\n",
-            run_time, memory_usage, GetTSMemory(), GetTSNodes(), GetTSTrees(),
+    TreeStats ts_stats;
+    unsigned int ts_trees = SumYearTreeStats(&ts_stats);
+    printf ("DataFilter: RunTime:%f Mem Usage: %lu TS Mem Usage:%lu for %u nodes in system in %u trees.\n (%d lines of input => %d failed parse, %d ts parsed => %d written to file, %d discarded).\n",
+            run_time, (unsigned long) memory_usage, (unsigned long) ts_stats.bytes_allocated, ts_stats.nodes, ts_trees,
             lines_in_file, parse_failures, ts_handled, written_to_file, duplicates_found);
+    printf (" TS lookups:%llu hits:%llu inserts:%llu rotations:%llu recolorings:%llu\n", ts_stats.lookups, ts_stats.hits, ts_stats.inserts, ts_stats.rotations, ts_stats.recolorings);
 #else
     printf ("DataFilter: RunTime: %f \n %d lines of input => %d failed parse, %d ts parsed => %d written to file, %d discarded).\n", run_time, lines_in_file, parse_failures, ts_handled, written_to_file, duplicates_found);
 
 #endif // TESTSET_PROFILE
 
+    size_t history_bytes = 0;
+    unsigned int history_years = 0;
+    size_t cold_bytes = 0;
+    unsigned int cold_years = 0;
+    unsigned long long cold_hits = 0, cold_evictions = 0, cold_rehydrations = 0;
+    unsigned long long histogram[TREE_COUNT_HISTOGRAM_SIZE] = {0};
     int print_once = 0;
     for (int i=0;i<CENTURY_INDEX;i++)
     {
@@ -373,9 +1485,38 @@ int main (int argc , char **argv)
 
                 }
 
+                if (count_bits)
+                   GetCountHistogram(centuries[i]->year[j], histogram);
                 DestroyTree(centuries[i]->year[j]);
 
              }
+             if (year_cache_cap && centuries[i]->stats[j].lookups)
+             {
+                year_stats *stats = &centuries[i]->stats[j];
+                verbose_printf(1, "Year %d: %llu lookups, %llu answered cold, %u evictions, %u rehydrations.\n", ((i*100)+j)-1,
+                               stats->lookups, stats->blob_hits, stats->evictions, stats->rehydrations);
+                cold_hits += stats->blob_hits;
+                cold_evictions += stats->evictions;
+                cold_rehydrations += stats->rehydrations;
+             }
+             if (centuries[i]->cold[j])
+             {
+                if (count_bits)
+                {
+                   struct Tree *thawed = ThawTree(centuries[i]->cold[j], NULL);
+                   GetCountHistogram(thawed, histogram);
+                   DestroyTree(thawed);
+                }
+                cold_bytes += FrozenTreeBytes(centuries[i]->cold[j]);
+                cold_years++;
+                DestroyFrozenTree(centuries[i]->cold[j]);
+             }
+             if (centuries[i]->history[j])
+             {
+                history_bytes += FrozenTreeBytes(centuries[i]->history[j]);
+                history_years++;
+                DestroyFrozenTree(centuries[i]->history[j]);
+             }
           }
           free(centuries[i]);
           #ifdef TESTSET_PROFILE
@@ -384,10 +1525,20 @@ int main (int argc , char **argv)
        }
     }
 
+    if (count_bits)
+        printf ("Occurrence histogram of %llu distinct timestamps (%u bit counters) written to %s.\n",
+                WriteCountHistogram(histogram_filename, histogram), count_bits, histogram_filename);
+    if (history_years > 0)
+        printf ("History held frozen for %u years in %lu bytes.\n", history_years, (unsigned long) history_bytes);
+    if (year_cache_cap)
+        printf ("Cold years: %llu evictions, %llu rehydrations, %llu duplicates answered cold, %u years left cold in %lu bytes.\n",
+                cold_evictions, cold_rehydrations, cold_hits, cold_years, (unsigned long) cold_bytes);
+
 #ifdef TESTSET_PROFILE
-    printf ("After destroying memory - DataFilter Mem Usage: %Iu TS Mem Usage: %Iu for %d nodes in system. \n", memory_usage, GetTSMemory(), GetTSNodes());
+    printf ("After destroying memory - DataFilter Mem Usage: %lu\n", (unsigned long) memory_usage);
 #endif
 
     return 0;
 }
 
+#endif // DATEFILTER_NO_MAIN
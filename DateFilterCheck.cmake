@@ -0,0 +1,48 @@
+# DateFilterCheck - run DateFilter on inputs from the source tree and compare its output files with expected ones (ctest, see CMakeLists.txt).
+#
+#   cmake -DDATEFILTER=<DateFilter> -DSOURCE_DIR=<dir> -DWORK_DIR=<dir> -DINPUTS=<source>=<copy>|... -DARGS=<arg>|...
+#         -DCOMPARE=<output>=<expected>|... -P DateFilterCheck.cmake
+#
+# Inputs are copied into a fresh WORK_DIR (under the name after '=', which may include a directory) and DateFilter runs there, so the
+# outputs it names after them land in WORK_DIR. Lists are separated by '|' to survive add_test.
+
+foreach(required DATEFILTER SOURCE_DIR WORK_DIR INPUTS COMPARE)
+    if(NOT DEFINED ${required})
+        message(FATAL_ERROR "DateFilterCheck: ${required} is not set")
+    endif()
+endforeach()
+
+file(REMOVE_RECURSE "${WORK_DIR}")
+file(MAKE_DIRECTORY "${WORK_DIR}")
+
+string(REPLACE "|" ";" input_list "${INPUTS}")
+foreach(input ${input_list})
+    string(REPLACE "=" ";" input_pair "${input}")
+    list(GET input_pair 0 input_source)
+    list(GET input_pair 1 input_copy)
+    get_filename_component(input_copy_dir "${WORK_DIR}/${input_copy}" DIRECTORY)
+    file(MAKE_DIRECTORY "${input_copy_dir}")
+    configure_file("${SOURCE_DIR}/${input_source}" "${WORK_DIR}/${input_copy}" COPYONLY)
+endforeach()
+
+string(REPLACE "|" ";" arg_list "${ARGS}")
+execute_process(COMMAND "${DATEFILTER}" ${arg_list}
+                WORKING_DIRECTORY "${WORK_DIR}"
+                RESULT_VARIABLE result
+                OUTPUT_VARIABLE output
+                ERROR_VARIABLE output)
+if(NOT result EQUAL 0)
+    message(FATAL_ERROR "DateFilter ${arg_list} exited with ${result}:\n${output}")
+endif()
+
+string(REPLACE "|" ";" compare_list "${COMPARE}")
+foreach(compare ${compare_list})
+    string(REPLACE "=" ";" compare_pair "${compare}")
+    list(GET compare_pair 0 output_file)
+    list(GET compare_pair 1 expected_file)
+    execute_process(COMMAND "${CMAKE_COMMAND}" -E compare_files "${WORK_DIR}/${output_file}" "${SOURCE_DIR}/${expected_file}"
+                    RESULT_VARIABLE different)
+    if(different)
+        message(FATAL_ERROR "DateFilter ${arg_list}: ${output_file} differs from ${expected_file}\n${output}")
+    endif()
+endforeach()
@@ -1,37 +1,110 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
+#include <string.h>
+#include <math.h>
+#include <stdatomic.h>
+#ifdef _WIN32
 #include <direct.h>
+#include <process.h>
+#define getpid _getpid
+#else
+#include <unistd.h>
+#endif
 #include "TreeSet.h"
+#include "TreeTrace.h"
 
 #define BLACK 0
 #define RED 1
 
 static unsigned int verbose_enabled = 0;
 
+// Hot path counters in TreeStats are only maintained when TESTSET_PROFILE is defined, so they cost nothing otherwise.
 #ifdef TESTSET_PROFILE
-static size_t memory_usage = 0;
-static unsigned int total_nodes = 0;
-static unsigned int total_trees = 0;
+#define TREE_STAT(statement) statement
+#else
+#define TREE_STAT(statement)
 #endif
 
+// sizes for spill mode (TREE_OPTION_SPILL), see SpillTree
+#define SPILL_PAGE_BYTES  4096
+#define SPILL_CACHE_PAGES 32
+#define SPILL_MAX_RUNS    8
+
 typedef struct TreeNode {
     struct TreeNode *left;
     struct TreeNode *right;
     struct TreeNode *parent;
-    unsigned int     key;         // upper N-bitmap_size_per_node of bitmap offset
+    unsigned long long key;       // upper 64-bitmap_idx_size bits of bitmap offset
     unsigned int     RedBlack:1;
+    unsigned int     InBlock:1;   // node (and its payload) live inside a TreeBlock rather than their own allocations.
+    unsigned int     refs;        // TREE_OPTION_SNAPSHOTS: number of parents and versions pointing at this node (only touched by the writer)
     unsigned char   *payload;     //will be dynamically allocated as a byte array big enough to contain bitmap_size_in_bytes in the node.
 } TreeNode;
 
+/* Immutable published state of a TREE_OPTION_SNAPSHOTS tree, see TreeSnapshot. */
+typedef struct TreeVersion {
+    struct Tree        *tree;
+    struct TreeNode    *root;
+    int                 size;
+    atomic_uint         refs;          // readers holding it, plus one while it is the tree's published version
+    struct TreeVersion *next_retired;
+} TreeVersion;
+
+/* Contiguous allocation holding many nodes followed by their payloads (see BuildTreeFromSorted). Blocks are chained
+   off the tree and released in one go by DestroyTree. */
+typedef struct TreeBlock {
+    struct TreeBlock *next;
+    size_t            size;
+} TreeBlock;
+
 typedef struct Tree {
     int size;
     unsigned int bitmap_size_per_node;
     unsigned int bitmap_size_in_bytes;
     unsigned int bitmap_idx_size;
+    unsigned long long sub_bit_mask; // (1 << bitmap_idx_size) - 1, so splitting an offset is one shift and one and.
+    unsigned int counter_bits;       // bits per offset in a payload, 1 for a bitmap or 4 or 8 with TREE_OPTION_COUNTERS
     TreeNode *root;
+    TreeNode *finger;     // last node found or inserted, where the next search starts looking (see FingerSearch)
+    TreeNode *rightmost;  // node with the largest key
+    TreeBlock *blocks;
+    int compacted;        // every node is still where CompactTree laid it out
+    unsigned int options;               // TREE_OPTION_ flags the tree was created with
+    unsigned long long *bloom;          // TREE_OPTION_BLOOM_FILTER: BLOOM_BLOCK_WORDS words per block, 64 byte aligned inside bloom_memory
+    void *bloom_memory;
+    size_t bloom_memory_size;
+    unsigned long long bloom_block_mask;
+    unsigned char *hash_control;        // TREE_OPTION_HASH_INDEX: a control byte per slot (HASH_EMPTY or the key's hash tag), 64 byte aligned in hash_memory
+    TreeNode **hash_slots;              // node of each used slot, after the control bytes
+    void *hash_memory;
+    size_t hash_memory_size;
+    size_t hash_capacity;               // slots, a power of two no smaller than HASH_MIN_CAPACITY
+    size_t hash_used;
+    struct TreeVersion *published;              // TREE_OPTION_SNAPSHOTS: version handed out by TreeSnapshot
+    atomic_flag publish_lock;                   // guards published while it is read with its refs bumped, or swapped
+    struct TreeVersion *_Atomic retired;        // versions released by readers, freed by the writer on its next publish
+    size_t memory_budget;                       // TREE_OPTION_SPILL: node and bitmap bytes above which SpillTree runs
+    char *spill_directory;                      // where run files go, NULL for tmpfile()
+    struct SpillRun *spill_runs;                // newest first
+    unsigned int spill_run_count;
+    unsigned int spill_run_id;                  // numbers this tree's run files in spill_directory
+    struct SpillPage *spill_cache;
+    unsigned int spill_cache_pages;             // at most SPILL_CACHE_PAGES, and no more than a quarter of memory_budget
+    unsigned long long spill_tick;
+    TreeAllocator allocator;                    // allocate NULL for malloc and free
+    TreeTuning *tuning;                         // CreateTreeFromTuning: how the width and flags were chosen, for TreeInfo
+    TreeStats stats;  // bytes_allocated is always kept, the counters only with TESTSET_PROFILE.
 } Tree;
 
+static void ReleaseNodeRef (Tree *tree, TreeNode *node);
+static void ReclaimVersions (Tree *tree);
+static TreeNode *SnapshotFindOrInsertNode (Tree *tree, unsigned long long key);
+static const unsigned char *SpillFindRecord (Tree *tree, unsigned long long key);
+static void SpillIfOverBudget (Tree *tree);
+static void SpillRelease (Tree *tree);
+static void CollectNodes (TreeNode *node, TreeNode **nodes, unsigned int *count);
+
 
 /* Utilities*/
 
@@ -45,27 +118,276 @@ static void verbose_printf (int level, const char *format, ...)
     }
 };
 
-static void *memory_allocate (size_t size)
+static void *memory_allocate (Tree *tree, size_t size)
 {
-   void *mem_request = malloc(size);
-   #ifdef TESTSET_PROFILE
-   if (mem_request)
-      memory_usage += size;
-   #endif
+   void *mem_request = (tree && tree->allocator.allocate)?tree->allocator.allocate(tree->allocator.context, size):malloc(size);
+   if (mem_request && tree)
+      tree->stats.bytes_allocated += size;
    return mem_request;
 };
 
-static void memory_free (void *memory_to_free, size_t size)
+static void memory_free (Tree *tree, void *memory_to_free, size_t size)
 {
    if (memory_to_free)
    {
-      #ifdef TESTSET_PROFILE
-      memory_usage -= size;
-      #endif
-      free(memory_to_free);
+      if (tree)
+         tree->stats.bytes_allocated -= size;
+      if (tree && tree->allocator.release)
+         tree->allocator.release(tree->allocator.context, memory_to_free, size);
+      else
+         free(memory_to_free);
+   }
+}
+
+/* BloomHash, BloomMayContain, BloomAdd - Blocked Bloom filter over node keys. Each key maps to one 512 bit (cache line) block and sets
+   BLOOM_PROBES bits inside it, so a lookup for a key that was never inserted is usually rejected after touching a single cache line
+   instead of descending the tree. Sized at BLOOM_BITS_PER_KEY bits per expected node, rounded up to a power of two blocks. */
+#define BLOOM_BLOCK_WORDS 8
+#define BLOOM_PROBES 6
+#define BLOOM_BITS_PER_KEY 12
+
+static unsigned long long BloomHash (unsigned long long key)
+{
+   // splitmix64 finaliser - keys are often small consecutive integers, so they need a full mix.
+   key += 0x9e3779b97f4a7c15ULL;
+   key = (key ^ (key >> 30)) * 0xbf58476d1ce4e5b9ULL;
+   key = (key ^ (key >> 27)) * 0x94d049bb133111ebULL;
+   return key ^ (key >> 31);
+}
+
+static int BloomMayContain (Tree *tree, unsigned long long key)
+{
+   unsigned long long hash = BloomHash(key);
+   unsigned long long *block = tree->bloom + ((hash & tree->bloom_block_mask) * BLOOM_BLOCK_WORDS);
+   unsigned long long probes = BloomHash(hash);
+
+   for (unsigned int idx=0;idx<BLOOM_PROBES;idx++, probes >>= 9)
+   {
+      unsigned int bit = (unsigned int) (probes & 511);
+      if (!(block[bit / 64] & (1ULL << (bit % 64))))
+         return 0;
+   }
+   return 1;
+}
+
+static void BloomAdd (Tree *tree, unsigned long long key)
+{
+   unsigned long long hash = BloomHash(key);
+   unsigned long long *block = tree->bloom + ((hash & tree->bloom_block_mask) * BLOOM_BLOCK_WORDS);
+   unsigned long long probes = BloomHash(hash);
+
+   for (unsigned int idx=0;idx<BLOOM_PROBES;idx++, probes >>= 9)
+   {
+      unsigned int bit = (unsigned int) (probes & 511);
+      block[bit / 64] |= (1ULL << (bit % 64));
+   }
+}
+
+static int BloomCreate (Tree *tree, unsigned long long expected_nodes)
+{
+   unsigned long long blocks = 1;
+   while ((blocks * BLOOM_BLOCK_WORDS * 64) < (expected_nodes * BLOOM_BITS_PER_KEY))
+      blocks <<= 1;
+
+   tree->bloom_memory_size = (size_t) (blocks * BLOOM_BLOCK_WORDS * sizeof(unsigned long long)) + 64;
+   tree->bloom_memory = memory_allocate(tree, tree->bloom_memory_size);
+   if (!tree->bloom_memory)
+      return 0;
+   memset(tree->bloom_memory, 0, tree->bloom_memory_size);
+   tree->bloom = (unsigned long long *) (((size_t) tree->bloom_memory + 63) & ~((size_t) 63));
+   tree->bloom_block_mask = blocks - 1;
+   return 1;
+}
+
+/* HashIndexFind, HashIndexInsert, HashIndexRebuild - Open addressing index from node key to node (TREE_OPTION_HASH_INDEX), so point lookups
+   skip the tree descent. Slots are probed a group of HASH_GROUP_SLOTS at a time, each slot with a control byte that is HASH_EMPTY or the
+   low 7 bits of the key's hash: a group's control bytes are compared against the tag in one go (a single SSE2 compare where available) and
+   only slots whose tag matches are looked at. Groups are visited in triangular order from the one the rest of the hash selects, and a group
+   with an empty slot ends a search. The index grows at 7/8 full and is rebuilt whenever nodes are relocated. Nodes are never deleted one by
+   one; a delete would need a tombstone control byte so probes for keys placed past it keep going. */
+#define HASH_GROUP_SLOTS 16
+#define HASH_EMPTY 0x80
+#define HASH_MIN_CAPACITY 64
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && (_M_IX86_FP >= 2))
+#include <emmintrin.h>
+#define HASH_SSE2
+#endif
+
+// Bit n is set for each slot n of the group whose control byte equals tag.
+static unsigned int HashGroupMatch (const unsigned char *group, unsigned char tag)
+{
+#ifdef HASH_SSE2
+   __m128i control = _mm_load_si128((const __m128i *) group);
+   return (unsigned int) _mm_movemask_epi8(_mm_cmpeq_epi8(control, _mm_set1_epi8((char) tag)));
+#else
+   unsigned int match = 0;
+   for (unsigned int idx=0;idx<HASH_GROUP_SLOTS;idx++)
+      match |= (unsigned int) (group[idx] == tag) << idx;
+   return match;
+#endif
+}
+
+static unsigned int HashLowestSlot (unsigned int match)
+{
+#if defined(__GNUC__) || defined(__clang__)
+   return (unsigned int) __builtin_ctz(match);
+#else
+   unsigned int slot = 0;
+   while (!(match & 1))
+   {
+      match >>= 1;
+      slot++;
+   }
+   return slot;
+#endif
+}
+
+// Index of the first group probed for hash.
+static size_t HashFirstGroup (Tree *tree, unsigned long long hash)
+{
+   return (size_t) (hash >> 7) & ((tree->hash_capacity / HASH_GROUP_SLOTS) - 1);
+}
+
+static TreeNode *HashIndexFind (Tree *tree, unsigned long long key)
+{
+   unsigned long long hash = BloomHash(key);
+   unsigned char tag = (unsigned char) (hash & 0x7f);
+   size_t group_mask = (tree->hash_capacity / HASH_GROUP_SLOTS) - 1;
+   size_t group = HashFirstGroup(tree, hash);
+
+   TREE_STAT(tree->stats.hash_lookups++);
+   for (size_t step=1;;step++)
+   {
+      const unsigned char *control = tree->hash_control + (group * HASH_GROUP_SLOTS);
+
+      TREE_STAT(tree->stats.hash_group_probes++);
+      for (unsigned int match = HashGroupMatch(control, tag);match;match &= match - 1)
+      {
+         TreeNode *node = tree->hash_slots[(group * HASH_GROUP_SLOTS) + HashLowestSlot(match)];
+         if (node->key == key)
+            return node;
+      }
+      if (HashGroupMatch(control, HASH_EMPTY))
+         return NULL;
+      group = (group + step) & group_mask;
+   }
+}
+
+// Put node in the first empty slot of its probe sequence. There must be one (the index is never more than 7/8 full).
+static void HashIndexPlace (Tree *tree, TreeNode *node)
+{
+   unsigned long long hash = BloomHash(node->key);
+   size_t group_mask = (tree->hash_capacity / HASH_GROUP_SLOTS) - 1;
+   size_t group = HashFirstGroup(tree, hash);
+
+   for (size_t step=1;;step++)
+   {
+      unsigned int empty = HashGroupMatch(tree->hash_control + (group * HASH_GROUP_SLOTS), HASH_EMPTY);
+      if (empty)
+      {
+         size_t slot = (group * HASH_GROUP_SLOTS) + HashLowestSlot(empty);
+         tree->hash_control[slot] = (unsigned char) (hash & 0x7f);
+         tree->hash_slots[slot] = node;
+         tree->hash_used++;
+         return;
+      }
+      group = (group + step) & group_mask;
+   }
+}
+
+static size_t HashCapacityFor (unsigned long long nodes)
+{
+   size_t capacity = HASH_MIN_CAPACITY;
+   while (((unsigned long long) capacity * 7 / 8) < nodes)
+      capacity <<= 1;
+   return capacity;
+}
+
+// Move the index to capacity slots, taking the current entries along. Returns 0 (leaving the index as it was) if out of memory.
+static int HashIndexResize (Tree *tree, size_t capacity)
+{
+   void *old_memory = tree->hash_memory;
+   size_t old_memory_size = tree->hash_memory_size;
+   unsigned char *old_control = tree->hash_control;
+   TreeNode **old_slots = tree->hash_slots;
+   size_t old_capacity = tree->hash_capacity;
+   size_t memory_size = capacity + (capacity * sizeof(TreeNode *)) + 64;
+   void *memory = memory_allocate(tree, memory_size);
+
+   if (!memory)
+      return 0;
+   tree->hash_memory = memory;
+   tree->hash_memory_size = memory_size;
+   tree->hash_control = (unsigned char *) (((size_t) memory + 63) & ~((size_t) 63));
+   tree->hash_slots = (TreeNode **) (tree->hash_control + capacity);
+   tree->hash_capacity = capacity;
+   tree->hash_used = 0;
+   memset(tree->hash_control, HASH_EMPTY, capacity);
+   for (size_t slot=0;slot<old_capacity;slot++)
+   {
+      if (old_control[slot] != HASH_EMPTY)
+         HashIndexPlace(tree, old_slots[slot]);
    }
+   memory_free(tree, old_memory, old_memory_size);
+   return 1;
 }
 
+// Without memory to grow, the index is dropped and the tree answers point lookups itself again.
+static void HashIndexDrop (Tree *tree)
+{
+   printf("Hash index of %lu slots could not grow, point lookups go through the tree.\n", (unsigned long) tree->hash_capacity);
+   memory_free(tree, tree->hash_memory, tree->hash_memory_size);
+   tree->hash_memory = NULL;
+   tree->hash_memory_size = 0;
+   tree->hash_control = NULL;
+   tree->hash_slots = NULL;
+   tree->hash_capacity = 0;
+   tree->hash_used = 0;
+}
+
+static void HashIndexInsert (Tree *tree, TreeNode *node)
+{
+   if (((tree->hash_used + 1) * 8 > tree->hash_capacity * 7) && !HashIndexResize(tree, tree->hash_capacity * 2))
+   {
+      HashIndexDrop(tree);
+      return;
+   }
+   HashIndexPlace(tree, node);
+}
+
+static void HashIndexAddNodes (Tree *tree, TreeNode *node)
+{
+   while (node)
+   {
+      HashIndexAddNodes(tree, node->left);
+      HashIndexPlace(tree, node);
+      node = node->right;
+   }
+}
+
+// Refill the index from the tree after its nodes were relocated or freed.
+static void HashIndexRebuild (Tree *tree)
+{
+   if (!tree->hash_control)
+      return;
+   memset(tree->hash_control, HASH_EMPTY, tree->hash_capacity);
+   tree->hash_used = 0;
+   if ((HashCapacityFor(tree->size) > tree->hash_capacity) && !HashIndexResize(tree, HashCapacityFor(tree->size)))
+   {
+      HashIndexDrop(tree);
+      return;
+   }
+   HashIndexAddNodes(tree, tree->root);
+}
+
+#ifdef TESTSET_PROFILE
+static void RecordDepth (Tree *tree, unsigned int depth)
+{
+   tree->stats.depth_histogram[(depth < TREE_STATS_DEPTH_BUCKETS)?depth:(TREE_STATS_DEPTH_BUCKETS-1)]++;
+}
+#endif
+
 
 void SetTSVerbose (unsigned int enable_disable)
 {
@@ -90,11 +412,11 @@ void PrintTreeHelper (TreeNode *node, int depth, Tree *tree, char *str)
     {
         printf (" @depth %d (%s):\n", depth, str);
         PrintTreeHelper(node->left, depth+1, tree, "left");
-        printf (" (%d)  node %p: payload key:%04x (%d) color:%s\n (l=%p[%d], r=%p[%d], p=%p[%d])\n", depth, node, node->key, node->key,
+        printf (" (%d)  node %p: payload key:%04llx (%llu) color:%s\n (l=%p[%lld], r=%p[%lld], p=%p[%lld])\n", depth, node, node->key, node->key,
                 (node->RedBlack == RED)?"RED":"BLACK",
-                node->left, (node->left)?node->left->key:-1,
-                node->right, (node->right)?node->right->key:-1,
-                node->parent, (node->parent)?node->parent->key:-1);
+                node->left, (node->left)?(long long) node->left->key:-1,
+                node->right, (node->right)?(long long) node->right->key:-1,
+                node->parent, (node->parent)?(long long) node->parent->key:-1);
         if (node->payload)
         {
            printf ("   bitmap[%p]:", node->payload);
@@ -153,7 +475,7 @@ unsigned int FindMaxDepth (TreeNode *node, unsigned int depth)
    {
        unsigned int left_depth = FindMaxDepth(node->left, depth+1);
        unsigned int right_depth = FindMaxDepth(node->right, depth+1);
-       verbose_printf (3, "At node %d - left node tree is depth %d, right node tree is depth %d.\n", node->key, left_depth, right_depth);
+       verbose_printf (3, "At node %llu - left node tree is depth %d, right node tree is depth %d.\n", node->key, left_depth, right_depth);
        if (left_depth > right_depth)
            return left_depth;
        else
@@ -161,20 +483,60 @@ unsigned int FindMaxDepth (TreeNode *node, unsigned int depth)
    }
 }
 
-/* Print Tree Info per average depth of tree and node memory allocation if TESTSET_PROFILE is enabled. */
+unsigned int TreeDepth (Tree *tree)
+{
+   return (tree)?FindMaxDepth(tree->root, 0):0;
+}
+
+/* Print Tree Info per average depth of tree and node memory allocation, plus the hot path counters if TESTSET_PROFILE is enabled. */
 void TreeInfo (Tree *tree)
 {
    unsigned int running_depth_sum = 0;
    if (tree)
    {
-      running_depth_sum = TreeInfoHelper(tree->root, 0);
+      if (tree->root)
+          running_depth_sum = TreeInfoHelper(tree->root, 0);
       if (tree->size > 0)
       {
              printf ("size:%d left_depth:%d right_depth:%d Avg depth:(%d/%d) = %f\n", tree->size, FindMaxDepth(tree->root->left, 0), FindMaxDepth(tree->root->right, 0), running_depth_sum, tree->size, (double) running_depth_sum/tree->size);
+             TreeStats stats;
+             GetTreeStats(tree, &stats);
+             printf ("Tree header size:%u TreeNode size: %u+%u (node+payload) bytes allocated:%lu bits set:%llu bytes per set bit:%f\n",
+                     (unsigned int) sizeof(Tree), (unsigned int) sizeof(TreeNode), tree->bitmap_size_in_bytes,
+                     (unsigned long) stats.bytes_allocated, stats.bits_set, stats.bytes_per_set_bit);
 #ifdef TESTSET_PROFILE
-             printf ("Tree header size:%I64d TreeNode size: %I64d+%d (node+payload)\n", sizeof(Tree), sizeof(TreeNode), tree->bitmap_size_in_bytes);
+             printf ("lookups:%llu hits:%llu finger hits:%llu inserts:%llu rotations:%llu recolorings:%llu\n", stats.lookups, stats.hits, stats.finger_hits, stats.inserts, stats.rotations, stats.recolorings);
+             if (tree->options & TREE_OPTION_SNAPSHOTS)
+                 printf ("path copies:%llu versions published:%llu\n", stats.path_copies, stats.versions_published);
 #endif
       }
+      if (tree->tuning)
+      {
+             const TreeTuning *tuning = tree->tuning;
+             printf ("tuned: %u bits per node%s from %u samples (%.0f%% in order) for %llu offsets, projected nodes/bytes per width:", tuning->bitmap_size_per_node,
+                     (tuning->flags & TREE_OPTION_HASH_INDEX)?" with a hash index":"", tuning->samples, tuning->in_order * 100.0, tuning->expected_offsets);
+             for (unsigned int idx=0;idx<tuning->width_count;idx++)
+             {
+                 if ((tuning->sampled_nodes[idx] == 0) && (tuning->samples > 0))
+                     printf (" %u: ruled out%s", tuning->widths[idx], (idx + 1 < tuning->width_count)?",":"");
+                 else
+                     printf (" %u%s: %llu/%llu%s", tuning->widths[idx], (tuning->widths[idx] == tuning->bitmap_size_per_node)?"*":"",
+                             tuning->projected_nodes[idx], tuning->projected_bytes[idx], (idx + 1 < tuning->width_count)?",":"");
+             }
+             printf ("\n");
+      }
+      if (tree->hash_control)
+      {
+             printf ("hash index: %lu of %lu slots used (%lu bytes), lookups:%llu groups probed:%llu\n", (unsigned long) tree->hash_used,
+                     (unsigned long) tree->hash_capacity, (unsigned long) tree->hash_memory_size, tree->stats.hash_lookups, tree->stats.hash_group_probes);
+      }
+      if (tree->spill_runs)
+      {
+             TreeStats stats;
+             GetTreeStats(tree, &stats);
+             printf ("spilled: %llu records in %u run files (%llu bytes), lookups:%llu hits:%llu page reads:%llu\n", stats.spill_records, stats.spill_runs,
+                     stats.spill_file_bytes, stats.spill_lookups, stats.spill_hits, stats.spill_page_reads);
+      }
    }
 }
 
@@ -182,26 +544,99 @@ void TreeInfo (Tree *tree)
 
 
 
-/* CreateTree - Create and initialized the base tree structure that will contain all nodes and return a reference to the tree.
- *bitmap_size_per_node is the size of the allocated bitmap window onto the larger virtual bitmap */
+/* CreateTree, CreateTreeWithOptions - Create and initialized the base tree structure that will contain all nodes and return a reference to the tree.
+ *bitmap_size_per_node is the size of the allocated bitmap window onto the larger virtual bitmap. options (may be NULL) selects optional features. */
 
-struct Tree *CreateTree (unsigned int bitmap_size_per_node)
+struct Tree *CreateTreeWithOptions (unsigned int bitmap_size_per_node, const TreeOptions *options)
 {
     struct Tree *tree = NULL;
 
     if (bitmap_size_per_node < MAX_BITMAP_PER_NODE)
     {
-        tree = memory_allocate(sizeof(Tree));
+        tree = malloc(sizeof(Tree));
         if (tree)
         {
+           memset(&tree->stats, 0, sizeof(TreeStats));
+           tree->stats.bytes_allocated = sizeof(Tree);
            tree->size = 0;
            tree->bitmap_size_per_node = bitmap_size_per_node;
-           tree->bitmap_size_in_bytes = (bitmap_size_per_node + 7) / 8;
+           tree->counter_bits = 1;
+           if (options && (options->flags & TREE_OPTION_COUNTERS))
+               tree->counter_bits = (options->counter_bits > 0)?options->counter_bits:8;
+           tree->bitmap_size_in_bytes = ((bitmap_size_per_node * tree->counter_bits) + 7) / 8;
            tree->bitmap_idx_size = CountBitSize(bitmap_size_per_node);
+           tree->sub_bit_mask = (1ULL << tree->bitmap_idx_size) - 1;
            tree->root = NULL;
-           #ifdef TESTSET_PROFILE
-           total_trees++;
-           #endif
+           tree->finger = NULL;
+           tree->rightmost = NULL;
+           tree->blocks = NULL;
+           tree->compacted = 0;
+           tree->options = (options)?options->flags:0;
+           memset(&tree->allocator, 0, sizeof(TreeAllocator));
+           if (options && options->allocator && options->allocator->allocate && options->allocator->release)
+               tree->allocator = *options->allocator;
+           tree->tuning = NULL;
+           tree->bloom = NULL;
+           tree->bloom_memory = NULL;
+           tree->bloom_memory_size = 0;
+           tree->bloom_block_mask = 0;
+           tree->hash_control = NULL;
+           tree->hash_slots = NULL;
+           tree->hash_memory = NULL;
+           tree->hash_memory_size = 0;
+           tree->hash_capacity = 0;
+           tree->hash_used = 0;
+           tree->published = NULL;
+           atomic_flag_clear(&tree->publish_lock);
+           atomic_init(&tree->retired, NULL);
+           tree->memory_budget = (options && (tree->options & TREE_OPTION_SPILL))?options->memory_budget:0;
+           tree->spill_directory = NULL;
+           tree->spill_runs = NULL;
+           tree->spill_run_count = 0;
+           tree->spill_cache = NULL;
+           tree->spill_cache_pages = SPILL_CACHE_PAGES;
+           if (tree->memory_budget && ((tree->memory_budget / 4 / SPILL_PAGE_BYTES) < SPILL_CACHE_PAGES))
+               tree->spill_cache_pages = (tree->memory_budget / 4 / SPILL_PAGE_BYTES > 0)?(unsigned int) (tree->memory_budget / 4 / SPILL_PAGE_BYTES):1;
+           tree->spill_tick = 0;
+           if ((tree->options & TREE_OPTION_SPILL) && options->spill_directory)
+           {
+               tree->spill_directory = malloc(strlen(options->spill_directory) + 1);
+               if (tree->spill_directory)
+                   strcpy(tree->spill_directory, options->spill_directory);
+           }
+
+           if ((tree->counter_bits != 1) && (tree->counter_bits != 4) && (tree->counter_bits != 8))
+           {
+               printf("TREE_OPTION_COUNTERS counters of %u bits are not supported, only 4 or 8.\n", tree->counter_bits);
+               free(tree->spill_directory);
+               free(tree);
+               tree = NULL;
+           }
+           else if ((tree->options & TREE_OPTION_SPILL) && (tree->options & TREE_OPTION_SNAPSHOTS))
+           {
+               printf("TREE_OPTION_SPILL cannot be combined with TREE_OPTION_SNAPSHOTS.\n");
+               free(tree->spill_directory);
+               free(tree);
+               tree = NULL;
+           }
+           else if ((tree->options & TREE_OPTION_HASH_INDEX) && (tree->options & TREE_OPTION_SNAPSHOTS))
+           {
+               printf("TREE_OPTION_HASH_INDEX cannot be combined with TREE_OPTION_SNAPSHOTS.\n");
+               free(tree->spill_directory);
+               free(tree);
+               tree = NULL;
+           }
+           else if (((tree->options & TREE_OPTION_BLOOM_FILTER) && !BloomCreate(tree, options->expected_nodes)) ||
+                    ((tree->options & TREE_OPTION_SNAPSHOTS) && !TreePublish(tree)) ||
+                    ((tree->options & TREE_OPTION_HASH_INDEX) && !HashIndexResize(tree, HashCapacityFor(options->expected_nodes))) ||
+                    (options && options->spill_directory && (tree->options & TREE_OPTION_SPILL) && !tree->spill_directory))
+           {
+               memory_free(tree, tree->bloom_memory, tree->bloom_memory_size);
+               memory_free(tree, tree->hash_memory, tree->hash_memory_size);
+               free(tree->spill_directory);
+               free(tree);
+               tree = NULL;
+           }
         }
     }
     else
@@ -211,6 +646,208 @@ struct Tree *CreateTree (unsigned int bitmap_size_per_node)
     return tree;
 }
 
+struct Tree *CreateTree (unsigned int bitmap_size_per_node)
+{
+    return CreateTreeWithOptions(bitmap_size_per_node, NULL);
+}
+
+/* TuneTree, CreateTreeFromTuning, CreateTreeTuned - Node width and representation chosen from a sample of the input, see TreeSet.h. A node
+   is costed at its TreeNode and payload plus TUNE_ALLOCATION_OVERHEAD for each of its two allocations. Input samples where at least
+   TUNE_IN_ORDER of the steps stay in the previous node or move to a later one count as time ordered (random order gives about half): the
+   key span they cover grows in proportion to the input, filled as densely as the sampled span, and the finger serves them. Otherwise the sampled nodes are taken as drawn at random from the nodes of the sampled key span, and the occupancy of that span
+   after expected_offsets draws is projected from the share of samples that fell in a node already drawn. */
+#define TUNE_ALLOCATION_OVERHEAD 16
+#define TUNE_IN_ORDER            0.9
+#define TUNE_HASH_MAX_IN_ORDER   0.75
+#define TUNE_HASH_MIN_NODES      65536
+
+typedef struct tune_sample {
+    unsigned long long *offsets;
+    unsigned int        count;
+    unsigned int        capacity;
+} tune_sample;
+
+static int TuneSampleFrozen (void *context, unsigned long long total_bit_offset)
+{
+    tune_sample *sample = context;
+
+    sample->offsets[sample->count++] = total_bit_offset;
+    return sample->count == sample->capacity;
+}
+
+static int CompareTuneOffsets (const void *a, const void *b)
+{
+    unsigned long long left = *(const unsigned long long *) a, right = *(const unsigned long long *) b;
+    return (left > right) - (left < right);
+}
+
+// Nodes M of a key span such that draws distinct nodes in M after samples random draws: M (1 - e^(-samples/M)) = draws, at most span.
+static double TuneOccupiedNodes (double draws, double samples, double span)
+{
+    double low = draws, high = span;
+
+    if ((draws >= samples) || (span * (1.0 - exp(-samples / span)) <= draws))
+        return span;
+    for (int iteration=0;iteration<64;iteration++)
+    {
+        double middle = (low + high) / 2;
+        if (middle * (1.0 - exp(-samples / middle)) < draws)
+            low = middle;
+        else
+            high = middle;
+    }
+    return (low + high) / 2;
+}
+
+int TuneTree (const TreeTuningHints *hints, TreeTuning *tuning)
+{
+    tune_sample sample;
+    unsigned int counter_bits = 1;
+    unsigned int in_order_steps = 0;
+    int chosen = -1;
+
+    if (!hints || !tuning || !hints->widths || (hints->width_count == 0) || (hints->width_count > TREE_TUNE_MAX_WIDTHS))
+    {
+        printf("TuneTree: between 1 and %u candidate widths are needed.\n", TREE_TUNE_MAX_WIDTHS);
+        return 0;
+    }
+    memset(tuning, 0, sizeof(TreeTuning));
+    for (unsigned int idx=0;idx<hints->width_count;idx++)
+    {
+        if ((hints->widths[idx] == 0) || (hints->widths[idx] >= MAX_BITMAP_PER_NODE))
+        {
+            printf("TuneTree: width %u is invalid, must be between 1 and %d bits.\n", hints->widths[idx], MAX_BITMAP_PER_NODE - 1);
+            return 0;
+        }
+        tuning->widths[idx] = hints->widths[idx];
+    }
+    tuning->width_count = hints->width_count;
+    if (hints->options.flags & TREE_OPTION_COUNTERS)
+        counter_bits = (hints->options.counter_bits > 0)?hints->options.counter_bits:8;
+
+    sample.count = (hints->sample_offsets)?hints->sample_count:0;
+    sample.capacity = sample.count + ((hints->sample_frozen)?TREE_TUNE_MAX_FROZEN_SAMPLES:0);
+    sample.offsets = malloc(((size_t) sample.capacity + 1) * sizeof(unsigned long long));
+    if (!sample.offsets)
+    {
+        printf("TuneTree: cannot allocate a sample of %u offsets.\n", sample.capacity);
+        return 0;
+    }
+    if (sample.count > 0)
+        memcpy(sample.offsets, hints->sample_offsets, (size_t) sample.count * sizeof(unsigned long long));
+    if (hints->sample_frozen)
+        FrozenForEachSetBit(hints->sample_frozen, 0, ~0ULL, TuneSampleFrozen, &sample);
+    tuning->samples = sample.count;
+    tuning->expected_offsets = (hints->expected_offsets > sample.count)?hints->expected_offsets:sample.count;
+
+    // Frozen samples are in key order whatever order the input comes in, so only input samples tell whether the finger will help.
+    if (hints->sample_offsets && (hints->sample_count > 1))
+    {
+        unsigned int idx_size = CountBitSize(hints->widths[0]);
+        for (unsigned int idx=1;idx<hints->sample_count;idx++)
+        {
+            in_order_steps += (hints->sample_offsets[idx] >> idx_size) >= (hints->sample_offsets[idx - 1] >> idx_size);
+        }
+        tuning->in_order = (double) in_order_steps / (hints->sample_count - 1);
+    }
+    else
+    {
+        tuning->in_order = 1.0;
+    }
+
+    qsort(sample.offsets, sample.count, sizeof(unsigned long long), CompareTuneOffsets);
+    for (unsigned int width_idx=0;width_idx<tuning->width_count;width_idx++)
+    {
+        unsigned int width = tuning->widths[width_idx];
+        unsigned int idx_size = CountBitSize(width);
+        unsigned long long sub_bit_mask = (1ULL << idx_size) - 1;
+        unsigned long long nodes = 0;
+        int addressable = 1;
+
+        for (unsigned int idx=0;addressable && (idx<sample.count);idx++)
+        {
+            addressable = (sample.offsets[idx] & sub_bit_mask) < width;
+            nodes += (idx == 0) || ((sample.offsets[idx] >> idx_size) != (sample.offsets[idx - 1] >> idx_size));
+        }
+        if (!addressable)
+            continue;
+
+        double projected = (double) nodes;
+        double span = (sample.count > 0)?(double) ((sample.offsets[sample.count - 1] >> idx_size) - (sample.offsets[0] >> idx_size)) + 1.0:1.0;
+        if ((sample.count > 0) && (tuning->in_order >= TUNE_IN_ORDER))
+        {
+            double projected_offsets = (double) (sample.offsets[sample.count - 1] - sample.offsets[0] + 1) * tuning->expected_offsets / sample.count;
+            projected = ((double) nodes / span) * ((projected_offsets / (double) (1ULL << idx_size)) + 1.0);
+        }
+        else if (sample.count > 0)
+        {
+            double occupied = TuneOccupiedNodes((double) nodes, (double) sample.count, span);
+            projected = occupied * (1.0 - exp(-(double) tuning->expected_offsets / occupied));
+        }
+        if (projected < (double) nodes)
+            projected = (double) nodes;
+        if (projected > (double) tuning->expected_offsets)
+            projected = (double) tuning->expected_offsets;
+
+        tuning->sampled_nodes[width_idx] = nodes;
+        tuning->projected_nodes[width_idx] = (unsigned long long) (projected + 0.5);
+        tuning->projected_bytes[width_idx] = tuning->projected_nodes[width_idx] *
+                                             (sizeof(TreeNode) + (((width * counter_bits) + 7) / 8) + (2 * TUNE_ALLOCATION_OVERHEAD));
+        if ((chosen < 0) || (tuning->projected_bytes[width_idx] < tuning->projected_bytes[chosen]) ||
+            ((tuning->projected_bytes[width_idx] == tuning->projected_bytes[chosen]) && (tuning->projected_nodes[width_idx] < tuning->projected_nodes[chosen])))
+            chosen = (int) width_idx;
+    }
+    free(sample.offsets);
+
+    if (chosen < 0)
+    {
+        printf("TuneTree: none of the %u widths holds every sampled offset.\n", tuning->width_count);
+        return 0;
+    }
+    tuning->bitmap_size_per_node = tuning->widths[chosen];
+    if (!(hints->options.flags & TREE_OPTION_SNAPSHOTS) && (tuning->in_order < TUNE_HASH_MAX_IN_ORDER) &&
+        (tuning->projected_nodes[chosen] >= TUNE_HASH_MIN_NODES) && ((tuning->projected_nodes[chosen] * 2) <= tuning->expected_offsets))
+        tuning->flags |= TREE_OPTION_HASH_INDEX;
+    return 1;
+}
+
+struct Tree *CreateTreeFromTuning (const TreeTuning *tuning, const TreeOptions *options)
+{
+    TreeOptions tuned_options;
+    struct Tree *tree;
+
+    if (!tuning)
+        return NULL;
+    if (options)
+        tuned_options = *options;
+    else
+        memset(&tuned_options, 0, sizeof(tuned_options));
+    tuned_options.flags |= tuning->flags;
+    for (unsigned int idx=0;idx<tuning->width_count;idx++)
+    {
+        if ((tuning->widths[idx] == tuning->bitmap_size_per_node) && (tuned_options.expected_nodes == 0))
+            tuned_options.expected_nodes = tuning->projected_nodes[idx];
+    }
+
+    tree = CreateTreeWithOptions(tuning->bitmap_size_per_node, &tuned_options);
+    if (tree)
+    {
+        tree->tuning = memory_allocate(tree, sizeof(TreeTuning));
+        if (tree->tuning)
+            *tree->tuning = *tuning;
+    }
+    return tree;
+}
+
+struct Tree *CreateTreeTuned (const TreeTuningHints *hints)
+{
+    TreeTuning tuning;
+
+    if (!TuneTree(hints, &tuning))
+        return NULL;
+    return CreateTreeFromTuning(&tuning, &hints->options);
+}
+
 /* DestroyNode, DestroyTree - Procedures to destroy tree nodes and tree containers */
 void DestroyNode (Tree *tree, TreeNode *tree_node)
 {
@@ -220,13 +857,13 @@ void DestroyNode (Tree *tree, TreeNode *tree_node)
             DestroyNode(tree, tree_node->left);
         if (tree_node->right)
             DestroyNode(tree, tree_node->right);
-        if (tree_node->payload != NULL)
-            memory_free(tree_node->payload, tree->bitmap_size_in_bytes);
-        memory_free(tree_node, sizeof(TreeNode));
+        if (!tree_node->InBlock)
+        {
+            if (tree_node->payload != NULL)
+                memory_free(tree, tree_node->payload, tree->bitmap_size_in_bytes);
+            memory_free(tree, tree_node, sizeof(TreeNode));
+        }
         tree->size--;
-        #ifdef TESTSET_PROFILE
-        total_nodes--;
-        #endif
     }
 }
 
@@ -234,11 +871,28 @@ void DestroyTree(Tree *tree)
 {
     if (tree)
     {
+       if (tree->options & TREE_OPTION_SNAPSHOTS)
+       {
+           // All snapshots must have been released by now; the published version is the last one standing.
+           if (tree->published)
+               ReleaseSnapshot(tree->published);
+           tree->published = NULL;
+           ReclaimVersions(tree);
+           ReleaseNodeRef(tree, tree->root);
+           tree->root = NULL;
+       }
        DestroyNode(tree, tree->root);
-       memory_free(tree, sizeof(Tree));
-       #ifdef TESTSET_PROFILE
-       total_trees--;
-       #endif
+       while (tree->blocks)
+       {
+           TreeBlock *next = tree->blocks->next;
+           memory_free(tree, tree->blocks, tree->blocks->size);
+           tree->blocks = next;
+       }
+       memory_free(tree, tree->bloom_memory, tree->bloom_memory_size);
+       memory_free(tree, tree->hash_memory, tree->hash_memory_size);
+       SpillRelease(tree);
+       memory_free(tree, tree->tuning, sizeof(TreeTuning));
+       free(tree);
 
     }
 }
@@ -247,6 +901,7 @@ void DestroyTree(Tree *tree)
 void RightRotate (Tree *t, TreeNode *partial_tree)
 {
    TreeNode *left = partial_tree->left;
+   TREE_STAT(t->stats.rotations++);
    partial_tree->left = left->right;
    if (partial_tree->left)
        partial_tree->left->parent = partial_tree;
@@ -272,6 +927,7 @@ void RightRotate (Tree *t, TreeNode *partial_tree)
 void LeftRotate (Tree *t, TreeNode *partial_tree)
 {
    TreeNode *right = partial_tree->right;
+   TREE_STAT(t->stats.rotations++);
    partial_tree->right = right->left;
    if (partial_tree->right)
        partial_tree->right->parent = partial_tree;
@@ -299,7 +955,6 @@ int FixUpTree (Tree *t, TreeNode *partial_tree)
    TreeNode *grandparent = NULL;
    int work_done = 0;
 
-    verbose_printf (1,"Root = %p\n", t->root);
     while ((partial_tree != t->root) && (partial_tree->RedBlack != BLACK) && (partial_tree->parent->RedBlack == RED))
     {
        work_done = 1;
@@ -311,8 +966,6 @@ int FixUpTree (Tree *t, TreeNode *partial_tree)
           break;
        }
 
-       verbose_printf (1," partial_tree:%p[%d], parent:%p[%d], grandparent:%p[%d]\n", partial_tree, (partial_tree!=NULL)?partial_tree->key:-1, parent,
-                        (parent!=NULL)?parent->key:-1, grandparent, (grandparent!=NULL)?grandparent->key:-1);
        // Case A: Parent of partial_tree is left child of grand-parent of partial_tree
        if (parent == grandparent->left)
        {
@@ -321,8 +974,9 @@ int FixUpTree (Tree *t, TreeNode *partial_tree)
 
            if ((uncle_partial_tree != NULL) && (uncle_partial_tree->RedBlack == RED))
            {
-               verbose_printf (1," A1 Recolor");
+               TREE_TRACE(TREE_TRACE_RECOLOR, grandparent->key, 0, 0);
                // Case 1: Uncle is red, only recoloring required
+               TREE_STAT(t->stats.recolorings++);
                grandparent->RedBlack = RED;
                parent->RedBlack = BLACK;
                uncle_partial_tree->RedBlack = BLACK;
@@ -332,12 +986,12 @@ int FixUpTree (Tree *t, TreeNode *partial_tree)
               // Case 2: Do rotation in the opposite direction of which side of the parent we are on
               if (partial_tree == parent->right)
               {
-                 verbose_printf (1," Case A2: Left Rotate ");
+                 TREE_TRACE(TREE_TRACE_ROTATE, parent->key, 0, 0);
                  LeftRotate(t, parent);
                  partial_tree = parent;
                  parent = partial_tree->parent;
               }
-              verbose_printf (1," Case A3: Right Rotate.");
+              TREE_TRACE(TREE_TRACE_ROTATE, grandparent->key, 0, 1);
               //  partial_tree is left child so, do counter-rotate rotate (Case 3 is when we start in this state
               RightRotate(t, grandparent);
 
@@ -351,7 +1005,6 @@ int FixUpTree (Tree *t, TreeNode *partial_tree)
               */
               partial_tree = parent;
            }
-           verbose_printf (1,"\n");
        }
        // Case B: Parent of partial_tree is right child of grand-parent or partial_tree
        else
@@ -361,8 +1014,9 @@ int FixUpTree (Tree *t, TreeNode *partial_tree)
 
            if ((uncle_partial_tree != NULL) && (uncle_partial_tree->RedBlack == RED))
            {
-               verbose_printf (1,"B1 Recolor ");
+               TREE_TRACE(TREE_TRACE_RECOLOR, grandparent->key, 0, 0);
                // Case 1: Uncle is red, only recoloring required
+               TREE_STAT(t->stats.recolorings++);
                grandparent->RedBlack = RED;
                parent->RedBlack = BLACK;
                uncle_partial_tree->RedBlack = BLACK;
@@ -372,16 +1026,14 @@ int FixUpTree (Tree *t, TreeNode *partial_tree)
               // Case 2: Do rotation in the opposite direction of which side of the parent we are on
               if (partial_tree == parent->left)
               {
-                 verbose_printf (1,"B2 Right Rotate ");
-
+                 TREE_TRACE(TREE_TRACE_ROTATE, parent->key, 0, 1);
                  RightRotate(t, parent);
                  partial_tree = parent;
                  parent = partial_tree->parent;
               }
 
 
-              verbose_printf (1,"B3 Left Rotate");
-
+              TREE_TRACE(TREE_TRACE_ROTATE, grandparent->key, 0, 0);
               // partial_tree is left child so, do counter-rotate rotate (Case 3 is when we start in this state)
               LeftRotate(t, grandparent);
 
@@ -396,236 +1048,2408 @@ int FixUpTree (Tree *t, TreeNode *partial_tree)
 
               partial_tree = parent;
            }
-           verbose_printf (1,"\n");
        }
     }
 
     //ensure root node is always black after rotations.
     if (t->root && (t->root->RedBlack == RED))
     {
+        TREE_STAT(t->stats.recolorings++);
         t->root->RedBlack = BLACK;
     }
     return work_done;
 }
 
-/* FindOrInsertNode - Given a valid tree, attempt to find or insert the node reference passed in. The helper will track the found node (if not inserting) in nodeFound (if given),
-insert_depth will track the depth the node is inserted at (if variable reference is not NULL), and depth is a helper field to track how far down the tree we go. */
+/* NextNode, PrevNode - In-order neighbours of a node found through the parent links. The walk gives up (returns 0) after FINGER_MAX_STEPS
+   links so a finger check never costs more than a handful of pointer loads; otherwise *neighbour is set (NULL at either end of the tree). */
+#define FINGER_MAX_STEPS 4
 
-TreeNode *FindNodeHelper (TreeNode *node, int key)
+static int NextNode (TreeNode *node, TreeNode **neighbour)
 {
-    if (node)
+    unsigned int steps = 0;
+    if (node->right)
     {
-       verbose_printf (1,"FindNode: Checking node(%p) with key=%d (looking for %d)\n", node, node->key, key);
-
-       if (node->key == key)
-        return node;
-       else if (key < node->key)
-        return FindNodeHelper (node->left, key);
-       else if (key > node->key)
-        return FindNodeHelper (node->right, key);
+        node = node->right;
+        while (node->left)
+        {
+            if (++steps > FINGER_MAX_STEPS)
+                return 0;
+            node = node->left;
+        }
+        *neighbour = node;
+        return 1;
     }
-    return NULL;
+    while (node->parent && (node == node->parent->right))
+    {
+        if (++steps > FINGER_MAX_STEPS)
+            return 0;
+        node = node->parent;
+    }
+    *neighbour = node->parent;
+    return 1;
 }
 
-TreeNode *FindNode (Tree *tree, unsigned int key)
+static int PrevNode (TreeNode *node, TreeNode **neighbour)
 {
-   return FindNodeHelper(tree->root, key);
+    unsigned int steps = 0;
+    if (node->left)
+    {
+        node = node->left;
+        while (node->right)
+        {
+            if (++steps > FINGER_MAX_STEPS)
+                return 0;
+            node = node->right;
+        }
+        *neighbour = node;
+        return 1;
+    }
+    while (node->parent && (node == node->parent->left))
+    {
+        if (++steps > FINGER_MAX_STEPS)
+            return 0;
+        node = node->parent;
+    }
+    *neighbour = node->parent;
+    return 1;
 }
 
+/* FingerSearch - Resolve key against the last accessed node (tree->finger) without descending from the root. Time ordered input mostly asks
+   for the finger's own key, one of its in-order neighbours, or a key above everything in the tree. Returns 1 when resolved: *found is the
+   node or NULL if key is absent, in which case *attach_parent and *attach_left give the empty child slot key belongs in (for two adjacent
+   nodes a < b with a < key < b that is a->right if empty, b->left otherwise). Returns 0 if key is not next to the finger. */
+static int FingerSearch (Tree *tree, unsigned long long key, TreeNode **found, TreeNode **attach_parent, int *attach_left)
+{
+    TreeNode *finger = tree->finger;
+    TreeNode *neighbour = NULL;
 
+    if (!finger)
+        return 0;
 
-TreeNode *FindOrInsertNodeHelper (TreeNode *node, TreeNode *node_to_insert, TreeNode **nodeFound, unsigned int *insert_depth, unsigned int depth)
-{
-    if (node == NULL)
+    if (key == finger->key)
+    {
+        *found = finger;
+        return 1;
+    }
+
+    // Appending past the largest key is the common case for time ordered input; the rightmost node never has a right child.
+    if (key > tree->rightmost->key)
+    {
+        *found = NULL;
+        *attach_parent = tree->rightmost;
+        *attach_left = 0;
+        return 1;
+    }
+
+    if (key > finger->key)
     {
-        if (insert_depth)
-           *insert_depth = depth-1;
-        return node_to_insert;
+        if (!NextNode(finger, &neighbour) || (neighbour && (key > neighbour->key)))
+            return 0;
+        if (neighbour && (key == neighbour->key))
+        {
+            *found = neighbour;
+            return 1;
+        }
+        *found = NULL;
+        *attach_left = (finger->right != NULL);
+        *attach_parent = (*attach_left)?neighbour:finger;
+        return 1;
     }
-    else if (node_to_insert->key < node->key)
+    else
     {
-        node->left = FindOrInsertNodeHelper (node->left, node_to_insert, nodeFound, insert_depth, depth+1);
-        if (node->left == node_to_insert)
-           node_to_insert->parent = node;
+        if (!PrevNode(finger, &neighbour) || (neighbour && (key < neighbour->key)))
+            return 0;
+        if (neighbour && (key == neighbour->key))
+        {
+            *found = neighbour;
+            return 1;
+        }
+        *found = NULL;
+        *attach_left = (finger->left == NULL);
+        *attach_parent = (*attach_left)?finger:neighbour;
+        return 1;
     }
-    else if (node_to_insert->key > node->key)
+}
+
+/* LocateNode - Find the node holding key, via the finger if possible or else by descending from the root. If not found, *attach_parent and
+   *attach_left describe where a node with this key would be linked in (attach_parent NULL for an empty tree). */
+static TreeNode *LocateNode (Tree *tree, unsigned long long key, TreeNode **attach_parent, int *attach_left)
+{
+    TreeNode *node = tree->root;
+    unsigned int depth = 0;
+
+    *attach_parent = NULL;
+    *attach_left = 0;
+    TREE_STAT(tree->stats.lookups++);
+
+    if (FingerSearch(tree, key, &node, attach_parent, attach_left))
     {
-        node->right = FindOrInsertNodeHelper (node->right, node_to_insert, nodeFound, insert_depth, depth+1);
-        if (node->right == node_to_insert)
-           node_to_insert->parent = node;
+        TREE_STAT(tree->stats.finger_hits++);
     }
-    else if ((node_to_insert->key == node->key) && (nodeFound))
+    else
     {
-        *nodeFound = node;
+        while (node && (node->key != key))
+        {
+            depth++;
+            *attach_parent = node;
+            *attach_left = (key < node->key);
+            node = (*attach_left)?node->left:node->right;
+        }
+        depth += (node != NULL);
     }
+
+    TREE_STAT(tree->stats.hits += (node != NULL));
+    TREE_STAT(RecordDepth(tree, depth));
+    TREE_TRACE(TREE_TRACE_FIND, key, depth, (node != NULL));
     return node;
 }
 
-TreeNode *FindOrInsertNode (struct Tree *tree, unsigned int key)
+TreeNode *FindNode (Tree *tree, unsigned int key)
 {
-  TreeNode *found_node = NULL; // This will track if the node is found and return a pointer to it. If it is NULL, this means node created was inserted.
-  TreeNode *node_to_insert = NULL;
+   return FindNode64(tree, key);
+}
 
-  unsigned int insert_depth = 0;
+/* FindNodeInMemory - FindNode64 without looking at spilled nodes. */
+static TreeNode *FindNodeInMemory (Tree *tree, unsigned long long key)
+{
+   TreeNode *attach_parent;
+   int attach_left;
+   TreeNode *node;
 
-  if (tree)
-  {
-      node_to_insert = memory_allocate(sizeof(TreeNode));
-      if (node_to_insert)
-      {
-         node_to_insert->left = node_to_insert->right = node_to_insert->parent = NULL;
-         node_to_insert->RedBlack = RED;
-         node_to_insert->key = key;
-         if (tree->bitmap_size_in_bytes > 0)
-         {
-            node_to_insert->payload = memory_allocate(tree->bitmap_size_in_bytes);
-            if (!node_to_insert->payload)
-            {
-                memory_free(node_to_insert, sizeof(TreeNode));
-                node_to_insert = NULL;
-            }
-            else
-            {
-               memset(node_to_insert->payload, 0, tree->bitmap_size_in_bytes);
-            }
-         }
-         else
-         {
-            node_to_insert->payload = NULL;
-         }
-      }
+   // The hash index answers without a descent; otherwise keys never inserted are usually turned away by the Bloom filter (the finger's own key
+   // is cheaper to check directly than either).
+   if (tree->hash_control && !(tree->finger && (tree->finger->key == key)))
+   {
+       node = HashIndexFind(tree, key);
+       TREE_STAT(tree->stats.lookups++);
+       TREE_STAT(tree->stats.hits += (node != NULL));
+       TREE_TRACE(TREE_TRACE_FIND, key, 0, (node != NULL));
+   }
+   else if (tree->bloom && !(tree->finger && (tree->finger->key == key)))
+   {
+       tree->stats.bloom_queries++;
+       if (!BloomMayContain(tree, key))
+       {
+           tree->stats.bloom_rejects++;
+           TREE_TRACE(TREE_TRACE_FIND, key, 0, 0);
+           return NULL;
+       }
+       node = LocateNode(tree, key, &attach_parent, &attach_left);
+       tree->stats.bloom_false_positives += (node == NULL);
+   }
+   else
+   {
+       node = LocateNode(tree, key, &attach_parent, &attach_left);
+   }
 
-      if (tree->root == NULL)
-      {
-        node_to_insert->RedBlack = BLACK;
-        node_to_insert->parent = NULL;
-        tree->root = node_to_insert;
-      }
-      else
-      {
-         node_to_insert->RedBlack = RED;
-         FindOrInsertNodeHelper (tree->root, node_to_insert, &found_node, &insert_depth, 1);
-      }
-  }
+   if (node && !(tree->options & TREE_OPTION_SNAPSHOTS))
+       tree->finger = node;
+   return node;
+}
 
-  if (verbose_enabled >= 3)
-  {
-     printf ("PreFix Tree (after %d %s at depth %d):\n===========\n", node_to_insert->key, found_node?"found":"inserted", insert_depth);
-     PrintTree (tree);
-  }
+TreeNode *FindNode64 (Tree *tree, unsigned long long key)
+{
+   TreeNode *node = FindNodeInMemory(tree, key);
 
-  // If no node found, return node_to_insert as the found node and update tree size.
-  if (found_node == NULL)
-  {
-     found_node = node_to_insert;
-     tree->size++;
-     #ifdef TESTSET_PROFILE
-     total_nodes++;
-     #endif
+   // A spilled node is brought back into memory, so the caller gets a node it can use as any other.
+   if (!node && tree->spill_runs && SpillFindRecord(tree, key))
+       node = FindOrInsertNode64(tree, key);
+   return node;
+}
 
-     // Check Red/Black balance, if we are deep enough in the tree. As root is black,
-     // any child of root is good on insert.
-     int fixed = FixUpTree(tree, node_to_insert);
+/* ReleaseNodeRef, CopyNodeForWrite, SnapshotFindOrInsertNode, SnapshotFixUp - Path copying for TREE_OPTION_SNAPSHOTS trees. Published versions
+   share nodes with the writer's working tree, and refs counts the parents and versions pointing at each node. The writer may change a node in
+   place only if it reached it through nodes that all have refs == 1; anything else is copied first (its children gaining the copy as a second
+   parent), so the nodes a published version can reach never change. Only the root to leaf path of an insert or bit change is copied, plus the
+   uncles FixUpTree recolors. Parent links and the finger are not kept in this mode, rebalancing walks the copied path instead. */
+#define SNAPSHOT_MAX_DEPTH 128
 
-     if ((verbose_enabled >= 3) && fixed)
+static void ReleaseNodeRef (Tree *tree, TreeNode *node)
+{
+    while (node && (--node->refs == 0))
+    {
+        TreeNode *right = node->right;
+        ReleaseNodeRef(tree, node->left);
+        if (node->payload)
+            memory_free(tree, node->payload, tree->bitmap_size_in_bytes);
+        memory_free(tree, node, sizeof(TreeNode));
+        node = right;
+    }
+}
+
+static TreeNode *CopyNodeForWrite (Tree *tree, TreeNode *node)
+{
+    TreeNode *copy;
+
+    if (!node || (node->refs == 1))
+        return node;
+
+    copy = memory_allocate(tree, sizeof(TreeNode));
+    if (!copy)
+        return NULL;
+    *copy = *node;
+    copy->refs = 1;
+    copy->InBlock = 0;
+    if (node->payload)
+    {
+        copy->payload = memory_allocate(tree, tree->bitmap_size_in_bytes);
+        if (!copy->payload)
+        {
+            memory_free(tree, copy, sizeof(TreeNode));
+            return NULL;
+        }
+        memcpy(copy->payload, node->payload, tree->bitmap_size_in_bytes);
+    }
+    if (copy->left)
+        copy->left->refs++;
+    if (copy->right)
+        copy->right->refs++;
+    node->refs--;
+    TREE_STAT(tree->stats.path_copies++);
+    return copy;
+}
+
+static void ReplaceChild (Tree *tree, TreeNode *parent, TreeNode *old_child, TreeNode *new_child)
+{
+    if (!parent)
+        tree->root = new_child;
+    else if (parent->left == old_child)
+        parent->left = new_child;
+    else
+        parent->right = new_child;
+}
+
+static TreeNode *RotateLeftAt (Tree *tree, TreeNode *node)
+{
+    (void) tree; // only used by TREE_STAT
+    TreeNode *right = node->right;
+    node->right = right->left;
+    right->left = node;
+    TREE_STAT(tree->stats.rotations++);
+    return right;
+}
+
+static TreeNode *RotateRightAt (Tree *tree, TreeNode *node)
+{
+    (void) tree; // only used by TREE_STAT
+    TreeNode *left = node->left;
+    node->left = left->right;
+    left->right = node;
+    TREE_STAT(tree->stats.rotations++);
+    return left;
+}
+
+/* Same cases as FixUpTree, with path[0..depth-1] (all writable, path[0] the root) standing in for the parent links. */
+static int SnapshotFixUp (Tree *tree, TreeNode **path, int depth)
+{
+    int idx = depth - 1;
+
+    while ((idx >= 2) && (path[idx]->RedBlack == RED) && (path[idx-1]->RedBlack == RED))
+    {
+        TreeNode *node = path[idx];
+        TreeNode *parent = path[idx-1];
+        TreeNode *grandparent = path[idx-2];
+        TreeNode *great_grandparent = (idx >= 3)?path[idx-3]:NULL;
+        int parent_is_left = (parent == grandparent->left);
+        TreeNode *uncle = (parent_is_left)?grandparent->right:grandparent->left;
+
+        if (uncle && (uncle->RedBlack == RED))
+        {
+            // Case 1: Uncle is red, only recoloring required (on a private copy of the uncle)
+            uncle = CopyNodeForWrite(tree, uncle);
+            if (!uncle)
+                return 0;
+            if (parent_is_left)
+                grandparent->right = uncle;
+            else
+                grandparent->left = uncle;
+            TREE_STAT(tree->stats.recolorings++);
+            grandparent->RedBlack = RED;
+            parent->RedBlack = BLACK;
+            uncle->RedBlack = BLACK;
+            idx -= 2;
+            continue;
+        }
+
+        // Case 2: node on the inner side, rotate it above its parent first
+        if (parent_is_left && (node == parent->right))
+        {
+            grandparent->left = RotateLeftAt(tree, parent);
+            parent = node;
+        }
+        else if (!parent_is_left && (node == parent->left))
+        {
+            grandparent->right = RotateRightAt(tree, parent);
+            parent = node;
+        }
+
+        // Case 3: rotate the grandparent the other way and swap colours
+        ReplaceChild(tree, great_grandparent, grandparent, (parent_is_left)?RotateRightAt(tree, grandparent):RotateLeftAt(tree, grandparent));
+        parent->RedBlack = BLACK;
+        grandparent->RedBlack = RED;
+        break;
+    }
+
+    if (tree->root->RedBlack == RED)
+    {
+        TREE_STAT(tree->stats.recolorings++);
+        tree->root->RedBlack = BLACK;
+    }
+    return 1;
+}
+
+static TreeNode *SnapshotFindOrInsertNode (Tree *tree, unsigned long long key)
+{
+    TreeNode *path[SNAPSHOT_MAX_DEPTH];
+    TreeNode *node;
+    int depth = 0;
+
+    TREE_STAT(tree->stats.lookups++);
+    tree->root = CopyNodeForWrite(tree, tree->root);
+    node = tree->root;
+    while (node)
+    {
+        path[depth++] = node;
+        if (node->key == key)
+        {
+            TREE_STAT(tree->stats.hits++);
+            TREE_STAT(RecordDepth(tree, depth));
+            return node;
+        }
+
+        TreeNode **child = (key < node->key)?&node->left:&node->right;
+        if (*child)
+        {
+            TreeNode *copy = CopyNodeForWrite(tree, *child);
+            if (!copy)
+                return NULL;
+            *child = copy;
+        }
+        node = *child;
+    }
+    TREE_STAT(RecordDepth(tree, depth));
+
+    node = memory_allocate(tree, sizeof(TreeNode));
+    if (!node)
+        return NULL;
+    memset(node, 0, sizeof(TreeNode));
+    node->key = key;
+    node->refs = 1;
+    node->RedBlack = (depth > 0)?RED:BLACK;
+    if (tree->bitmap_size_in_bytes > 0)
+    {
+        node->payload = memory_allocate(tree, tree->bitmap_size_in_bytes);
+        if (!node->payload)
+        {
+            memory_free(tree, node, sizeof(TreeNode));
+            return NULL;
+        }
+        memset(node->payload, 0, tree->bitmap_size_in_bytes);
+    }
+
+    if (depth == 0)
+        tree->root = node;
+    else if (key < path[depth-1]->key)
+        path[depth-1]->left = node;
+    else
+        path[depth-1]->right = node;
+    path[depth++] = node;
+
+    tree->size++;
+    TREE_STAT(tree->stats.inserts++);
+    if (tree->bloom)
+        BloomAdd(tree, key);
+    SnapshotFixUp(tree, path, depth);
+    return node;
+}
+
+/* TreePublish, TreeSnapshot, ReleaseSnapshot, ReclaimVersions - Version handling for TREE_OPTION_SNAPSHOTS trees. The writer publishes its
+   working tree as a new version (one extra reference on the root, O(1)); readers take the published version with TreeSnapshot, also O(1), and
+   keep reading it unchanged however many writes follow. The lock only covers swapping or referencing the published pointer. A version
+   released by its last reader is pushed onto the retired list, and its nodes are freed by the writer on its next publish, so all node
+   reference counts are only ever touched by the writer thread. */
+
+static void ReclaimVersions (Tree *tree)
+{
+    TreeVersion *version = atomic_exchange(&tree->retired, NULL);
+    while (version)
+    {
+        TreeVersion *next = version->next_retired;
+        ReleaseNodeRef(tree, version->root);
+        memory_free(tree, version, sizeof(TreeVersion));
+        version = next;
+    }
+}
+
+int TreePublish (struct Tree *tree)
+{
+    TreeVersion *version;
+    TreeVersion *previous;
+
+    if (!tree || !(tree->options & TREE_OPTION_SNAPSHOTS))
+        return 0;
+
+    version = memory_allocate(tree, sizeof(TreeVersion));
+    if (!version)
+        return 0;
+    version->tree = tree;
+    version->root = tree->root;
+    version->size = tree->size;
+    version->next_retired = NULL;
+    atomic_init(&version->refs, 1);
+    if (tree->root)
+        tree->root->refs++;
+
+    while (atomic_flag_test_and_set_explicit(&tree->publish_lock, memory_order_acquire))
+        ;
+    previous = tree->published;
+    tree->published = version;
+    atomic_flag_clear_explicit(&tree->publish_lock, memory_order_release);
+
+    if (previous)
+        ReleaseSnapshot(previous);
+    ReclaimVersions(tree);
+    TREE_STAT(tree->stats.versions_published++);
+    return 1;
+}
+
+struct TreeVersion *TreeSnapshot (struct Tree *tree)
+{
+    TreeVersion *version = NULL;
+
+    if (tree && (tree->options & TREE_OPTION_SNAPSHOTS))
+    {
+        while (atomic_flag_test_and_set_explicit(&tree->publish_lock, memory_order_acquire))
+            ;
+        version = tree->published;
+        if (version)
+            atomic_fetch_add_explicit(&version->refs, 1, memory_order_relaxed);
+        atomic_flag_clear_explicit(&tree->publish_lock, memory_order_release);
+    }
+    return version;
+}
+
+void ReleaseSnapshot (struct TreeVersion *snapshot)
+{
+    if (snapshot && (atomic_fetch_sub_explicit(&snapshot->refs, 1, memory_order_acq_rel) == 1))
+    {
+        Tree *tree = snapshot->tree;
+        TreeVersion *head = atomic_load(&tree->retired);
+        do
+        {
+            snapshot->next_retired = head;
+        } while (!atomic_compare_exchange_weak(&tree->retired, &head, snapshot));
+    }
+}
+
+unsigned int CheckBitSnapshot (struct TreeVersion *snapshot, unsigned long long total_bit_offset)
+{
+    if (snapshot)
+    {
+        Tree *tree = snapshot->tree;
+        unsigned long long key = total_bit_offset >> tree->bitmap_idx_size;
+        TreeNode *node = snapshot->root;
+
+        while (node && (node->key != key))
+            node = (key < node->key)?node->left:node->right;
+        if (node)
+            return CheckSubBit(tree, node, (unsigned int) (total_bit_offset & tree->sub_bit_mask));
+    }
+    return 0;
+}
+
+int SnapshotNodes (struct TreeVersion *snapshot)
+{
+    return (snapshot)?snapshot->size:0;
+}
+
+/* FindOrInsertNode - Given a valid tree, find the node for key or insert a new (cleared) one, rebalance and return it. The node is only allocated
+   once the search has shown the key to be absent. */
+
+TreeNode *FindOrInsertNode (struct Tree *tree, unsigned int key)
+{
+  return FindOrInsertNode64(tree, key);
+}
+
+TreeNode *FindOrInsertNode64 (struct Tree *tree, unsigned long long key)
+{
+  TreeNode *found_node = NULL;
+  TreeNode *attach_parent = NULL;
+  int attach_left = 0;
+
+  if (!tree)
+      return NULL;
+  if (tree->options & TREE_OPTION_SNAPSHOTS)
+      return SnapshotFindOrInsertNode(tree, key);
+  if (tree->memory_budget)
+      SpillIfOverBudget(tree);
+
+  if (tree->hash_control && !(tree->finger && (tree->finger->key == key)))
+  {
+      found_node = HashIndexFind(tree, key);
+      if (found_node)
+      {
+          TREE_STAT(tree->stats.lookups++);
+          TREE_STAT(tree->stats.hits++);
+          TREE_TRACE(TREE_TRACE_FIND, key, 0, 1);
+          tree->finger = found_node;
+          return found_node;
+      }
+  }
+
+  found_node = LocateNode(tree, key, &attach_parent, &attach_left);
+  if (found_node)
+  {
+      tree->finger = found_node;
+      return found_node;
+  }
+
+  found_node = memory_allocate(tree, sizeof(TreeNode));
+  if (!found_node)
+      return NULL;
+
+  found_node->left = found_node->right = NULL;
+  found_node->parent = attach_parent;
+  found_node->RedBlack = RED;
+  found_node->InBlock = 0;
+  found_node->key = key;
+  found_node->payload = NULL;
+  tree->compacted = 0;
+  if (tree->bitmap_size_in_bytes > 0)
+  {
+     found_node->payload = memory_allocate(tree, tree->bitmap_size_in_bytes);
+     if (!found_node->payload)
      {
-        printf ("PostFix Tree:\n============\n");
-        PrintTree (tree);
+         memory_free(tree, found_node, sizeof(TreeNode));
+         return NULL;
      }
+     memset(found_node->payload, 0, tree->bitmap_size_in_bytes);
+  }
+  if (tree->spill_runs)
+  {
+     const unsigned char *spilled_payload = SpillFindRecord(tree, key);
+     if (spilled_payload && found_node->payload)
+        memcpy(found_node->payload, spilled_payload, tree->bitmap_size_in_bytes);
+  }
+
+  if (attach_parent == NULL)
+  {
+    found_node->RedBlack = BLACK;
+    tree->root = found_node;
+  }
+  else if (attach_left)
+  {
+    attach_parent->left = found_node;
   }
   else
   {
-      // this entity was already insert into the tree. Release memory for the insert attempt and return the node found.
-      verbose_printf (1,"Found node:%p\n", found_node);
-      if (node_to_insert->payload)
-        memory_free(node_to_insert->payload, tree->bitmap_size_in_bytes);
-      memory_free(node_to_insert, sizeof(TreeNode));
-      node_to_insert = NULL;
+    attach_parent->right = found_node;
   }
+
+  if (!tree->rightmost || (key > tree->rightmost->key))
+     tree->rightmost = found_node;
+  if (tree->bloom)
+     BloomAdd(tree, key);
+  if (tree->hash_control)
+     HashIndexInsert(tree, found_node);
+  tree->finger = found_node;
+  tree->size++;
+  TREE_STAT(tree->stats.inserts++);
+
+  // Check Red/Black balance, if we are deep enough in the tree. As root is black,
+  // any child of root is good on insert.
+  int fixed = FixUpTree(tree, found_node);
+
+  TREE_TRACE(TREE_TRACE_INSERT, key, tree->size, fixed);
   return found_node;
 }
 
 
-/* CheckSubBits, SetSubBits - If a tree node has been found, allow access to the internal bitmap with a bit offset within range of the bitmap within the node.
-    CheckSubBit expects a bit range from 0 to the size of the bits stored per notde, as dones SetSubBit. already_present will return true of the bit was
-    already set before the interface was called. */
-unsigned int CheckSubBit(Tree *tree, TreeNode *tree_node, unsigned int sub_bit_offset)
+/* PayloadCount, PayloadSetCount - The counter_bits wide count of a sub bit offset in a payload (for a plain bitmap, counter_bits is 1 and the count
+   is the bit). Counters of 1, 4 or 8 bits never straddle a byte. */
+static unsigned int PayloadCount (const unsigned char *payload, unsigned int sub_bit_offset, unsigned int counter_bits)
+{
+    unsigned int bit = sub_bit_offset * counter_bits;
+    return (payload[bit / 8] >> (bit % 8)) & ((1u << counter_bits) - 1);
+}
+
+static void PayloadSetCount (unsigned char *payload, unsigned int sub_bit_offset, unsigned int counter_bits, unsigned int count)
+{
+    unsigned int bit = sub_bit_offset * counter_bits;
+    unsigned int mask = ((1u << counter_bits) - 1) << (bit % 8);
+    payload[bit / 8] = (unsigned char) ((payload[bit / 8] & ~mask) | ((count << (bit % 8)) & mask));
+}
+
+/* CheckSubBits, SetSubBits - If a tree node has been found, allow access to the internal bitmap with a bit offset within range of the bitmap within the node.
+    CheckSubBit expects a bit range from 0 to the size of the bits stored per notde, as dones SetSubBit. already_present will return true of the bit was
+    already set before the interface was called. On a TREE_OPTION_COUNTERS tree a bit is set while its count is non zero. */
+unsigned int CheckSubBit(Tree *tree, TreeNode *tree_node, unsigned int sub_bit_offset)
+{
+    unsigned int return_code = 0;
+    if (tree && tree_node && (tree_node->payload) && (sub_bit_offset < tree->bitmap_size_per_node))
+    {
+        return_code = (PayloadCount(tree_node->payload, sub_bit_offset, tree->counter_bits) != 0);
+    }
+    return return_code;
+}
+
+unsigned int SetSubBit(Tree * tree, TreeNode *tree_node, unsigned int sub_bit_offset, unsigned int value, unsigned int *already_present)
+{
+    unsigned int return_code = 0;
+
+    if (already_present)
+        *already_present = 0;
+
+    if (tree && tree_node && (tree_node->payload) && (sub_bit_offset < tree->bitmap_size_per_node))
+    {
+        unsigned int count = PayloadCount(tree_node->payload, sub_bit_offset, tree->counter_bits);
+        if ((value % 2) == 1)
+        {
+           if (already_present)
+              *already_present = (count != 0);
+           if (count == 0)
+              PayloadSetCount(tree_node->payload, sub_bit_offset, tree->counter_bits, 1);
+        }
+        else
+        {
+            PayloadSetCount(tree_node->payload, sub_bit_offset, tree->counter_bits, 0);
+        };
+        return_code = 1;
+    }
+    return return_code;
+}
+
+/* ClearSubBits - Set all bits from 0 to the number of bits per node to 0 */
+void ClearSubBits(Tree *tree, TreeNode *tree_node)
+{
+    if (tree && tree_node)
+    {
+        memset(tree_node->payload, 0, tree->bitmap_size_in_bytes);
+    }
+}
+
+/* CheckBit, SetBit - If a tree is valid, allow access to the internal bitmap with a bit offset within total bit offset range (effectively (key << bitmap_idx_size) | sub_bit_offset).
+ This is the standard access to the TreeSet. CheckBit64/SetBit64 take the whole 64 bit offset, CheckBit96/SetBit96 take the node key (upper 64 bits) and
+ sub bit offset (lower 32 bits) separately for ranges wider than that. The split uses the shift and mask precomputed in CreateTree. They use the CheckSubBit
+ and SetSubBit interfaces introduced previously. */
+
+unsigned int CheckBit96 (Tree *tree, unsigned long long key, unsigned int sub_bit_offset)
+{
+   unsigned int found = 0;
+   TreeNode *check_node = FindNodeInMemory(tree, key);
+   if (check_node)
+   {
+       found = CheckSubBit(tree, check_node, sub_bit_offset);
+   }
+   else if (tree->spill_runs && (sub_bit_offset < tree->bitmap_size_per_node))
+   {
+       // Spilled nodes are read in place, checking bits never brings them back into memory.
+       const unsigned char *spilled_payload = SpillFindRecord(tree, key);
+       if (spilled_payload)
+           found = (PayloadCount(spilled_payload, sub_bit_offset, tree->counter_bits) != 0);
+   }
+   TREE_TRACE(TREE_TRACE_CHECK_BIT, key, sub_bit_offset, found);
+   return found;
+}
+
+void SetBit96 (Tree *tree, unsigned long long key, unsigned int sub_bit_offset, unsigned int value, unsigned int *already_set)
+{
+   unsigned int was_set = 0;
+
+   // With snapshots, a write that changes nothing must not copy the path, and one that does is published straight away.
+   if (tree->options & TREE_OPTION_SNAPSHOTS)
+   {
+       TreeNode *existing = FindNode64(tree, key);
+       if (existing && (CheckSubBit(tree, existing, sub_bit_offset) == (value % 2)))
+       {
+           if (already_set)
+               *already_set = (value % 2);
+           TREE_TRACE(TREE_TRACE_SET_BIT, key, sub_bit_offset, (value % 2) * 3);
+           return;
+       }
+   }
+
+   TreeNode *check_node = FindOrInsertNode64(tree, key);
+   if (check_node)
+   {
+       SetSubBit(tree, check_node, sub_bit_offset, value, &was_set);
+       if (tree->options & TREE_OPTION_SNAPSHOTS)
+           TreePublish(tree);
+   }
+   if (already_set)
+       *already_set = was_set;
+   TREE_TRACE(TREE_TRACE_SET_BIT, key, sub_bit_offset, (value % 2) | (was_set << 1));
+}
+
+unsigned int CheckBit64 (Tree *tree, unsigned long long total_bit_offset)
+{
+   return CheckBit96(tree, total_bit_offset >> tree->bitmap_idx_size, (unsigned int) (total_bit_offset & tree->sub_bit_mask));
+}
+
+void SetBit64 (Tree *tree, unsigned long long total_bit_offset, unsigned int value, unsigned int *already_set)
+{
+   SetBit96(tree, total_bit_offset >> tree->bitmap_idx_size, (unsigned int) (total_bit_offset & tree->sub_bit_mask), value, already_set);
+}
+
+/* IncrementBit, GetCount - Counting access (TREE_OPTION_COUNTERS). The counter saturates at its largest value, so an increment there changes
+   nothing (and publishes nothing on a snapshot tree). */
+unsigned int IncrementBit (Tree *tree, unsigned long long total_bit_offset)
+{
+   unsigned long long key;
+   unsigned int sub_bit_offset, previous = 0;
+   unsigned int count_max;
+   TreeNode *node;
+
+   if (!tree)
+       return 0;
+   key = total_bit_offset >> tree->bitmap_idx_size;
+   sub_bit_offset = (unsigned int) (total_bit_offset & tree->sub_bit_mask);
+   count_max = (1u << tree->counter_bits) - 1;
+   if (sub_bit_offset >= tree->bitmap_size_per_node)
+       return 0;
+
+   if (tree->options & TREE_OPTION_SNAPSHOTS)
+   {
+       node = FindNode64(tree, key);
+       if (node && (PayloadCount(node->payload, sub_bit_offset, tree->counter_bits) == count_max))
+           return count_max;
+   }
+
+   node = FindOrInsertNode64(tree, key);
+   if (node && node->payload)
+   {
+       previous = PayloadCount(node->payload, sub_bit_offset, tree->counter_bits);
+       if (previous < count_max)
+       {
+           PayloadSetCount(node->payload, sub_bit_offset, tree->counter_bits, previous + 1);
+           if (tree->options & TREE_OPTION_SNAPSHOTS)
+               TreePublish(tree);
+       }
+   }
+   return previous;
+}
+
+unsigned int GetCount (Tree *tree, unsigned long long total_bit_offset)
+{
+   unsigned long long key;
+   unsigned int sub_bit_offset;
+   TreeNode *node;
+
+   if (!tree)
+       return 0;
+   key = total_bit_offset >> tree->bitmap_idx_size;
+   sub_bit_offset = (unsigned int) (total_bit_offset & tree->sub_bit_mask);
+   if (sub_bit_offset >= tree->bitmap_size_per_node)
+       return 0;
+
+   node = FindNodeInMemory(tree, key);
+   if (node)
+       return (node->payload)?PayloadCount(node->payload, sub_bit_offset, tree->counter_bits):0;
+   if (tree->spill_runs)
+   {
+       const unsigned char *spilled_payload = SpillFindRecord(tree, key);
+       if (spilled_payload)
+           return PayloadCount(spilled_payload, sub_bit_offset, tree->counter_bits);
+   }
+   return 0;
+}
+
+unsigned int CheckBit (Tree *tree, unsigned int total_bit_offset)
+{
+   return CheckBit64(tree, total_bit_offset);
+}
+
+void SetBit (Tree *tree, unsigned int total_bit_offset, unsigned int value, unsigned int *already_set)
+{
+   SetBit64(tree, total_bit_offset, value, already_set);
+}
+
+/* LocateNodesInterleaved, CheckBitsInterleaved, SetBitsInterleaved - Batched lookups for offsets in random order. A single descent is a chain
+   of dependent cache misses; here up to TREE_INTERLEAVE_GROUP descents advance one level per round, each prefetching the child it moves to,
+   so the misses of the whole group overlap instead of queueing. The finger and Bloom filter are bypassed (neither helps random batches). */
+#define TREE_INTERLEAVE_GROUP 16
+
+#if defined(__GNUC__) || defined(__clang__)
+#define PREFETCH(address) __builtin_prefetch(address)
+#elif defined(_MSC_VER)
+#include <xmmintrin.h>
+#define PREFETCH(address) _mm_prefetch((const char *) (address), _MM_HINT_T0)
+#else
+#define PREFETCH(address) ((void) 0)
+#endif
+
+// Fill found[0..count-1] (count <= TREE_INTERLEAVE_GROUP) with the node holding each offset's key, or NULL.
+static void LocateNodesInterleaved (Tree *tree, const unsigned long long *offsets, unsigned int count, TreeNode **found)
+{
+    unsigned long long keys[TREE_INTERLEAVE_GROUP];
+    unsigned int pending[TREE_INTERLEAVE_GROUP];
+    unsigned int pending_count = 0;
+
+    for (unsigned int idx=0;idx<count;idx++)
+    {
+        keys[idx] = offsets[idx] >> tree->bitmap_idx_size;
+        found[idx] = tree->root;
+        pending[pending_count++] = idx;
+    }
+    TREE_STAT(tree->stats.lookups += count);
+
+    // With a hash index there is no descent to interleave, prefetching every first probed group before any is read does the same job.
+    if (tree->hash_control)
+    {
+        for (unsigned int idx=0;idx<count;idx++)
+        {
+            size_t group = HashFirstGroup(tree, BloomHash(keys[idx]));
+            PREFETCH(tree->hash_control + (group * HASH_GROUP_SLOTS));
+            PREFETCH(tree->hash_slots + (group * HASH_GROUP_SLOTS));
+        }
+        for (unsigned int idx=0;idx<count;idx++)
+        {
+            found[idx] = HashIndexFind(tree, keys[idx]);
+            if (found[idx] && found[idx]->payload)
+                PREFETCH(found[idx]->payload);
+            TREE_STAT(tree->stats.hits += (found[idx] != NULL));
+        }
+        return;
+    }
+
+    while (pending_count > 0)
+    {
+        unsigned int still_pending = 0;
+        for (unsigned int pos=0;pos<pending_count;pos++)
+        {
+            unsigned int idx = pending[pos];
+            TreeNode *node = found[idx];
+
+            if (!node)
+                continue;
+            if (node->key == keys[idx])
+            {
+                if (node->payload)
+                    PREFETCH(node->payload);
+                TREE_STAT(tree->stats.hits++);
+                continue;
+            }
+            node = (keys[idx] < node->key)?node->left:node->right;
+            if (node)
+                PREFETCH(node);
+            found[idx] = node;
+            pending[still_pending++] = idx;
+        }
+        pending_count = still_pending;
+    }
+}
+
+void CheckBitsInterleaved (struct Tree *tree, const unsigned long long *offsets, unsigned int count, unsigned char *results)
+{
+    TreeNode *found[TREE_INTERLEAVE_GROUP];
+
+    if (!tree || !offsets || !results)
+        return;
+
+    for (unsigned int first=0;first<count;first+=TREE_INTERLEAVE_GROUP)
+    {
+        unsigned int group = ((count - first) < TREE_INTERLEAVE_GROUP)?(count - first):TREE_INTERLEAVE_GROUP;
+        LocateNodesInterleaved(tree, offsets + first, group, found);
+        for (unsigned int idx=0;idx<group;idx++)
+        {
+            if (found[idx])
+                results[first + idx] = (unsigned char) CheckSubBit(tree, found[idx], (unsigned int) (offsets[first + idx] & tree->sub_bit_mask));
+            else
+                results[first + idx] = (tree->spill_runs)?(unsigned char) CheckBit64(tree, offsets[first + idx]):0;
+        }
+    }
+}
+
+void SetBitsInterleaved (struct Tree *tree, const unsigned long long *offsets, unsigned int count, unsigned int value, unsigned char *already_set)
+{
+    TreeNode *found[TREE_INTERLEAVE_GROUP];
+
+    if (!tree || !offsets)
+        return;
+
+    for (unsigned int first=0;first<count;first+=TREE_INTERLEAVE_GROUP)
+    {
+        unsigned int group = ((count - first) < TREE_INTERLEAVE_GROUP)?(count - first):TREE_INTERLEAVE_GROUP;
+
+        // Missing nodes are inserted one at a time through SetBit64. On a plain tree an insert only links a new node, so the pointers found
+        // for the rest of the group stay valid. Snapshot trees copy (and may free) nodes on every write, and a tree with a memory_budget may
+        // spill (free and rebuild its nodes) before any insert, so both take SetBit64 for everything.
+        if ((tree->options & TREE_OPTION_SNAPSHOTS) || tree->memory_budget)
+            memset(found, 0, sizeof(found));
+        else
+            LocateNodesInterleaved(tree, offsets + first, group, found);
+        for (unsigned int idx=0;idx<group;idx++)
+        {
+            unsigned long long offset = offsets[first + idx];
+            unsigned int was_set = 0;
+
+            if (found[idx])
+                SetSubBit(tree, found[idx], (unsigned int) (offset & tree->sub_bit_mask), value, &was_set);
+            else
+                SetBit64(tree, offset, value, &was_set);
+            if (already_set)
+                already_set[first + idx] = (unsigned char) was_set;
+        }
+    }
+}
+
+/* AllocateNodeBlock, LinkSortedNodes, BuildTreeFromSorted, BuildTreeFromSortedBits - Bulk load a tree from keys that are already in order.
+   All nodes and payloads come from one TreeBlock laid out in key (in-order) order, and the links are built bottom-up by always
+   taking the middle element as the subtree root. Subtree sizes then never differ by more than one, so every empty child sits at
+   depth red_depth or red_depth+1 (red_depth = floor(log2(count+1))). Colouring the nodes on the partial last level RED and every
+   other node BLACK gives each root-to-leaf path the same number of black nodes with no red node having a red child, so the result
+   is a valid RedBlack tree without a single FixUpTree call. */
+
+static TreeNode *AllocateNodeBlock (Tree *tree, unsigned int count)
+{
+    size_t block_size = sizeof(TreeBlock) + (count * sizeof(TreeNode)) + ((size_t) count * tree->bitmap_size_in_bytes);
+    TreeBlock *block = memory_allocate(tree, block_size);
+    TreeNode *nodes = NULL;
+
+    if (block)
+    {
+        memset(block, 0, block_size);
+        block->size = block_size;
+        block->next = tree->blocks;
+        tree->blocks = block;
+
+        nodes = (TreeNode *) (block + 1);
+        unsigned char *payloads = (unsigned char *) (nodes + count);
+        for (unsigned int idx=0;idx<count;idx++)
+        {
+            nodes[idx].InBlock = 1;
+            nodes[idx].payload = (tree->bitmap_size_in_bytes > 0)?(payloads + ((size_t) idx * tree->bitmap_size_in_bytes)):NULL;
+        }
+    }
+    return nodes;
+}
+
+static TreeNode *LinkSortedNodes (TreeNode *nodes, int low, int high, TreeNode *parent, unsigned int depth, unsigned int red_depth)
+{
+    TreeNode *node = NULL;
+    if (low <= high)
+    {
+        int middle = low + ((high - low) / 2);
+        node = &nodes[middle];
+        node->parent = parent;
+        node->RedBlack = (depth == red_depth)?RED:BLACK;
+        node->left = LinkSortedNodes(nodes, low, middle-1, node, depth+1, red_depth);
+        node->right = LinkSortedNodes(nodes, middle+1, high, node, depth+1, red_depth);
+    }
+    return node;
+}
+
+static void LinkTreeFromBlock (Tree *tree, TreeNode *nodes, unsigned int count)
+{
+    unsigned int red_depth = CountBitSize(count + 1) - 1;
+    tree->root = LinkSortedNodes(nodes, 0, (int) count - 1, NULL, 0, red_depth);
+    tree->rightmost = (count > 0)?&nodes[count-1]:NULL;
+    tree->size = count;
+    tree->compacted = 0;
+    for (unsigned int idx=0;tree->bloom && (idx<count);idx++)
+        BloomAdd(tree, nodes[idx].key);
+    HashIndexRebuild(tree);
+}
+
+/* BuildTreeFromSorted - keys must be strictly ascending. payloads (optional) holds count consecutive bitmaps of bitmap_size_in_bytes
+   each ((bitmap_size_per_node + 7) / 8), in the same order as keys. */
+struct Tree *BuildTreeFromSorted (const unsigned long long *keys, const unsigned char *payloads, unsigned int count, unsigned int bitmap_size_per_node)
+{
+    Tree *tree = NULL;
+
+    for (unsigned int idx=1;keys && (idx<count);idx++)
+    {
+        if (keys[idx] <= keys[idx-1])
+        {
+            printf("BuildTreeFromSorted: key %llu at index %u is not above the previous key %llu.\n", keys[idx], idx, keys[idx-1]);
+            return NULL;
+        }
+    }
+
+    tree = CreateTree(bitmap_size_per_node);
+    if (tree && keys && (count > 0))
+    {
+        TreeNode *nodes = AllocateNodeBlock(tree, count);
+        if (!nodes)
+        {
+            DestroyTree(tree);
+            return NULL;
+        }
+
+        for (unsigned int idx=0;idx<count;idx++)
+        {
+            nodes[idx].key = keys[idx];
+            if (payloads && nodes[idx].payload)
+                memcpy(nodes[idx].payload, payloads + ((size_t) idx * tree->bitmap_size_in_bytes), tree->bitmap_size_in_bytes);
+        }
+        LinkTreeFromBlock(tree, nodes, count);
+    }
+    return tree;
+}
+
+/* BuildTreeFromSortedBits - Same as BuildTreeFromSorted but from total bit offsets (as given to SetBit) in ascending order. Repeated
+   offsets are allowed, so a sorted stream of already seen values can be loaded as is. */
+struct Tree *BuildTreeFromSortedBits (const unsigned long long *bit_offsets, unsigned int count, unsigned int bitmap_size_per_node)
+{
+    Tree *tree = CreateTree(bitmap_size_per_node);
+    unsigned int node_count = 0;
+
+    if (!tree || !bit_offsets || (count == 0))
+        return tree;
+
+    for (unsigned int idx=0;idx<count;idx++)
+    {
+        if ((idx > 0) && (bit_offsets[idx] < bit_offsets[idx-1]))
+        {
+            printf("BuildTreeFromSortedBits: offset %llu at index %u is below the previous offset %llu.\n", bit_offsets[idx], idx, bit_offsets[idx-1]);
+            DestroyTree(tree);
+            return NULL;
+        }
+        if ((idx == 0) || ((bit_offsets[idx] >> tree->bitmap_idx_size) != (bit_offsets[idx-1] >> tree->bitmap_idx_size)))
+            node_count++;
+    }
+
+    TreeNode *nodes = AllocateNodeBlock(tree, node_count);
+    if (!nodes)
+    {
+        DestroyTree(tree);
+        return NULL;
+    }
+
+    int node_idx = -1;
+    for (unsigned int idx=0;idx<count;idx++)
+    {
+        unsigned long long key = bit_offsets[idx] >> tree->bitmap_idx_size;
+        if ((node_idx < 0) || (nodes[node_idx].key != key))
+        {
+            nodes[++node_idx].key = key;
+        }
+        SetSubBit(tree, &nodes[node_idx], (unsigned int) (bit_offsets[idx] & tree->sub_bit_mask), 1, NULL);
+    }
+    LinkTreeFromBlock(tree, nodes, node_count);
+    return tree;
+}
+/* CompactTree - Relocate all nodes and payloads into one new TreeBlock, rebalanced as BuildTreeFromSorted would build them and laid out in
+   van Emde Boas order: the top half of the levels first, then each subtree hanging below them, each recursively in the same way. A descent
+   then crosses a new cache line or page only every few levels, instead of at almost every node as it does once random order inserts have
+   scattered the nodes over the heap. The payloads follow all the nodes, in the same order. */
+typedef struct CompactLayout {
+    TreeNode     **sorted;       // the old nodes in key order
+    unsigned int  *position;     // sorted index -> index of its relocated node in nodes
+    TreeNode      *nodes;
+    unsigned int   next;         // next free index in nodes
+    unsigned int   red_depth;    // as in LinkTreeFromBlock
+    unsigned int   payload_bytes;
+    TreeNode      *old_finger;
+    TreeNode      *finger;
+} CompactLayout;
+
+static void CompactLayoutLevels (CompactLayout *layout, int low, int high, unsigned int levels);
+
+/* Lay out the subtrees rooted depth levels below the balanced subtree over sorted[low..high], levels deep each, left to right. */
+static void CompactLayoutBelow (CompactLayout *layout, int low, int high, unsigned int depth, unsigned int levels)
+{
+    if (low > high)
+        return;
+    if (depth == 0)
+    {
+        CompactLayoutLevels(layout, low, high, levels);
+        return;
+    }
+    int middle = low + ((high - low) / 2);
+    CompactLayoutBelow(layout, low, middle-1, depth-1, levels);
+    CompactLayoutBelow(layout, middle+1, high, depth-1, levels);
+}
+
+/* Assign positions to the top levels of the balanced subtree over sorted[low..high], in van Emde Boas order. */
+static void CompactLayoutLevels (CompactLayout *layout, int low, int high, unsigned int levels)
+{
+    if ((low > high) || (levels == 0))
+        return;
+    if (levels == 1)
+    {
+        layout->position[low + ((high - low) / 2)] = layout->next++;
+        return;
+    }
+    CompactLayoutLevels(layout, low, high, levels / 2);
+    CompactLayoutBelow(layout, low, high, levels / 2, levels - (levels / 2));
+}
+
+/* Copy the old nodes into their positions and link them as LinkSortedNodes would. */
+static TreeNode *CompactLink (CompactLayout *layout, int low, int high, TreeNode *parent, unsigned int depth)
+{
+    TreeNode *node = NULL;
+    if (low <= high)
+    {
+        int middle = low + ((high - low) / 2);
+        TreeNode *old_node = layout->sorted[middle];
+        node = &layout->nodes[layout->position[middle]];
+        node->key = old_node->key;
+        if (layout->payload_bytes > 0)
+            memcpy(node->payload, old_node->payload, layout->payload_bytes);
+        if (old_node == layout->old_finger)
+            layout->finger = node;
+        node->parent = parent;
+        node->RedBlack = (depth == layout->red_depth)?RED:BLACK;
+        node->left = CompactLink(layout, low, middle-1, node, depth+1);
+        node->right = CompactLink(layout, middle+1, high, node, depth+1);
+    }
+    return node;
+}
+
+unsigned int CompactTree (struct Tree *tree)
+{
+    CompactLayout layout;
+    TreeBlock *old_blocks;
+    TreeNode *old_root;
+    unsigned int count = 0;
+
+    if (!tree || (tree->options & TREE_OPTION_SNAPSHOTS) || (tree->size == 0))
+        return 0;
+    if (tree->compacted)
+        return (unsigned int) tree->size;
+
+    layout.sorted = malloc((size_t) tree->size * sizeof(TreeNode *));
+    layout.position = malloc((size_t) tree->size * sizeof(unsigned int));
+    if (!layout.sorted || !layout.position)
+    {
+        free(layout.sorted);
+        free(layout.position);
+        return 0;
+    }
+    CollectNodes(tree->root, layout.sorted, &count);
+
+    // The new block is allocated before anything is freed, so a failure leaves the tree as it was.
+    old_blocks = tree->blocks;
+    tree->blocks = NULL;
+    layout.nodes = AllocateNodeBlock(tree, count);
+    if (!layout.nodes)
+    {
+        tree->blocks = old_blocks;
+        free(layout.sorted);
+        free(layout.position);
+        return 0;
+    }
+    layout.next = 0;
+    layout.red_depth = CountBitSize(count + 1) - 1;
+    layout.payload_bytes = tree->bitmap_size_in_bytes;
+    layout.old_finger = tree->finger;
+    layout.finger = NULL;
+    CompactLayoutLevels(&layout, 0, (int) count - 1, CountBitSize(count));
+
+    old_root = tree->root;
+    tree->root = CompactLink(&layout, 0, (int) count - 1, NULL, 0);
+    tree->finger = layout.finger;
+    tree->rightmost = &layout.nodes[layout.position[count-1]];
+    DestroyNode(tree, old_root);
+    while (old_blocks)
+    {
+        TreeBlock *next = old_blocks->next;
+        memory_free(tree, old_blocks, old_blocks->size);
+        old_blocks = next;
+    }
+    tree->size = count;
+    tree->compacted = 1;
+    HashIndexRebuild(tree);
+    free(layout.sorted);
+    free(layout.position);
+    verbose_printf(1, "CompactTree: %u nodes relocated, %lu bytes allocated.\n", count, (unsigned long) tree->stats.bytes_allocated);
+    return count;
+}
+
+/* Spill mode (TREE_OPTION_SPILL) - When the nodes and their bitmaps take more than memory_budget, SpillTree writes the coldest half of the nodes (the end of the key
+   range away from the last accessed node) to a sorted run file and rebuilds the tree from the rest. A run is a sequence of fixed size records
+   (key, then bitmap) in key order, read a page at a time; the first key of every page is kept in memory as a sparse index, and pages read are
+   held in a small LRU cache of up to SPILL_CACHE_PAGES (taking no more than a quarter of the budget). Lookups that miss in memory check the runs newest first (a key spilled more than once is
+   only current in its newest run). Setting a bit of a spilled node brings the node back into memory with its bitmap, so the tree always holds
+   the current copy of anything it changes. Once there are more than SPILL_MAX_RUNS runs they are merged into one, keeping misses cheap. */
+#ifdef _WIN32
+#define SPILL_FSEEK(fp, offset) _fseeki64((fp), (long long) (offset), SEEK_SET)
+#else
+#define SPILL_FSEEK(fp, offset) fseeko((fp), (off_t) (offset), SEEK_SET)
+#endif
+
+typedef struct SpillRun {
+    struct SpillRun    *next;              // next older run
+    FILE               *fp;
+    char               *path;              // NULL for tmpfile() runs, otherwise removed with the run
+    unsigned long long  records;
+    unsigned long long  pages;
+    unsigned long long  index_capacity;
+    unsigned long long *page_first_keys;   // sparse index: first key of each page
+    unsigned long long  last_key;
+} SpillRun;
+
+typedef struct SpillPage {
+    SpillRun          *run;
+    unsigned long long page;
+    unsigned int       records;
+    unsigned long long last_use;
+    unsigned char     *data;
+} SpillPage;
+
+static size_t SpillRecordSize (Tree *tree)
+{
+    return sizeof(unsigned long long) + tree->bitmap_size_in_bytes;
+}
+
+static unsigned int SpillRecordsPerPage (Tree *tree)
+{
+    size_t records = SPILL_PAGE_BYTES / SpillRecordSize(tree);
+    return (records > 0)?(unsigned int) records:1;
+}
+
+static void SpillCloseRun (SpillRun *run)
+{
+    if (run)
+    {
+        if (run->fp)
+            fclose(run->fp);
+        if (run->path)
+        {
+            remove(run->path);
+            free(run->path);
+        }
+        free(run->page_first_keys);
+        free(run);
+    }
+}
+
+static SpillRun *SpillCreateRun (Tree *tree)
+{
+    SpillRun *run = calloc(1, sizeof(SpillRun));
+
+    if (!run)
+        return NULL;
+    if (tree->spill_directory)
+    {
+        size_t path_size = strlen(tree->spill_directory) + 96;
+        run->path = malloc(path_size);
+        if (run->path)
+        {
+            // Process id and tree address keep the names of trees spilling into the same directory apart, without shared state.
+            snprintf(run->path, path_size, "%s/treeset_%ld_%p_%u.run", tree->spill_directory, (long) getpid(), (void *) tree, tree->spill_run_id++);
+            run->fp = fopen(run->path, "wb+");
+        }
+    }
+    else
+    {
+        run->fp = tmpfile();
+    }
+    if (!run->fp)
+    {
+        printf("SpillTree: cannot create a run file%s%s.\n", (run->path)?" ":"", (run->path)?run->path:"");
+        SpillCloseRun(run);
+        return NULL;
+    }
+    return run;
+}
+
+static int SpillAppend (Tree *tree, SpillRun *run, unsigned long long key, const unsigned char *payload)
+{
+    if ((run->records % SpillRecordsPerPage(tree)) == 0)
+    {
+        if (run->pages == run->index_capacity)
+        {
+            unsigned long long capacity = (run->index_capacity > 0)?run->index_capacity*2:64;
+            unsigned long long *index = realloc(run->page_first_keys, capacity * sizeof(unsigned long long));
+            if (!index)
+                return 0;
+            run->page_first_keys = index;
+            run->index_capacity = capacity;
+        }
+        run->page_first_keys[run->pages++] = key;
+    }
+    if ((fwrite(&key, sizeof(key), 1, run->fp) != 1) ||
+        ((tree->bitmap_size_in_bytes > 0) && (fwrite(payload, tree->bitmap_size_in_bytes, 1, run->fp) != 1)))
+        return 0;
+    run->records++;
+    run->last_key = key;
+    return 1;
+}
+
+static int SpillFinishRun (Tree *tree, SpillRun *run)
+{
+    if (fflush(run->fp) != 0)
+        return 0;
+    run->next = tree->spill_runs;
+    tree->spill_runs = run;
+    tree->spill_run_count++;
+    return 1;
+}
+
+static SpillPage *SpillLoadPage (Tree *tree, SpillRun *run, unsigned long long page)
+{
+    SpillPage *victim = NULL;
+    size_t record_size = SpillRecordSize(tree);
+    unsigned int per_page = SpillRecordsPerPage(tree);
+
+    if (!tree->spill_cache)
+    {
+        tree->spill_cache = memory_allocate(tree, tree->spill_cache_pages * sizeof(SpillPage));
+        if (!tree->spill_cache)
+            return NULL;
+        memset(tree->spill_cache, 0, tree->spill_cache_pages * sizeof(SpillPage));
+    }
+
+    tree->spill_tick++;
+    for (unsigned int idx=0;idx<tree->spill_cache_pages;idx++)
+    {
+        SpillPage *entry = &tree->spill_cache[idx];
+        if ((entry->run == run) && (entry->page == page))
+        {
+            entry->last_use = tree->spill_tick;
+            return entry;
+        }
+        if (!victim || (entry->last_use < victim->last_use))
+            victim = entry;
+    }
+
+    if (!victim->data)
+    {
+        victim->data = memory_allocate(tree, per_page * record_size);
+        if (!victim->data)
+            return NULL;
+    }
+    victim->run = NULL;
+    victim->records = (unsigned int) (((run->records - (page * per_page)) < per_page)?(run->records - (page * per_page)):per_page);
+    if ((SPILL_FSEEK(run->fp, page * per_page * record_size) != 0) || (fread(victim->data, record_size, victim->records, run->fp) != victim->records))
+    {
+        printf("SpillTree: cannot read page %llu of a run file.\n", page);
+        return NULL;
+    }
+    victim->run = run;
+    victim->page = page;
+    victim->last_use = tree->spill_tick;
+    tree->stats.spill_page_reads++;
+    return victim;
+}
+
+/* SpillFindRecord - bitmap of key's newest spilled record, or NULL. Only valid until the next spill lookup. */
+static const unsigned char *SpillFindRecord (Tree *tree, unsigned long long key)
+{
+    size_t record_size = SpillRecordSize(tree);
+
+    tree->stats.spill_lookups++;
+    for (SpillRun *run = tree->spill_runs;run;run = run->next)
+    {
+        if ((run->records == 0) || (key < run->page_first_keys[0]) || (key > run->last_key))
+            continue;
+
+        // Last page starting at or below key, then the record within it.
+        unsigned long long low = 0, high = run->pages - 1;
+        while (low < high)
+        {
+            unsigned long long middle = (low + high + 1) / 2;
+            if (run->page_first_keys[middle] <= key)
+                low = middle;
+            else
+                high = middle - 1;
+        }
+        SpillPage *page = SpillLoadPage(tree, run, low);
+        if (!page)
+            continue;
+
+        int first = 0, last = (int) page->records - 1;
+        while (first <= last)
+        {
+            int middle = (first + last) / 2;
+            unsigned long long record_key;
+            memcpy(&record_key, page->data + (middle * record_size), sizeof(record_key));
+            if (record_key == key)
+            {
+                tree->stats.spill_hits++;
+                return page->data + (middle * record_size) + sizeof(unsigned long long);
+            }
+            if (record_key < key)
+                first = middle + 1;
+            else
+                last = middle - 1;
+        }
+    }
+    return NULL;
+}
+
+/* SpillMergeRuns - k way merge of all runs into one, the newest record of each key winning. */
+static int SpillMergeRuns (Tree *tree)
+{
+    unsigned int run_count = tree->spill_run_count;
+    size_t record_size = SpillRecordSize(tree);
+    SpillRun **runs = calloc(run_count, sizeof(SpillRun *));
+    unsigned char *records = malloc(run_count * record_size);
+    unsigned long long *positions = calloc(run_count, sizeof(unsigned long long));
+    SpillRun *merged = SpillCreateRun(tree);
+    int result = (runs && records && positions && merged);
+    unsigned int idx = 0;
+
+    for (SpillRun *run = tree->spill_runs;result && run;run = run->next)
+    {
+        runs[idx] = run;
+        result = (SPILL_FSEEK(run->fp, 0) == 0) && ((run->records == 0) || (fread(records + (idx * record_size), record_size, 1, run->fp) == 1));
+        idx++;
+    }
+
+    while (result)
+    {
+        // runs[] is newest first, so on equal keys the first one found wins and the others are skipped.
+        int best = -1;
+        unsigned long long best_key = 0;
+        for (idx=0;idx<run_count;idx++)
+        {
+            unsigned long long key;
+            if (positions[idx] >= runs[idx]->records)
+                continue;
+            memcpy(&key, records + (idx * record_size), sizeof(key));
+            if ((best < 0) || (key < best_key))
+            {
+                best = (int) idx;
+                best_key = key;
+            }
+        }
+        if (best < 0)
+            break;
+        result = SpillAppend(tree, merged, best_key, records + (best * record_size) + sizeof(unsigned long long));
+
+        for (idx=0;result && (idx<run_count);idx++)
+        {
+            unsigned long long key;
+            if (positions[idx] >= runs[idx]->records)
+                continue;
+            memcpy(&key, records + (idx * record_size), sizeof(key));
+            if ((key == best_key) && (++positions[idx] < runs[idx]->records))
+                result = (fread(records + (idx * record_size), record_size, 1, runs[idx]->fp) == 1);
+        }
+    }
+
+    if (result)
+    {
+        for (idx=0;tree->spill_cache && (idx<tree->spill_cache_pages);idx++)
+            tree->spill_cache[idx].run = NULL;
+        while (tree->spill_runs)
+        {
+            SpillRun *next = tree->spill_runs->next;
+            SpillCloseRun(tree->spill_runs);
+            tree->spill_runs = next;
+        }
+        tree->spill_run_count = 0;
+        result = SpillFinishRun(tree, merged);
+        verbose_printf(1, "SpillTree: merged %u runs into one of %llu records.\n", run_count, merged->records);
+    }
+    if (!result)
+    {
+        printf("SpillTree: merging %u runs failed, keeping them as they are.\n", run_count);
+        SpillCloseRun(merged);
+    }
+    free(runs);
+    free(records);
+    free(positions);
+    return result;
+}
+
+static void CollectNodes (TreeNode *node, TreeNode **nodes, unsigned int *count)
+{
+    while (node)
+    {
+        CollectNodes(node->left, nodes, count);
+        nodes[(*count)++] = node;
+        node = node->right;
+    }
+}
+
+unsigned int SpillTree (struct Tree *tree, unsigned int percent)
+{
+    TreeNode **nodes;
+    TreeNode *kept_nodes = NULL;
+    TreeBlock *old_blocks;
+    TreeNode *old_root;
+    SpillRun *run;
+    unsigned int count = 0, spill_count, kept, first;
+
+    if (!tree || !(tree->options & TREE_OPTION_SPILL) || (tree->size == 0) || (percent == 0))
+        return 0;
+
+    spill_count = (unsigned int) (((unsigned long long) tree->size * ((percent > 100)?100:percent)) / 100);
+    if (spill_count == 0)
+        spill_count = 1;
+    nodes = malloc((size_t) tree->size * sizeof(TreeNode *));
+    if (!nodes)
+        return 0;
+    CollectNodes(tree->root, nodes, &count);
+    kept = count - spill_count;
+
+    // Cold end: whichever end of the key range is further from the last accessed node.
+    first = (tree->finger && (tree->finger->key >= nodes[count / 2]->key))?0:kept;
+
+    // The rebuilt tree's block is allocated before anything is written, so a failure leaves the tree as it was.
+    old_blocks = tree->blocks;
+    tree->blocks = NULL;
+    if ((kept > 0) && !(kept_nodes = AllocateNodeBlock(tree, kept)))
+    {
+        tree->blocks = old_blocks;
+        free(nodes);
+        return 0;
+    }
+
+    run = SpillCreateRun(tree);
+    for (unsigned int idx=first;run && (idx<first+spill_count);idx++)
+    {
+        if (!SpillAppend(tree, run, nodes[idx]->key, nodes[idx]->payload))
+        {
+            SpillCloseRun(run);
+            run = NULL;
+        }
+    }
+    if (!run || !SpillFinishRun(tree, run))
+    {
+        printf("SpillTree: writing %u nodes failed, nothing spilled.\n", spill_count);
+        SpillCloseRun(run);
+        if (tree->blocks)
+            memory_free(tree, tree->blocks, tree->blocks->size);
+        tree->blocks = old_blocks;
+        free(nodes);
+        return 0;
+    }
+
+    for (unsigned int idx=0, node_idx=0;idx<count;idx++)
+    {
+        if ((idx >= first) && (idx < first + spill_count))
+            continue;
+        kept_nodes[node_idx].key = nodes[idx]->key;
+        if (tree->bitmap_size_in_bytes > 0)
+            memcpy(kept_nodes[node_idx].payload, nodes[idx]->payload, tree->bitmap_size_in_bytes);
+        node_idx++;
+    }
+    free(nodes);
+
+    old_root = tree->root;
+    DestroyNode(tree, old_root);
+    while (old_blocks)
+    {
+        TreeBlock *next = old_blocks->next;
+        memory_free(tree, old_blocks, old_blocks->size);
+        old_blocks = next;
+    }
+    tree->root = tree->finger = tree->rightmost = NULL;
+    tree->size = kept;
+    if (kept > 0)
+        LinkTreeFromBlock(tree, kept_nodes, kept);
+    else
+        HashIndexRebuild(tree);
+    tree->stats.spilled_nodes += spill_count;
+    verbose_printf(1, "SpillTree: %u nodes written to run %u, %u left in memory (%lu bytes).\n", spill_count, tree->spill_run_count, kept,
+                   (unsigned long) tree->stats.bytes_allocated);
+
+    if (tree->spill_run_count > SPILL_MAX_RUNS)
+        SpillMergeRuns(tree);
+    return spill_count;
+}
+
+/* Only the nodes and their bitmaps count against the budget: the fixed part of bytes_allocated (Bloom filter, hash index, page cache) is not
+   freed by spilling, so with it a small budget would spill again on every insert. */
+static void SpillIfOverBudget (Tree *tree)
+{
+    if (tree->memory_budget && (tree->size > 1) &&
+        (((size_t) tree->size * (sizeof(TreeNode) + tree->bitmap_size_in_bytes)) > tree->memory_budget))
+        SpillTree(tree, 50);
+}
+
+static void SpillRelease (Tree *tree)
+{
+    while (tree->spill_runs)
+    {
+        SpillRun *next = tree->spill_runs->next;
+        SpillCloseRun(tree->spill_runs);
+        tree->spill_runs = next;
+    }
+    if (tree->spill_cache)
+    {
+        for (unsigned int idx=0;idx<tree->spill_cache_pages;idx++)
+            memory_free(tree, tree->spill_cache[idx].data, SpillRecordsPerPage(tree) * SpillRecordSize(tree));
+        memory_free(tree, tree->spill_cache, tree->spill_cache_pages * sizeof(SpillPage));
+    }
+    free(tree->spill_directory);
+}
+
+size_t TreeMemoryUsage (struct Tree *tree)
+{
+    return (tree)?tree->stats.bytes_allocated:0;
+}
+
+unsigned int TreeSpillRuns (struct Tree *tree)
+{
+    return (tree)?tree->spill_run_count:0;
+}
+
+/* GetCountHistogram - Tally the counts of every node in memory, then of the spilled records (merged into one run first, so each key has one
+   current record) whose key is not also in memory. */
+static void CountHistogramNodes (Tree *tree, TreeNode *node, unsigned long long *histogram)
+{
+    while (node)
+    {
+        CountHistogramNodes(tree, node->left, histogram);
+        for (unsigned int sub_bit=0;node->payload && (sub_bit<tree->bitmap_size_per_node);sub_bit++)
+            histogram[PayloadCount(node->payload, sub_bit, tree->counter_bits)]++;
+        node = node->right;
+    }
+}
+
+void GetCountHistogram (struct Tree *tree, unsigned long long *histogram)
+{
+    unsigned long long zero_count;
+
+    if (!tree || !histogram)
+        return;
+    zero_count = histogram[0];
+    CountHistogramNodes(tree, tree->root, histogram);
+
+    if ((tree->spill_run_count > 1) && !SpillMergeRuns(tree))
+        printf("GetCountHistogram: spilled nodes left out, their runs could not be merged.\n");
+    if (tree->spill_run_count == 1)
+    {
+        SpillRun *run = tree->spill_runs;
+        size_t record_size = SpillRecordSize(tree);
+        unsigned char *record = malloc(record_size);
+        int readable = record && (SPILL_FSEEK(run->fp, 0) == 0);
+
+        for (unsigned long long idx=0;readable && (idx<run->records);idx++)
+        {
+            unsigned long long key;
+            TreeNode *node = tree->root;
+
+            if (fread(record, record_size, 1, run->fp) != 1)
+            {
+                printf("GetCountHistogram: cannot read a run file, spilled nodes left out.\n");
+                break;
+            }
+            memcpy(&key, record, sizeof(key));
+            while (node && (node->key != key))
+                node = (key < node->key)?node->left:node->right;
+            for (unsigned int sub_bit=0;!node && (sub_bit<tree->bitmap_size_per_node);sub_bit++)
+                histogram[PayloadCount(record + sizeof(key), sub_bit, tree->counter_bits)]++;
+        }
+        free(record);
+    }
+    histogram[0] = zero_count;
+}
+
+
+/* SetRange, TestRangeAny, TestRangeAll - Offsets first_offset..last_offset taken a node at a time. The span is split into its first node (from
+   the first sub bit offset on), the whole nodes in between and its last node (up to the last sub bit offset), and each node's share of the
+   payload is done with masked head and tail bytes around whole bytes, so a node costs one lookup whatever its share. Sub bit offsets past
+   bitmap_size_per_node are left out, as CheckBit64 never finds them set. Setting creates the nodes in order (each next to the finger); clearing
+   and testing only visit the nodes there are, in memory (by a walk pruned to the key range) and spilled (by a scan of the run pages). */
+typedef struct TreeRange {
+    unsigned long long first_key;
+    unsigned long long last_key;
+    unsigned int       first_sub;
+    unsigned int       last_sub;
+} TreeRange;
+
+typedef struct RangeKeys {
+    unsigned long long *keys;
+    size_t              count;
+    size_t              capacity;
+} RangeKeys;
+
+static int RangeSplit (Tree *tree, unsigned long long first_offset, unsigned long long last_offset, TreeRange *range)
 {
-    unsigned int return_code = 0;
-    if (tree && tree_node && (tree_node->payload) && (sub_bit_offset < tree->bitmap_size_per_node))
+    if (!tree || (first_offset > last_offset))
+        return 0;
+    range->first_key = first_offset >> tree->bitmap_idx_size;
+    range->last_key = last_offset >> tree->bitmap_idx_size;
+    range->first_sub = (unsigned int) (first_offset & tree->sub_bit_mask);
+    range->last_sub = (unsigned int) (last_offset & tree->sub_bit_mask);
+    return 1;
+}
+
+// Share of the range in key's node, 0 if it holds no sub bit offset below bitmap_size_per_node.
+static int RangeClip (Tree *tree, const TreeRange *range, unsigned long long key, unsigned int *first_sub, unsigned int *last_sub)
+{
+    *first_sub = (key == range->first_key)?range->first_sub:0;
+    *last_sub = tree->bitmap_size_per_node - 1;
+    if ((key == range->last_key) && (range->last_sub < *last_sub))
+        *last_sub = range->last_sub;
+    return (tree->bitmap_size_per_node > 0) && (*first_sub <= *last_sub);
+}
+
+/* PayloadRangeFill, PayloadRangeTest - Sub bit offsets first_sub..last_sub of a payload. Setting counters raises each zero count to 1 on its
+   own (non zero counts are kept); everything else works on the bits of the span: a masked head byte, whole bytes, a masked tail byte. */
+static void PayloadRangeFill (unsigned char *payload, unsigned int first_sub, unsigned int last_sub, unsigned int counter_bits, unsigned int value)
+{
+    if (value && (counter_bits > 1))
+    {
+        for (unsigned int sub_bit=first_sub;sub_bit<=last_sub;sub_bit++)
+        {
+            if (PayloadCount(payload, sub_bit, counter_bits) == 0)
+                PayloadSetCount(payload, sub_bit, counter_bits, 1);
+        }
+        return;
+    }
+
+    unsigned int first_bit = first_sub * counter_bits;
+    unsigned int last_bit = (last_sub * counter_bits) + counter_bits - 1;
+    unsigned int first_byte = first_bit / 8, last_byte = last_bit / 8;
+    unsigned char head = (unsigned char) (0xFF << (first_bit % 8));
+    unsigned char tail = (unsigned char) (0xFF >> (7 - (last_bit % 8)));
+
+    if (first_byte == last_byte)
+        head &= tail;
+    payload[first_byte] = (unsigned char) (value?(payload[first_byte] | head):(payload[first_byte] & ~head));
+    if (last_byte > first_byte)
     {
-        unsigned int set_bit_idx = sub_bit_offset / 8;
-        unsigned int set_bit_offset = sub_bit_offset % 8;
-        return_code = ((tree_node->payload[set_bit_idx] & (1<<set_bit_offset)) != 0);
+        memset(payload + first_byte + 1, value?0xFF:0, last_byte - first_byte - 1);
+        payload[last_byte] = (unsigned char) (value?(payload[last_byte] | tail):(payload[last_byte] & ~tail));
     }
-    return return_code;
 }
 
-unsigned int SetSubBit(Tree * tree, TreeNode *tree_node, unsigned int sub_bit_offset, unsigned int value, unsigned int *already_present)
+// all 0: 1 if any offset in the span is set. all 1: 1 if every one is.
+static int PayloadRangeTest (const unsigned char *payload, unsigned int first_sub, unsigned int last_sub, unsigned int counter_bits, int all)
 {
-    unsigned int return_code = 0;
+    if (all && (counter_bits > 1))
+    {
+        for (unsigned int sub_bit=first_sub;sub_bit<=last_sub;sub_bit++)
+        {
+            if (PayloadCount(payload, sub_bit, counter_bits) == 0)
+                return 0;
+        }
+        return 1;
+    }
 
-    if (already_present)
-        *already_present = 0;
+    unsigned int first_bit = first_sub * counter_bits;
+    unsigned int last_bit = (last_sub * counter_bits) + counter_bits - 1;
+    unsigned int first_byte = first_bit / 8, last_byte = last_bit / 8;
+    unsigned char head = (unsigned char) (0xFF << (first_bit % 8));
+    unsigned char tail = (unsigned char) (0xFF >> (7 - (last_bit % 8)));
+
+    if (first_byte == last_byte)
+        head &= tail;
+    if (all?((payload[first_byte] & head) != head):((payload[first_byte] & head) != 0))
+        return !all;
+    for (unsigned int byte=first_byte+1;byte<last_byte;byte++)
+    {
+        if (all?(payload[byte] != 0xFF):(payload[byte] != 0))
+            return !all;
+    }
+    if ((last_byte > first_byte) && (all?((payload[last_byte] & tail) != tail):((payload[last_byte] & tail) != 0)))
+        return !all;
+    return all;
+}
 
-    if (tree && tree_node && (tree_node->payload) && (sub_bit_offset < tree->bitmap_size_per_node))
+// Current bitmap of key: its node's in memory, else its newest spilled record (valid until the next spill lookup), else NULL.
+static const unsigned char *RangePayload (Tree *tree, unsigned long long key)
+{
+    TreeNode *node = FindNodeInMemory(tree, key);
+
+    if (node)
+        return node->payload;
+    return (tree->spill_runs)?SpillFindRecord(tree, key):NULL;
+}
+
+static int RangeKeysAdd (RangeKeys *list, unsigned long long key)
+{
+    if (list->count == list->capacity)
     {
-        unsigned int set_bit_idx = sub_bit_offset / 8;
-        unsigned int set_bit_offset = sub_bit_offset % 8;
-        if ((value % 2) == 1)
+        size_t capacity = (list->capacity > 0)?list->capacity*2:256;
+        unsigned long long *keys = realloc(list->keys, capacity * sizeof(unsigned long long));
+        if (!keys)
+            return 0;
+        list->keys = keys;
+        list->capacity = capacity;
+    }
+    list->keys[list->count++] = key;
+    return 1;
+}
+
+static int CompareRangeKeys (const void *a, const void *b)
+{
+    unsigned long long left = *(const unsigned long long *) a, right = *(const unsigned long long *) b;
+    return (left > right) - (left < right);
+}
+
+// Keys of the nodes in memory within the range, in order. Follows child links only, so it also walks a TREE_OPTION_SNAPSHOTS working tree.
+static int RangeCollectNodes (TreeNode *node, const TreeRange *range, RangeKeys *list)
+{
+    while (node)
+    {
+        if ((node->key > range->first_key) && !RangeCollectNodes(node->left, range, list))
+            return 0;
+        if ((node->key >= range->first_key) && (node->key <= range->last_key) && !RangeKeysAdd(list, node->key))
+            return 0;
+        if (node->key >= range->last_key)
+            break;
+        node = node->right;
+    }
+    return 1;
+}
+
+// Keys of the spilled records within the range, from every run (so possibly repeated, or also in memory).
+static int RangeCollectSpilled (Tree *tree, const TreeRange *range, RangeKeys *list)
+{
+    size_t record_size = SpillRecordSize(tree);
+
+    for (SpillRun *run = tree->spill_runs;run;run = run->next)
+    {
+        if ((run->records == 0) || (range->last_key < run->page_first_keys[0]) || (range->first_key > run->last_key))
+            continue;
+
+        unsigned long long low = 0, high = run->pages - 1;
+        while (low < high)
         {
-           if (already_present)
-              *already_present = ((tree_node->payload[set_bit_idx] & (1 << set_bit_offset)) != 0);
-           tree_node->payload[set_bit_idx] |= 1 << set_bit_offset;
+            unsigned long long middle = (low + high + 1) / 2;
+            if (run->page_first_keys[middle] <= range->first_key)
+                low = middle;
+            else
+                high = middle - 1;
+        }
+        for (unsigned long long page_idx=low;(page_idx<run->pages) && (run->page_first_keys[page_idx]<=range->last_key);page_idx++)
+        {
+            SpillPage *page = SpillLoadPage(tree, run, page_idx);
+            if (!page)
+                return 0;
+            for (unsigned int record_idx=0;record_idx<page->records;record_idx++)
+            {
+                unsigned long long key;
+                memcpy(&key, page->data + (record_idx * record_size), sizeof(key));
+                if ((key >= range->first_key) && (key <= range->last_key) && !RangeKeysAdd(list, key))
+                    return 0;
+            }
+        }
+    }
+    return 1;
+}
+
+/* RangeCollectKeys - sorted, distinct keys of the nodes within the range, in memory or spilled. */
+static int RangeCollectKeys (Tree *tree, const TreeRange *range, RangeKeys *list)
+{
+    memset(list, 0, sizeof(RangeKeys));
+    if (!RangeCollectNodes(tree->root, range, list) || (tree->spill_runs && !RangeCollectSpilled(tree, range, list)))
+    {
+        free(list->keys);
+        return 0;
+    }
+    if (tree->spill_runs && (list->count > 1))
+    {
+        size_t kept = 1;
+        qsort(list->keys, list->count, sizeof(unsigned long long), CompareRangeKeys);
+        for (size_t idx=1;idx<list->count;idx++)
+        {
+            if (list->keys[idx] != list->keys[kept - 1])
+                list->keys[kept++] = list->keys[idx];
+        }
+        list->count = kept;
+    }
+    return 1;
+}
+
+unsigned long long SetRange (struct Tree *tree, unsigned long long first_offset, unsigned long long last_offset, unsigned int value)
+{
+    TreeRange range;
+    unsigned long long written = 0;
+    unsigned int first_sub, last_sub;
+
+    if (!RangeSplit(tree, first_offset, last_offset, &range))
+        return 0;
+    value %= 2;
+
+    if (value)
+    {
+        for (unsigned long long key=range.first_key;;key++)
+        {
+            if (RangeClip(tree, &range, key, &first_sub, &last_sub))
+            {
+                // With snapshots, a node already set over its share is not copied.
+                const unsigned char *payload = (tree->options & TREE_OPTION_SNAPSHOTS)?RangePayload(tree, key):NULL;
+                if (!payload || !PayloadRangeTest(payload, first_sub, last_sub, tree->counter_bits, 1))
+                {
+                    TreeNode *node = FindOrInsertNode64(tree, key);
+                    if (!node || !node->payload)
+                    {
+                        printf("SetRange: cannot insert node %llu, range set up to it.\n", key);
+                        break;
+                    }
+                    PayloadRangeFill(node->payload, first_sub, last_sub, tree->counter_bits, 1);
+                    written++;
+                }
+            }
+            if (key == range.last_key)
+                break;
+        }
+    }
+    else
+    {
+        RangeKeys list;
+        if (!RangeCollectKeys(tree, &range, &list))
+        {
+            printf("SetRange: cannot allocate the list of nodes to clear.\n");
+            return 0;
+        }
+        for (size_t idx=0;idx<list.count;idx++)
+        {
+            // Only nodes with something to clear are written, so a spilled one is brought back (or a snapshot path copied) only then.
+            const unsigned char *payload = RangePayload(tree, list.keys[idx]);
+            if (!payload || !RangeClip(tree, &range, list.keys[idx], &first_sub, &last_sub) ||
+                !PayloadRangeTest(payload, first_sub, last_sub, tree->counter_bits, 0))
+                continue;
+            TreeNode *node = FindOrInsertNode64(tree, list.keys[idx]);
+            if (node && node->payload)
+            {
+                PayloadRangeFill(node->payload, first_sub, last_sub, tree->counter_bits, 0);
+                written++;
+            }
+        }
+        free(list.keys);
+    }
+
+    if (written && (tree->options & TREE_OPTION_SNAPSHOTS))
+        TreePublish(tree);
+    return written;
+}
+
+static int RangeAnyInMemory (Tree *tree, TreeNode *node, const TreeRange *range)
+{
+    unsigned int first_sub, last_sub;
+
+    while (node)
+    {
+        if ((node->key > range->first_key) && RangeAnyInMemory(tree, node->left, range))
+            return 1;
+        if ((node->key >= range->first_key) && (node->key <= range->last_key) && node->payload &&
+            RangeClip(tree, range, node->key, &first_sub, &last_sub) && PayloadRangeTest(node->payload, first_sub, last_sub, tree->counter_bits, 0))
+            return 1;
+        if (node->key >= range->last_key)
+            break;
+        node = node->right;
+    }
+    return 0;
+}
+
+unsigned int TestRangeAny (struct Tree *tree, unsigned long long first_offset, unsigned long long last_offset)
+{
+    TreeRange range;
+    RangeKeys list;
+    unsigned int first_sub, last_sub;
+    unsigned int found = 0;
+
+    if (!RangeSplit(tree, first_offset, last_offset, &range))
+        return 0;
+    if (RangeAnyInMemory(tree, tree->root, &range))
+        return 1;
+    if (!tree->spill_runs)
+        return 0;
+
+    // Spilled nodes not also in memory (those were tested above) answer from their newest record.
+    memset(&list, 0, sizeof(list));
+    if (!RangeCollectSpilled(tree, &range, &list))
+        printf("TestRangeAny: cannot list the spilled nodes, they are left out.\n");
+    for (size_t idx=0;!found && (idx<list.count);idx++)
+    {
+        if (FindNodeInMemory(tree, list.keys[idx]) || !RangeClip(tree, &range, list.keys[idx], &first_sub, &last_sub))
+            continue;
+        const unsigned char *spilled_payload = SpillFindRecord(tree, list.keys[idx]);
+        found = spilled_payload && PayloadRangeTest(spilled_payload, first_sub, last_sub, tree->counter_bits, 0);
+    }
+    free(list.keys);
+    return found;
+}
+
+unsigned int TestRangeAll (struct Tree *tree, unsigned long long first_offset, unsigned long long last_offset)
+{
+    TreeRange range;
+    unsigned int first_sub, last_sub;
+    unsigned int tested = 0;
+
+    if (!RangeSplit(tree, first_offset, last_offset, &range))
+        return 0;
+    for (unsigned long long key=range.first_key;;key++)
+    {
+        if (RangeClip(tree, &range, key, &first_sub, &last_sub))
+        {
+            const unsigned char *payload = RangePayload(tree, key);
+            if (!payload || !PayloadRangeTest(payload, first_sub, last_sub, tree->counter_bits, 1))
+                return 0;
+            tested = 1;
+        }
+        if (key == range.last_key)
+            break;
+    }
+    return tested;
+}
+
+
+/* FreezeTree - Immutable, compressed copy of a finished tree for read only use. Nodes with no bits set are dropped. The remaining keys are
+   split into blocks of FROZEN_BLOCK_KEYS: each block's first key is kept in full (block_first, plus an Eytzinger ordered copy in index_keys
+   that a lookup descends cache friendly), the rest as varint encoded gaps (key - previous key - 1, one byte for gaps below 128) in deltas.
+   The bitmaps are packed back to back in payloads, in key order, so node n's bitmap is at n * bitmap_size_in_bytes. */
+#define FROZEN_BLOCK_KEYS 64
+
+typedef struct FrozenTree {
+    unsigned int        bitmap_size_per_node;
+    unsigned int        bitmap_size_in_bytes;
+    unsigned int        counter_bits;    // as in the tree it was frozen from
+    unsigned int        bitmap_idx_size;
+    unsigned long long  sub_bit_mask;
+    unsigned int        count;           // nodes
+    unsigned int        block_count;
+    unsigned long long *block_first;     // first key of each block, ascending
+    unsigned long long *index_keys;      // block_first in Eytzinger order, slots 1..block_count
+    unsigned int       *index_blocks;    // block number of each index_keys slot
+    unsigned int       *block_offsets;   // start of each block's gaps in deltas
+    unsigned char      *deltas;
+    unsigned char      *payloads;
+    size_t              bytes;           // everything above plus this header
+} FrozenTree;
+
+typedef struct frozen_build {
+    Tree               *tree;
+    unsigned long long *keys;
+    unsigned char      *payloads;
+    unsigned int        count;
+} frozen_build;
+
+static int PayloadIsClear (const unsigned char *payload, unsigned int size)
+{
+    for (unsigned int idx=0;idx<size;idx++)
+    {
+        if (payload[idx])
+            return 0;
+    }
+    return 1;
+}
+
+// In order walk by child links (parent links are not kept in every mode), collecting the nodes that have bits set.
+static void FreezeCollect (frozen_build *build, TreeNode *node)
+{
+    while (node)
+    {
+        FreezeCollect(build, node->left);
+        if (node->payload && !PayloadIsClear(node->payload, build->tree->bitmap_size_in_bytes))
+        {
+            build->keys[build->count] = node->key;
+            memcpy(build->payloads + ((size_t) build->count * build->tree->bitmap_size_in_bytes), node->payload, build->tree->bitmap_size_in_bytes);
+            build->count++;
+        }
+        node = node->right;
+    }
+}
+
+static unsigned int VarintSize (unsigned long long value)
+{
+    unsigned int size = 1;
+    while (value >= 0x80)
+    {
+        value >>= 7;
+        size++;
+    }
+    return size;
+}
+
+static unsigned int WriteVarint (unsigned char *out, unsigned long long value)
+{
+    unsigned int size = 0;
+    while (value >= 0x80)
+    {
+        out[size++] = (unsigned char) (value | 0x80);
+        value >>= 7;
+    }
+    out[size++] = (unsigned char) value;
+    return size;
+}
+
+static unsigned long long ReadVarint (const unsigned char **in)
+{
+    const unsigned char *pos = *in;
+    unsigned long long value = *pos & 0x7f;
+    unsigned int shift = 7;
+
+    while (*pos++ & 0x80)
+    {
+        value |= (unsigned long long) (*pos & 0x7f) << shift;
+        shift += 7;
+    }
+    *in = pos;
+    return value;
+}
+
+// Lay block_first out in Eytzinger (BFS of the implicit balanced search tree) order: slot k has children 2k and 2k+1.
+static unsigned int FillEytzinger (FrozenTree *frozen, unsigned int next_block, unsigned int slot)
+{
+    if (slot <= frozen->block_count)
+    {
+        next_block = FillEytzinger(frozen, next_block, 2 * slot);
+        frozen->index_keys[slot] = frozen->block_first[next_block];
+        frozen->index_blocks[slot] = next_block++;
+        next_block = FillEytzinger(frozen, next_block, (2 * slot) + 1);
+    }
+    return next_block;
+}
+
+struct FrozenTree *FreezeTree (struct Tree *tree)
+{
+    frozen_build build = {tree, NULL, NULL, 0};
+    FrozenTree *frozen = NULL;
+    size_t delta_bytes = 0;
+
+    if (!tree)
+        return NULL;
+    if (tree->spill_runs)
+    {
+        printf("FreezeTree: tree has nodes spilled to disk, only a fully in memory tree can be frozen.\n");
+        return NULL;
+    }
+
+    build.keys = malloc(((size_t) tree->size + 1) * sizeof(unsigned long long));
+    build.payloads = malloc(((size_t) tree->size + 1) * tree->bitmap_size_in_bytes);
+    frozen = calloc(1, sizeof(FrozenTree));
+    if (!build.keys || !build.payloads || !frozen)
+    {
+        printf("FreezeTree: out of memory for %d nodes.\n", tree->size);
+        free(build.keys);
+        free(build.payloads);
+        free(frozen);
+        return NULL;
+    }
+    FreezeCollect(&build, tree->root);
+
+    frozen->bitmap_size_per_node = tree->bitmap_size_per_node;
+    frozen->bitmap_size_in_bytes = tree->bitmap_size_in_bytes;
+    frozen->counter_bits = tree->counter_bits;
+    frozen->bitmap_idx_size = tree->bitmap_idx_size;
+    frozen->sub_bit_mask = tree->sub_bit_mask;
+    frozen->count = build.count;
+    frozen->block_count = (build.count + FROZEN_BLOCK_KEYS - 1) / FROZEN_BLOCK_KEYS;
+
+    for (unsigned int idx=0;idx<build.count;idx++)
+    {
+        if (idx % FROZEN_BLOCK_KEYS)
+            delta_bytes += VarintSize(build.keys[idx] - build.keys[idx-1] - 1);
+    }
+
+    frozen->block_first = malloc((frozen->block_count + 1) * sizeof(unsigned long long));
+    frozen->index_keys = malloc((frozen->block_count + 1) * sizeof(unsigned long long));
+    frozen->index_blocks = malloc((frozen->block_count + 1) * sizeof(unsigned int));
+    frozen->block_offsets = malloc((frozen->block_count + 1) * sizeof(unsigned int));
+    frozen->deltas = malloc(delta_bytes + 1);
+    frozen->payloads = realloc(build.payloads, ((size_t) build.count + 1) * tree->bitmap_size_in_bytes);
+    if (frozen->payloads)
+        build.payloads = NULL;
+    if (!frozen->block_first || !frozen->index_keys || !frozen->index_blocks || !frozen->block_offsets || !frozen->deltas || !frozen->payloads)
+    {
+        printf("FreezeTree: out of memory for %u nodes.\n", build.count);
+        DestroyFrozenTree(frozen);
+        free(build.keys);
+        free(build.payloads);
+        return NULL;
+    }
+
+    size_t delta_pos = 0;
+    for (unsigned int idx=0;idx<build.count;idx++)
+    {
+        if ((idx % FROZEN_BLOCK_KEYS) == 0)
+        {
+            frozen->block_first[idx / FROZEN_BLOCK_KEYS] = build.keys[idx];
+            frozen->block_offsets[idx / FROZEN_BLOCK_KEYS] = (unsigned int) delta_pos;
         }
         else
         {
-            tree_node->payload[set_bit_idx] &= ~(1 << set_bit_offset);
-        };
-        return_code = 1;
+            delta_pos += WriteVarint(frozen->deltas + delta_pos, build.keys[idx] - build.keys[idx-1] - 1);
+        }
     }
-    return return_code;
+    FillEytzinger(frozen, 0, 1);
+    free(build.keys);
+
+    frozen->bytes = sizeof(FrozenTree) + (frozen->block_count * ((2 * sizeof(unsigned long long)) + (2 * sizeof(unsigned int)))) + delta_bytes +
+                    ((size_t) build.count * frozen->bitmap_size_in_bytes);
+    verbose_printf(1, "FreezeTree: %u nodes (%d in tree) in %u blocks, %lu bytes of key gaps, %lu bytes in total.\n", build.count, tree->size,
+                   frozen->block_count, (unsigned long) delta_bytes, (unsigned long) frozen->bytes);
+    return frozen;
 }
 
-/* ClearSubBits - Set all bits from 0 to the number of bits per node to 0 */
-void ClearSubBits(Tree *tree, TreeNode *tree_node)
+void DestroyFrozenTree (struct FrozenTree *frozen)
 {
-    if (tree && tree_node)
+    if (frozen)
     {
-        memset(tree_node->payload, 0, tree->bitmap_size_in_bytes);
+        free(frozen->block_first);
+        free(frozen->index_keys);
+        free(frozen->index_blocks);
+        free(frozen->block_offsets);
+        free(frozen->deltas);
+        free(frozen->payloads);
+        free(frozen);
     }
 }
 
-/* CheckBit, SetBit - If a tree is valid, allow access to the internal bitmap with a bit offset within total bit offset range (effectively (key << bitmap_size_per_node) | sub_bit_offset).
- This is the standard access to the TreeSet unless the key range independent of the sub_bit_index plus the sub_bit_range is greater than 32 bits. It uses the CheckSubBit and SetSubBit interfaces
-  introduced previously. */
+/* FrozenBlockFor - the last block whose first key is <= key, or -1 if key is below every key. */
+static int FrozenBlockFor (const FrozenTree *frozen, unsigned long long key)
+{
+    unsigned int slot = 1;
 
-unsigned int CheckBit (Tree *tree, unsigned int total_bit_offset)
+    while (slot <= frozen->block_count)
+        slot = (2 * slot) + (frozen->index_keys[slot] <= key);
+
+    // slot now encodes the descent; dropping the trailing right turns and one left turn gives the first slot whose key is above key (0 if none).
+    while (slot & 1)
+        slot >>= 1;
+    slot >>= 1;
+
+    if (slot == 0)
+        return (int) frozen->block_count - 1;
+    return (int) frozen->index_blocks[slot] - 1;
+}
+
+/* FrozenFindNode - index of the node holding key, or -1. */
+static long long FrozenFindNode (const FrozenTree *frozen, unsigned long long key)
 {
-   unsigned int key = total_bit_offset >> tree->bitmap_idx_size;
-   unsigned int sub_bit_offset =  total_bit_offset & ((1<<tree->bitmap_idx_size)-1);
-   TreeNode *check_node = FindNode(tree, key);
-   if (check_node)
-   {
-       return CheckSubBit(tree, check_node, sub_bit_offset);
-   }
-   return 0;
+    int block = FrozenBlockFor(frozen, key);
+
+    if (block >= 0)
+    {
+        unsigned long long node_key = frozen->block_first[block];
+        unsigned int first = (unsigned int) block * FROZEN_BLOCK_KEYS;
+        unsigned int last = (first + FROZEN_BLOCK_KEYS < frozen->count)?(first + FROZEN_BLOCK_KEYS):frozen->count;
+        const unsigned char *pos = frozen->deltas + frozen->block_offsets[block];
+
+        for (unsigned int idx=first;idx<last;idx++)
+        {
+            if (idx > first)
+                node_key += ReadVarint(&pos) + 1;
+            if (node_key == key)
+                return idx;
+            if (node_key > key)
+                break;
+        }
+    }
+    return -1;
 }
 
-void SetBit (Tree *tree, unsigned int total_bit_offset, unsigned int value, unsigned int *already_set)
+static unsigned int FrozenCheckSubBit (const FrozenTree *frozen, unsigned int node, unsigned int sub_bit_offset)
+{
+    if (sub_bit_offset >= frozen->bitmap_size_per_node)
+        return 0;
+    return (PayloadCount(frozen->payloads + ((size_t) node * frozen->bitmap_size_in_bytes), sub_bit_offset, frozen->counter_bits) != 0);
+}
+
+unsigned int FrozenCheckBit (struct FrozenTree *frozen, unsigned long long total_bit_offset)
 {
-   unsigned int key = total_bit_offset >> tree->bitmap_idx_size;
-   unsigned int sub_bit_offset =  total_bit_offset & ((1<<tree->bitmap_idx_size)-1);
+    long long node;
 
-   verbose_printf(1, "SetBit: total_bit_offset %d(%04x) => key %d(%04x), sub_bit_offset: %d(%04x)\n", total_bit_offset, total_bit_offset, key, key, sub_bit_offset, sub_bit_offset);
-   TreeNode *check_node = FindOrInsertNode(tree, key);
-   if (check_node)
-   {
-       SetSubBit(tree, check_node, sub_bit_offset, value, already_set);
-   }
+    if (!frozen)
+        return 0;
+    node = FrozenFindNode(frozen, total_bit_offset >> frozen->bitmap_idx_size);
+    return (node >= 0)?FrozenCheckSubBit(frozen, (unsigned int) node, (unsigned int) (total_bit_offset & frozen->sub_bit_mask)):0;
+}
+
+/* FrozenForEachSetBit - decode forward from the block holding first_offset, visiting each set bit until last_offset. */
+unsigned long long FrozenForEachSetBit (struct FrozenTree *frozen, unsigned long long first_offset, unsigned long long last_offset,
+                                        FrozenBitVisitor visitor, void *context)
+{
+    unsigned long long visited = 0;
+    unsigned long long first_key, last_key;
+    int block;
+
+    if (!frozen || (frozen->count == 0) || (first_offset > last_offset))
+        return 0;
+
+    first_key = first_offset >> frozen->bitmap_idx_size;
+    last_key = last_offset >> frozen->bitmap_idx_size;
+    block = FrozenBlockFor(frozen, first_key);
+    if (block < 0)
+        block = 0;
+
+    for (unsigned int idx=(unsigned int) block * FROZEN_BLOCK_KEYS;idx<frozen->count;)
+    {
+        unsigned long long node_key = frozen->block_first[idx / FROZEN_BLOCK_KEYS];
+        const unsigned char *pos = frozen->deltas + frozen->block_offsets[idx / FROZEN_BLOCK_KEYS];
+        unsigned int last = (idx + FROZEN_BLOCK_KEYS < frozen->count)?(idx + FROZEN_BLOCK_KEYS):frozen->count;
+
+        for (unsigned int first=idx;idx<last;idx++)
+        {
+            if (idx > first)
+                node_key += ReadVarint(&pos) + 1;
+            if (node_key > last_key)
+                return visited;
+            if (node_key < first_key)
+                continue;
+
+            for (unsigned int sub_bit=0;sub_bit<frozen->bitmap_size_per_node;sub_bit++)
+            {
+                unsigned long long offset = (node_key << frozen->bitmap_idx_size) | sub_bit;
+                if ((offset >= first_offset) && (offset <= last_offset) && FrozenCheckSubBit(frozen, idx, sub_bit))
+                {
+                    visited++;
+                    if (visitor && visitor(context, offset))
+                        return visited;
+                }
+            }
+        }
+    }
+    return visited;
+}
+
+/* ThawTree - Rebuild an ordinary tree from a frozen one, in linear time through the same contiguous node block as BuildTreeFromSorted. Counters
+   come back as they were frozen, whatever options say. */
+struct Tree *ThawTree (struct FrozenTree *frozen, const TreeOptions *options)
+{
+    TreeOptions thawed_options;
+    Tree *tree;
+    TreeNode *nodes;
+
+    if (!frozen)
+        return NULL;
+    if (options && (options->flags & TREE_OPTION_SNAPSHOTS))
+    {
+        printf("ThawTree: snapshot trees cannot be rebuilt from a frozen tree.\n");
+        return NULL;
+    }
+
+    if (options)
+        thawed_options = *options;
+    else
+        memset(&thawed_options, 0, sizeof(thawed_options));
+    thawed_options.flags &= ~TREE_OPTION_COUNTERS;
+    if (frozen->counter_bits > 1)
+    {
+        thawed_options.flags |= TREE_OPTION_COUNTERS;
+        thawed_options.counter_bits = frozen->counter_bits;
+    }
+    tree = CreateTreeWithOptions(frozen->bitmap_size_per_node, &thawed_options);
+    if (!tree || (frozen->count == 0))
+        return tree;
+    nodes = AllocateNodeBlock(tree, frozen->count);
+    if (!nodes)
+    {
+        DestroyTree(tree);
+        return NULL;
+    }
+
+    for (unsigned int block=0, idx=0;block<frozen->block_count;block++)
+    {
+        const unsigned char *pos = frozen->deltas + frozen->block_offsets[block];
+        unsigned long long key = frozen->block_first[block];
+        for (unsigned int first=idx;(idx<frozen->count) && (idx<first+FROZEN_BLOCK_KEYS);idx++)
+        {
+            if (idx > first)
+                key += ReadVarint(&pos) + 1;
+            nodes[idx].key = key;
+            if (nodes[idx].payload)
+                memcpy(nodes[idx].payload, frozen->payloads + ((size_t) idx * frozen->bitmap_size_in_bytes), frozen->bitmap_size_in_bytes);
+        }
+    }
+    LinkTreeFromBlock(tree, nodes, frozen->count);
+    return tree;
+}
+
+unsigned int FrozenTreeNodes (struct FrozenTree *frozen)
+{
+    return (frozen)?frozen->count:0;
+}
+
+size_t FrozenTreeBytes (struct FrozenTree *frozen)
+{
+    return (frozen)?frozen->bytes:0;
 }
 
 
+
 // sample usage code
 
 void example_test()
@@ -676,25 +3500,74 @@ void example_test()
    }
 }
 
-#ifdef TESTSET_PROFILE
-
-// Profiling node and memory usage - NOT thread safe!
+/* GetTreeStats, ResetTreeStats - Per tree profiling. bytes_allocated, nodes, bits_set and bytes_per_set_bit are always available (bits_set is
+   counted from the payloads on each call, so nothing is tracked per SetBit); lookups, hits, inserts, rotations, recolorings and the descent
+   depth histogram are only counted when built with TESTSET_PROFILE and read as 0 otherwise. The bloom_ counters are kept whenever the tree
+   has a Bloom filter. Reset clears the counters only. */
 
-size_t GetTSMemory()
+static unsigned long long CountSetBits (Tree *tree, TreeNode *node)
 {
-  return memory_usage;
+    unsigned long long bits_set = 0;
+    if (node)
+    {
+        for (unsigned int idx=0;node->payload && (tree->counter_bits == 1) && (idx<tree->bitmap_size_in_bytes);idx++)
+        {
+            for (unsigned char byte = node->payload[idx];byte;byte &= (unsigned char) (byte - 1))
+                bits_set++;
+        }
+        for (unsigned int sub_bit=0;node->payload && (tree->counter_bits > 1) && (sub_bit<tree->bitmap_size_per_node);sub_bit++)
+            bits_set += (PayloadCount(node->payload, sub_bit, tree->counter_bits) != 0);
+        bits_set += CountSetBits(tree, node->left) + CountSetBits(tree, node->right);
+    }
+    return bits_set;
 }
 
-unsigned int GetTSNodes()
+void GetTreeStats (struct Tree *tree, TreeStats *stats)
 {
-    return total_nodes;
+    if (tree && stats)
+    {
+        *stats = tree->stats;
+        stats->nodes = tree->size;
+        stats->bits_set = CountSetBits(tree, tree->root);
+        stats->bytes_per_set_bit = (stats->bits_set > 0)?((double) stats->bytes_allocated / stats->bits_set):0.0;
+        stats->spill_runs = tree->spill_run_count;
+        stats->spill_records = 0;
+        for (SpillRun *run = tree->spill_runs;run;run = run->next)
+            stats->spill_records += run->records;
+        stats->spill_file_bytes = stats->spill_records * SpillRecordSize(tree);
+        stats->hash_bytes = tree->hash_memory_size;
+        stats->hash_load_factor = (tree->hash_capacity > 0)?((double) tree->hash_used / tree->hash_capacity):0.0;
+
+        if (tree->bloom)
+        {
+            // Measured: share of lookups for absent keys that got past the filter. Estimated: chance all probes of a new key hit set bits.
+            unsigned long long bloom_words = (tree->bloom_block_mask + 1) * BLOOM_BLOCK_WORDS;
+            unsigned long long bits_set = 0;
+            double fill, estimate = 1.0;
+
+            for (unsigned long long idx=0;idx<bloom_words;idx++)
+            {
+                for (unsigned long long word = tree->bloom[idx];word;word &= word - 1)
+                    bits_set++;
+            }
+            fill = (double) bits_set / (double) (bloom_words * 64);
+            for (unsigned int idx=0;idx<BLOOM_PROBES;idx++)
+                estimate *= fill;
+
+            stats->bloom_bytes = (size_t) (bloom_words * sizeof(unsigned long long));
+            stats->bloom_estimated_fpr = estimate;
+            stats->bloom_false_positive_rate = ((stats->bloom_rejects + stats->bloom_false_positives) > 0)?
+                                               ((double) stats->bloom_false_positives / (stats->bloom_rejects + stats->bloom_false_positives)):0.0;
+        }
+    }
 }
 
-unsigned int GetTSTrees()
+void ResetTreeStats (struct Tree *tree)
 {
-    return total_trees;
+    if (tree)
+    {
+        size_t bytes_allocated = tree->stats.bytes_allocated;
+        memset(&tree->stats, 0, sizeof(TreeStats));
+        tree->stats.bytes_allocated = bytes_allocated;
+    }
 }
-
-
-
-#endif
@@ -1,17 +1,22 @@
 /* TreeSet
  * =======
  *  Implements a RedBlack Tree to store a wide and potentially sparse bitmap, limited only by range of an unsigned int (assumed to be 32 bits at least) when
- *  using just the CheckBit and SetBit interfaces (so a bitmap with a virtual size of  2^32 bits).  Interfaces are also offered to allow the upper and lower
- *  part of the key index to be used independently, allowing for potentially 32 bits times the maximum bitmap size per node. (ie: the key is the 'upper' 32 bits of
- *  the overall key and the sub_bit_offset is up to the max bitmap size per node). Given the default MAX_BITMAP_PER_NODE of 64, this could be up to 2^(32+64) or 2^96 bits (~79 octillion).
+ *  using just the CheckBit and SetBit interfaces (so a bitmap with a virtual size of  2^32 bits), or of an unsigned long long with CheckBit64 and SetBit64
+ *  (2^64 bits). Node keys are 64 bits wide, and interfaces are also offered to allow the upper and lower part of the key index to be used independently
+ *  (CheckBit96/SetBit96, or FindOrInsertNode64 with CheckSubBit/SetSubBit), allowing for 64 bits of node key times the bitmap size per node. (ie: the key is the
+ *  'upper' 64 bits of the overall key and the sub_bit_offset, given as 32 bits, is up to the bitmap size per node).
  */
 
- #define MAX_BITMAP_PER_NODE 64
+#ifndef TREESET_H
+#define TREESET_H
 
-#define TESTSET_PROFILE 1 // Enabling this will enable memory and node information dumps. NOT THREAD SAFE.
+ #define MAX_BITMAP_PER_NODE 4096
+
+// Define TESTSET_PROFILE (cmake -DTREESET_PROFILE=ON) to count lookups, inserts and rebalancing work per tree in TreeStats.
 
  struct Tree;
  struct TreeNode;
+ struct FrozenTree;
 
 
 /* Create a tree structure that will contain the bitmap elements. The sizing per node can be manipulated to allow for operations over a subset of the bitmap
@@ -20,21 +25,182 @@
    make sense to have 60 bits per node. */
 
 struct Tree *CreateTree (unsigned int bitmap_size_per_node);
+
+/* Optional features, selected when the tree is created with CreateTreeWithOptions (CreateTree uses none of them). */
+#define TREE_OPTION_BLOOM_FILTER 0x1  // Blocked Bloom filter over node keys in front of FindNode/CheckBit, for lookup heavy use where most probes miss.
+                                      // Sized from expected_nodes; see the bloom_ fields of TreeStats for its false positive rate.
+#define TREE_OPTION_SNAPSHOTS    0x2  // Copy-on-write versions for concurrent readers, see TreeSnapshot.
+#define TREE_OPTION_SPILL        0x4  // Keep memory under memory_budget by spilling cold nodes to disk, see SpillTree. Not with TREE_OPTION_SNAPSHOTS.
+#define TREE_OPTION_HASH_INDEX   0x8  // Hash index from node key to node beside the tree, so CheckBit/SetBit/FindNode of an existing node take O(1)
+                                      // instead of a descent (inserts still descend to link the node in). Sized from expected_nodes, grows as
+                                      // needed. About 9 bytes per slot at up to 7/8 load. Not with TREE_OPTION_SNAPSHOTS.
+#define TREE_OPTION_COUNTERS     0x10 // A saturating counter of counter_bits per offset instead of a bit, see IncrementBit.
+
+/* Where a tree's nodes, bitmaps and other per tree memory come from (see TreeShards.h for NUMA bound arenas). release is given the size that
+   was allocated. Both are only called from the thread writing the tree. */
+typedef struct TreeAllocator {
+    void *(*allocate) (void *context, size_t size);
+    void  (*release) (void *context, void *memory, size_t size);
+    void  *context;
+} TreeAllocator;
+
+typedef struct TreeOptions {
+    unsigned int       flags;           // TREE_OPTION_ values
+    unsigned long long expected_nodes;  // expected number of nodes (distinct keys), sizes the Bloom filter and hash index
+    size_t             memory_budget;   // TREE_OPTION_SPILL: bytes of nodes and bitmaps the tree may hold before spilling (0 to spill only on
+                                        // SpillTree calls); the Bloom filter, hash index and page cache come on top
+    const char        *spill_directory; // TREE_OPTION_SPILL: directory for run files, NULL for the system's temporary files
+    unsigned int       counter_bits;    // TREE_OPTION_COUNTERS: 4 (counts up to 15) or 8 (up to 255), 0 for 8
+    const TreeAllocator *allocator;     // NULL for malloc and free
+} TreeOptions;
+
+struct Tree *CreateTreeWithOptions (unsigned int bitmap_size_per_node, const TreeOptions *options);
 void DestroyTree(struct Tree *tree);
 
+/* Auto tuned trees. Which bitmap_size_per_node is best depends on how densely the offsets fill each node's window, which only the input can
+   tell. TuneTree takes the widths the application's offsets allow (each a whole unit of its key layout, e.g. a minute or an hour of seconds,
+   so no offset falls past the end of a window) and a sample: the first offsets of the input in input order, a frozen tree of earlier data
+   (read in key order, at most TREE_TUNE_MAX_FROZEN_SAMPLES of its bits), or both. For every width it counts the nodes the sample needs,
+   projects them to expected_offsets (scaled in proportion for input in time order, or by an occupancy estimate over the sampled key span
+   otherwise) and picks the width projected to take the fewest bytes. TREE_OPTION_HASH_INDEX is added when the sample comes in random order
+   (the finger rarely helps) and most offsets are projected to land in a node that already exists. A width that cannot hold every sampled
+   offset is ruled out. Returns 1 with the choice in tuning, or 0 for invalid hints.
+
+   CreateTreeFromTuning creates a tree with the chosen width and flags added to options (may be NULL), and CreateTreeTuned does both steps
+   for hints->options. Such a tree keeps its TreeTuning, which TreeInfo reports. */
+#define TREE_TUNE_MAX_WIDTHS 8
+#define TREE_TUNE_MAX_FROZEN_SAMPLES (1u << 20)
+
+typedef struct TreeTuningHints {
+    const unsigned int       *widths;           // candidate bitmap_size_per_node values, at most TREE_TUNE_MAX_WIDTHS
+    unsigned int              width_count;
+    const unsigned long long *sample_offsets;   // offsets in the order the input sets them, may be NULL
+    unsigned int              sample_count;
+    struct FrozenTree        *sample_frozen;    // earlier data, may be NULL
+    unsigned long long        expected_offsets; // offsets the whole input will set, 0 for as many as sampled
+    TreeOptions               options;          // for CreateTreeTuned; counter_bits also sizes the payloads
+} TreeTuningHints;
+
+typedef struct TreeTuning {
+    unsigned int       bitmap_size_per_node;    // width chosen
+    unsigned int       flags;                   // TREE_OPTION_ flags added (TREE_OPTION_HASH_INDEX or none)
+    unsigned int       samples;                 // offsets sampled, from the input and the frozen tree
+    double             in_order;                // share of steps between consecutive input samples not going back to an earlier node
+    unsigned long long expected_offsets;
+    unsigned int       width_count;
+    unsigned int       widths[TREE_TUNE_MAX_WIDTHS];
+    unsigned long long sampled_nodes[TREE_TUNE_MAX_WIDTHS];   // nodes the sample needs at each width, 0 if the width was ruled out
+    unsigned long long projected_nodes[TREE_TUNE_MAX_WIDTHS]; // ... and the whole input
+    unsigned long long projected_bytes[TREE_TUNE_MAX_WIDTHS];
+} TreeTuning;
+
+int TuneTree (const TreeTuningHints *hints, TreeTuning *tuning);
+struct Tree *CreateTreeFromTuning (const TreeTuning *tuning, const TreeOptions *options);
+struct Tree *CreateTreeTuned (const TreeTuningHints *hints);
+
 unsigned int CheckBit (struct Tree *tree, unsigned int total_bit_offset);
 void SetBit(struct Tree *tree, unsigned int total_bit_offset, unsigned int value, unsigned int *already_set);
 
+/* Same as CheckBit/SetBit over the full 64 bit offset range. */
+unsigned int CheckBit64 (struct Tree *tree, unsigned long long total_bit_offset);
+void SetBit64 (struct Tree *tree, unsigned long long total_bit_offset, unsigned int value, unsigned int *already_set);
+
+/* Batched CheckBit64/SetBit64 for offsets in random order: groups of lookups descend the tree together with the next nodes prefetched, so
+   their cache misses overlap. results[i] (and already_set[i], which may be NULL) get what CheckBit64/SetBit64 would give for offsets[i]. */
+void CheckBitsInterleaved (struct Tree *tree, const unsigned long long *offsets, unsigned int count, unsigned char *results);
+void SetBitsInterleaved (struct Tree *tree, const unsigned long long *offsets, unsigned int count, unsigned int value, unsigned char *already_set);
+
+/* Single call access with the offset split into node key (upper 64 bits) and sub bit offset (lower 32 bits, below bitmap_size_per_node),
+   for ranges wider than 64 bits without handling TreeNode pointers. */
+unsigned int CheckBit96 (struct Tree *tree, unsigned long long key, unsigned int sub_bit_offset);
+void SetBit96 (struct Tree *tree, unsigned long long key, unsigned int sub_bit_offset, unsigned int value, unsigned int *already_set);
+
+/* Range access over the offsets first_offset..last_offset (inclusive), a node at a time instead of a bit at a time: a day of seconds with a 64
+   bit window per node is 1,440 node operations rather than 86,400 bit ones. SetRange sets (value 1, creating the nodes needed) or clears (value
+   0, creating none) every offset and returns the number of nodes written; on a TREE_OPTION_COUNTERS tree setting raises zero counts to 1 and
+   clearing resets them. TestRangeAny is 1 if any offset in the range is set, TestRangeAll if every one is. Sub bit offsets past
+   bitmap_size_per_node are not part of any range, and a range with none below it, or with first_offset > last_offset, gives 0. */
+unsigned long long SetRange (struct Tree *tree, unsigned long long first_offset, unsigned long long last_offset, unsigned int value);
+unsigned int TestRangeAny (struct Tree *tree, unsigned long long first_offset, unsigned long long last_offset);
+unsigned int TestRangeAll (struct Tree *tree, unsigned long long first_offset, unsigned long long last_offset);
+
 /*(These Interfaces allow for creation and handling of nodes and their bitmap subsets
   independently of the total bitmap range..useful if your entire range is bigger than can be represented in 32 bits.
    Value will set a bit as 1 for any value > 0. Already_set is used if application wants to know if the bit was set prior to this call. */
 
 struct TreeNode *FindNode (struct Tree *tree, int unsigned key);
 struct TreeNode *FindOrInsertNode (struct Tree *tree, unsigned int key);
+struct TreeNode *FindNode64 (struct Tree *tree, unsigned long long key);
+struct TreeNode *FindOrInsertNode64 (struct Tree *tree, unsigned long long key);
 unsigned int CheckSubBit(struct Tree *tree, struct TreeNode *tree_node, unsigned int bit_offset);
 unsigned int SetSubBit(struct Tree *tree, struct TreeNode *tree_node, unsigned int bit_offset, unsigned int value, unsigned int *already_set);
 void ClearSubBits(struct Tree *tree, struct TreeNode *tree_node);
 
+/* Bulk load a balanced tree in linear time, without any per-key descent or rebalancing. BuildTreeFromSorted takes strictly ascending node keys
+   and optionally their bitmaps (count * ((bitmap_size_per_node + 7) / 8) bytes, NULL for all clear). BuildTreeFromSortedBits takes ascending
+   total bit offsets as used by SetBit (repeats allowed). Both return NULL if the input is out of order. */
+struct Tree *BuildTreeFromSorted (const unsigned long long *keys, const unsigned char *payloads, unsigned int count, unsigned int bitmap_size_per_node);
+struct Tree *BuildTreeFromSortedBits (const unsigned long long *bit_offsets, unsigned int count, unsigned int bitmap_size_per_node);
+
+/* Move every node and bitmap of a tree into one contiguous block, rebalanced and in van Emde Boas order, so lookups in a large tree built by
+   random order inserts touch far fewer cache lines and pages. Call it at a quiescent point (between batches of input): node pointers from
+   before are invalid afterwards. Nodes inserted later are allocated as usual until the next call. Returns the number of nodes in the tree,
+   or 0 if it is empty, could not be compacted for lack of memory, or has TREE_OPTION_SNAPSHOTS. A tree already compacted is left as is. */
+unsigned int CompactTree (struct Tree *tree);
+
+
+/* Counting trees (TREE_OPTION_COUNTERS). Each offset holds a small saturating counter, packed counter_bits apiece into the node payloads, in
+   place of a bit. IncrementBit adds one (stopping at the counter's maximum) and returns the count from before, so 0 means a first occurrence;
+   GetCount reads it. The bit interfaces keep working: a bit is set while its count is non zero, setting it raises a zero count to 1 and
+   clearing it resets the count. On a plain tree IncrementBit acts as SetBit, counting up to 1. GetCountHistogram adds the number of offsets
+   holding each count n > 0 to histogram[n], which needs TREE_COUNT_HISTOGRAM_SIZE entries; spilled nodes are included. */
+#define TREE_COUNT_HISTOGRAM_SIZE 256
+
+unsigned int IncrementBit (struct Tree *tree, unsigned long long total_bit_offset);
+unsigned int GetCount (struct Tree *tree, unsigned long long total_bit_offset);
+void GetCountHistogram (struct Tree *tree, unsigned long long *histogram);
+
+/* Out of core use (TREE_OPTION_SPILL). SpillTree writes percent of the nodes, taken from the end of the key range away from the last access, to a
+   sorted run file and frees them; the tree then answers for them from disk (through a sparse index and a small page cache), and brings a node back
+   into memory when one of its bits is set or FindNode returns it. Trees with a memory_budget call it themselves (spilling half) once their nodes
+   and bitmaps pass it, before an insert. Returns the number of nodes spilled. A spill frees or moves every node, so a node pointer from FindNode or FindOrInsertNode
+   (for CheckSubBit/SetSubBit) must not be used past the next SpillTree call or, with a memory_budget, past the next insert. TreeMemoryUsage is the
+   tree's current bytes_allocated, cheap enough to poll when keeping a budget over many trees. TreeSpillRuns is the number of run files the tree
+   has now, 0 once nothing is spilled (as FreezeTree requires). */
+unsigned int SpillTree (struct Tree *tree, unsigned int percent);
+size_t TreeMemoryUsage (struct Tree *tree);
+unsigned int TreeSpillRuns (struct Tree *tree);
+
+/* Read only, compressed copy of a tree that will not be written again (for example a finished year). Keys are stored as gaps in blocks under an
+   Eytzinger ordered index and the bitmaps as one packed array, so it takes a fraction of the tree's memory while answering FrozenCheckBit the same
+   as CheckBit64 on the tree. The tree (which must not have spilled nodes) is not changed and may be destroyed afterwards. FrozenForEachSetBit calls
+   visitor for every set bit in [first_offset, last_offset] in ascending order, stopping early when visitor returns non zero, and returns the number
+   of bits visited. ThawTree turns a frozen tree back into a writable one created with options (may be NULL, snapshots are not supported, and
+   counters come back as they were frozen), in linear time. */
+struct FrozenTree;
+typedef int (*FrozenBitVisitor) (void *context, unsigned long long total_bit_offset);
+
+struct FrozenTree *FreezeTree (struct Tree *tree);
+void DestroyFrozenTree (struct FrozenTree *frozen);
+struct Tree *ThawTree (struct FrozenTree *frozen, const TreeOptions *options);
+unsigned int FrozenCheckBit (struct FrozenTree *frozen, unsigned long long total_bit_offset);
+unsigned long long FrozenForEachSetBit (struct FrozenTree *frozen, unsigned long long first_offset, unsigned long long last_offset,
+                                        FrozenBitVisitor visitor, void *context);
+unsigned int FrozenTreeNodes (struct FrozenTree *frozen);
+size_t FrozenTreeBytes (struct FrozenTree *frozen);
+
+/* Copy-on-write snapshots (TREE_OPTION_SNAPSHOTS). One writer thread uses the normal interfaces; each SetBit/SetBit64/SetBit96 that changes a bit
+   publishes a new version, copying only the root to leaf path it touched. Changes made through FindOrInsertNode and SetSubBit become visible at the
+   next TreePublish, and node pointers from them must not be used past it. Any number of reader threads call TreeSnapshot (O(1)) to get an immutable
+   version, query it with CheckBitSnapshot while writes continue, and hand it back with ReleaseSnapshot; its memory is reclaimed by the writer.
+   All snapshots must be released before DestroyTree. */
+struct TreeVersion;
+
+int TreePublish (struct Tree *tree);
+struct TreeVersion *TreeSnapshot (struct Tree *tree);
+void ReleaseSnapshot (struct TreeVersion *snapshot);
+unsigned int CheckBitSnapshot (struct TreeVersion *snapshot, unsigned long long total_bit_offset);
+int SnapshotNodes (struct TreeVersion *snapshot);
 
 /* Utility to dump the tree. */
 void PrintTree (struct Tree *tree);
@@ -42,38 +208,52 @@ void PrintTree (struct Tree *tree);
 /* Print tree statistics */
 void TreeInfo (struct Tree *tree);
 
+/* Number of nodes on the longest root to leaf path (0 for an empty tree). */
+unsigned int TreeDepth (struct Tree *tree);
+
 /* test interface to run a simple set of functions */
 void example_test();
 
 /* Utility to enable debug output. */
 void SetTSVerbose (unsigned int enable_disable);
 
-#ifdef TESTSET_PROFILE
-
-/* Utility to dump memory usage and allocated nodes of system (not thread safe!) */
-size_t GetTSMemory();
-unsigned int GetTSNodes();
-unsigned int GetTSTrees();
-#endif
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
+/* Per tree statistics, see GetTreeStats. Each tree keeps its own counters, so they are as thread safe as the tree they describe. */
+#define TREE_STATS_DEPTH_BUCKETS 64
+
+typedef struct TreeStats {
+    unsigned long long lookups;       // node searches by FindNode, FindOrInsertNode, CheckBit and SetBit
+    unsigned long long hits;          // searches that found an existing node
+    unsigned long long finger_hits;   // searches resolved next to the previously accessed node without a descent (depth 0 in the histogram)
+    unsigned long long inserts;       // nodes added
+    unsigned long long rotations;     // rotations done by FixUpTree
+    unsigned long long recolorings;   // recolor-only fix ups (uncle red) plus root recolors in FixUpTree
+    unsigned long long path_copies;   // TREE_OPTION_SNAPSHOTS: nodes copied because a published version shares them
+    unsigned long long versions_published;
+    unsigned long long depth_histogram[TREE_STATS_DEPTH_BUCKETS]; // nodes visited per search, last bucket holds anything deeper
+    size_t             bytes_allocated; // tree header, nodes and payloads currently allocated
+    unsigned int       nodes;
+    unsigned long long bits_set;       // offsets with a non zero count on a TREE_OPTION_COUNTERS tree
+    double             bytes_per_set_bit;
+    unsigned long long bloom_queries;          // TREE_OPTION_BLOOM_FILTER: lookups checked against the filter
+    unsigned long long bloom_rejects;          // lookups answered "absent" by the filter alone
+    unsigned long long bloom_false_positives;  // lookups the filter let through that found no node
+    double             bloom_false_positive_rate; // bloom_false_positives / (bloom_rejects + bloom_false_positives)
+    double             bloom_estimated_fpr;    // expected rate for the current filter fill
+    size_t             bloom_bytes;
+    unsigned long long spilled_nodes;          // TREE_OPTION_SPILL: nodes written out by SpillTree
+    unsigned long long spill_lookups;          // misses in memory checked against the run files
+    unsigned long long spill_hits;             // ... and found there
+    unsigned long long spill_page_reads;       // pages read from run files (page cache misses)
+    unsigned int       spill_runs;             // run files now
+    unsigned long long spill_records;          // records in them (a key spilled again later is in more than one until runs merge)
+    unsigned long long spill_file_bytes;
+    unsigned long long hash_lookups;           // TREE_OPTION_HASH_INDEX, with TESTSET_PROFILE: lookups answered by the hash index
+    unsigned long long hash_group_probes;      // control byte groups compared for them (1 per lookup when nothing collides)
+    size_t             hash_bytes;
+    double             hash_load_factor;       // used slots / slots
+} TreeStats;
+
+void GetTreeStats (struct Tree *tree, TreeStats *stats);
+void ResetTreeStats (struct Tree *tree);
+
+#endif // TREESET_H
@@ -0,0 +1,165 @@
+/* TreeSet.hpp
+ * ===========
+ *  Compile time specialised TreeSet. The node geometry (bits per node, the width of the sub bit index and its mask) is fixed by the template
+ *  arguments, so splitting an offset into node key and sub bit is a constant shift and mask, and each node's bitmap is held inline as a
+ *  std::array<uint64_t, N> instead of a separately allocated byte array. Offsets map onto nodes exactly as in the C TreeSet created with
+ *  CreateTree(BitsPerNode) (the sub bit index is CountBitSize(BitsPerNode) bits wide and sub bits at or above BitsPerNode are never set).
+ *
+ *  The ordered node index is a std::map (a RedBlack tree) using Allocator, with the same last-access finger as the C tree so time ordered
+ *  input rarely needs a descent. C code reaches the common specialisations through TreeSetFixed.h.
+ */
+
+#ifndef TREESET_HPP
+#define TREESET_HPP
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <iterator>
+#include <map>
+#include <memory>
+#include <utility>
+
+namespace treeset {
+
+// Number of bits needed to hold value, same as CountBitSize in TreeSet.c.
+constexpr unsigned int CountBitSize (unsigned long long value)
+{
+    return (value > 0) ? (1 + CountBitSize(value >> 1)) : 0;
+}
+
+template <unsigned int BitsPerNode, typename KeyType = std::uint64_t, typename Allocator = std::allocator<KeyType> >
+class TreeSet
+{
+    static_assert(BitsPerNode > 0, "a node must hold at least one bit");
+
+public:
+    static constexpr unsigned int bits_per_node = BitsPerNode;
+    static constexpr unsigned int bitmap_idx_size = CountBitSize(BitsPerNode);
+    static constexpr KeyType sub_bit_mask = (KeyType(1) << bitmap_idx_size) - 1;
+    static constexpr std::size_t payload_words = (BitsPerNode + 63) / 64;
+
+    typedef std::array<std::uint64_t, payload_words> Payload;
+
+private:
+    typedef std::pair<const KeyType, Payload> value_type;
+    typedef typename std::allocator_traits<Allocator>::template rebind_alloc<value_type> node_allocator;
+    typedef std::map<KeyType, Payload, std::less<KeyType>, node_allocator> node_map;
+    typedef typename node_map::iterator node_iterator;
+
+    node_map nodes_;
+    node_iterator finger_;
+
+    static bool InRange (KeyType sub_bit) { return sub_bit < BitsPerNode; }
+    static std::uint64_t Mask (KeyType sub_bit) { return std::uint64_t(1) << (sub_bit % 64); }
+
+    /* Find the node for key starting from the last accessed node. Returns end() if absent and sets *hint to where key belongs. */
+    node_iterator Locate (KeyType key, node_iterator *hint)
+    {
+        if (finger_ != nodes_.end())
+        {
+            if (finger_->first == key)
+                return finger_;
+            if (finger_->first < key)
+            {
+                node_iterator next = std::next(finger_);
+                if ((next == nodes_.end()) || (key < next->first))
+                {
+                    *hint = next;
+                    return nodes_.end();
+                }
+                if (next->first == key)
+                    return finger_ = next;
+            }
+        }
+        *hint = nodes_.lower_bound(key);
+        if ((*hint != nodes_.end()) && ((*hint)->first == key))
+            return finger_ = *hint;
+        return nodes_.end();
+    }
+
+public:
+    explicit TreeSet (const Allocator &allocator = Allocator()) : nodes_(std::less<KeyType>(), node_allocator(allocator)), finger_(nodes_.end()) {}
+
+    TreeSet (const TreeSet &other) : nodes_(other.nodes_), finger_(nodes_.end()) {}
+    TreeSet &operator= (const TreeSet &other)
+    {
+        nodes_ = other.nodes_;
+        finger_ = nodes_.end();
+        return *this;
+    }
+
+    /* CheckBit - true if the bit at total_bit_offset is set. */
+    bool CheckBit (KeyType total_bit_offset)
+    {
+        KeyType sub_bit = total_bit_offset & sub_bit_mask;
+        node_iterator hint;
+        node_iterator node = Locate(total_bit_offset >> bitmap_idx_size, &hint);
+        return InRange(sub_bit) && (node != nodes_.end()) && ((node->second[sub_bit / 64] & Mask(sub_bit)) != 0);
+    }
+
+    /* SetBit - set (value true) or clear the bit at total_bit_offset, creating its node when setting. Returns whether it was set before. */
+    bool SetBit (KeyType total_bit_offset, bool value = true)
+    {
+        KeyType key = total_bit_offset >> bitmap_idx_size;
+        KeyType sub_bit = total_bit_offset & sub_bit_mask;
+        node_iterator hint;
+        node_iterator node = Locate(key, &hint);
+
+        if (!InRange(sub_bit))
+            return false;
+        if (node == nodes_.end())
+        {
+            if (!value)
+                return false;
+            node = finger_ = nodes_.emplace_hint(hint, key, Payload());
+        }
+
+        std::uint64_t &word = node->second[sub_bit / 64];
+        bool already_set = (word & Mask(sub_bit)) != 0;
+        if (value)
+            word |= Mask(sub_bit);
+        else
+            word &= ~Mask(sub_bit);
+        return already_set;
+    }
+
+    /* FindNode - bitmap of the node holding key, or NULL. */
+    Payload *FindNode (KeyType key)
+    {
+        node_iterator hint;
+        node_iterator node = Locate(key, &hint);
+        return (node != nodes_.end()) ? &node->second : nullptr;
+    }
+
+    /* FindOrInsertNode - bitmap of the node holding key, inserting a cleared one if needed. */
+    Payload &FindOrInsertNode (KeyType key)
+    {
+        node_iterator hint;
+        node_iterator node = Locate(key, &hint);
+        if (node == nodes_.end())
+            node = finger_ = nodes_.emplace_hint(hint, key, Payload());
+        return node->second;
+    }
+
+    std::size_t size () const { return nodes_.size(); }
+
+    void clear ()
+    {
+        nodes_.clear();
+        finger_ = nodes_.end();
+    }
+
+    /* ForEachNode - visit (key, payload) pairs in key order. */
+    template <typename Visitor>
+    void ForEachNode (Visitor visitor) const
+    {
+        for (typename node_map::const_iterator node = nodes_.begin(); node != nodes_.end(); ++node)
+            visitor(node->first, node->second);
+    }
+};
+
+} // namespace treeset
+
+#endif // TREESET_HPP
@@ -0,0 +1,1034 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <stdatomic.h>
+#endif
+#include "TreeSet.h"
+#include "TreeSetFixed.h"
+#include "TreeTrace.h"
+#ifndef _WIN32
+#include "TreeShards.h"
+#endif
+
+/* TreeSetBench - runs the TreeSet interfaces and the DateFilter parse/filter path against synthetic workloads and reports
+   ns/op, memory per set bit and tree depth. Every run is reproducible from its seed. Results are printed as a table and
+   appended as one JSON object per line to the results file (bench_output.txt by default) so runs can be compared over time.
+
+   Usage: TreeSetBench [-n<ops>] [-s<seed>] [-w<workload>] [-o<results file>] */
+
+// These are provided by DateFilter.c when built with DATEFILTER_NO_MAIN.
+int parse_timestamp (char * buffer, unsigned int length, int *year, int *month, int *day, int *hour, int *minute, int *second, int *microsecond,
+                     int *tz_adjusted);
+unsigned int CheckInsertTSPresent (int year, int month, int day, int hour, int minute, int second, int microsecond);
+void SetFractionDigits (unsigned int digits);
+
+#define BENCH_BITS_PER_NODE 60
+#define BENCH_YEAR_KEY_BITS 26 // DateFilter's MakeKey range for one year
+
+/* Utilities*/
+
+static unsigned long long rng_state = 0;
+
+// xorshift64* - small, fast and identical on every platform, unlike rand().
+static unsigned long long NextRandom (void)
+{
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return rng_state * 2685821657736338717ULL;
+}
+
+static double NowSeconds (void)
+{
+#ifdef _WIN32
+    LARGE_INTEGER frequency, counter;
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&counter);
+    return (double) counter.QuadPart / (double) frequency.QuadPart;
+#else
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double) now.tv_sec + ((double) now.tv_nsec / 1e9);
+#endif
+}
+
+// Total bit offset as DataFilter would build it from a running count of seconds (minute node, second sub bit).
+static unsigned long long SecondsToOffset (unsigned long long seconds)
+{
+    return ((seconds / 60) << 6) | (seconds % 60);
+}
+
+/* Workload generators - each fills offsets[0..count-1]. */
+
+// Random offset within the first key_bits bits of offset space. Only the low BENCH_BITS_PER_NODE sub bits of each 64 bit node window
+// can be set, so the sub bit is drawn from that range.
+static unsigned long long RandomOffset (unsigned int key_bits)
+{
+    unsigned long long node_key = NextRandom() & ((1ULL << (key_bits - 6)) - 1);
+    return (node_key << 6) | (NextRandom() % BENCH_BITS_PER_NODE);
+}
+
+// Uniform random offsets over one DateFilter year key space.
+static void GenerateUniform (unsigned long long *offsets, unsigned int count)
+{
+    for (unsigned int idx=0;idx<count;idx++)
+        offsets[idx] = RandomOffset(BENCH_YEAR_KEY_BITS);
+}
+
+// Ascending timestamps a few seconds apart, like a log file.
+static void GenerateTimeOrdered (unsigned long long *offsets, unsigned int count)
+{
+    unsigned long long seconds = NextRandom() % 1000000;
+    for (unsigned int idx=0;idx<count;idx++)
+    {
+        seconds += NextRandom() % 4;
+        offsets[idx] = SecondsToOffset(seconds);
+    }
+}
+
+// Random picks out of a pool of 1024 offsets, so nearly every operation hits an existing bit.
+static void GenerateHeavyDuplicate (unsigned long long *offsets, unsigned int count)
+{
+    unsigned long long pool[1024];
+    for (unsigned int idx=0;idx<1024;idx++)
+        pool[idx] = RandomOffset(BENCH_YEAR_KEY_BITS);
+    for (unsigned int idx=0;idx<count;idx++)
+        offsets[idx] = pool[NextRandom() % 1024];
+}
+
+// Offsets scattered over 64 years worth of key space, so almost every operation lands on its own node.
+static void GenerateMultiYearSparse (unsigned long long *offsets, unsigned int count)
+{
+    for (unsigned int idx=0;idx<count;idx++)
+        offsets[idx] = ((NextRandom() % 64) << BENCH_YEAR_KEY_BITS) | RandomOffset(BENCH_YEAR_KEY_BITS);
+}
+
+// Strictly ascending node keys, one new node per operation, always inserted at the far right of the tree.
+static void GenerateAscending (unsigned long long *offsets, unsigned int count)
+{
+    for (unsigned int idx=0;idx<count;idx++)
+        offsets[idx] = (unsigned long long) idx << 6;
+}
+
+// Millisecond timestamps a few ms apart starting anywhere in the last 30 years, so offsets are well past 32 bits (SetBit64 range).
+static void GenerateMillisecondsDecades (unsigned long long *offsets, unsigned int count)
+{
+    unsigned long long milliseconds = 1000ULL * (NextRandom() % (30ULL * 365 * 24 * 3600));
+    for (unsigned int idx=0;idx<count;idx++)
+    {
+        milliseconds += NextRandom() % 8;
+        offsets[idx] = ((milliseconds / BENCH_BITS_PER_NODE) << 6) | (milliseconds % BENCH_BITS_PER_NODE);
+    }
+}
+
+typedef struct workload {
+    const char *name;
+    void (*generate)(unsigned long long *offsets, unsigned int count);
+} workload;
+
+static const workload workloads[] = {
+    {"uniform", GenerateUniform},
+    {"time_ordered", GenerateTimeOrdered},
+    {"heavy_duplicate", GenerateHeavyDuplicate},
+    {"multi_year_sparse", GenerateMultiYearSparse},
+    {"ascending", GenerateAscending},
+    {"ms_decades", GenerateMillisecondsDecades},
+};
+
+#define WORKLOAD_COUNT (sizeof(workloads) / sizeof(workloads[0]))
+
+/* BenchTreeWorkload - time SetBit, CheckBit and FindOrInsertNode over one workload and record the result, along with SetBit/CheckBit on the
+   compile time specialised TreeSet60 (TreeSetFixed.h) for comparison against the runtime configured C tree. */
+static void BenchTreeWorkload (const workload *load, unsigned long long *offsets, unsigned int count, unsigned long long seed, FILE *fp_results)
+{
+    unsigned int bits_set = 0;
+    unsigned int check_sum = 0;
+    unsigned int fixed_check_sum = 0;
+    double start_time, setbit_time, checkbit_time, insert_time, fixed_setbit_time, fixed_checkbit_time;
+
+    rng_state = seed;
+    load->generate(offsets, count);
+
+    struct Tree *tree = CreateTree(BENCH_BITS_PER_NODE);
+
+    start_time = NowSeconds();
+    for (unsigned int idx=0;idx<count;idx++)
+    {
+        unsigned int already_set = 0;
+        SetBit64(tree, offsets[idx], 1, &already_set);
+        bits_set += !already_set;
+    }
+    setbit_time = NowSeconds() - start_time;
+
+    start_time = NowSeconds();
+    for (unsigned int idx=0;idx<count;idx++)
+        check_sum += CheckBit64(tree, offsets[idx]);
+    checkbit_time = NowSeconds() - start_time;
+
+    TreeStats stats;
+    GetTreeStats(tree, &stats);
+    size_t tree_memory = stats.bytes_allocated;
+    unsigned int depth = TreeDepth(tree);
+    unsigned int nodes = stats.nodes;
+    DestroyTree(tree);
+
+    tree = CreateTree(BENCH_BITS_PER_NODE);
+    start_time = NowSeconds();
+    for (unsigned int idx=0;idx<count;idx++)
+        FindOrInsertNode64(tree, offsets[idx] >> 6);
+    insert_time = NowSeconds() - start_time;
+    DestroyTree(tree);
+
+    struct TreeSet60 *fixed_tree = CreateTreeSet60();
+    start_time = NowSeconds();
+    for (unsigned int idx=0;idx<count;idx++)
+        SetBitTreeSet60(fixed_tree, offsets[idx], 1, NULL);
+    fixed_setbit_time = NowSeconds() - start_time;
+
+    start_time = NowSeconds();
+    for (unsigned int idx=0;idx<count;idx++)
+        fixed_check_sum += CheckBitTreeSet60(fixed_tree, offsets[idx]);
+    fixed_checkbit_time = NowSeconds() - start_time;
+    DestroyTreeSet60(fixed_tree);
+
+    if (check_sum != count)
+        fprintf(stderr, "%s: CheckBit found %u of %u bits set!\n", load->name, check_sum, count);
+    if (fixed_check_sum != count)
+        fprintf(stderr, "%s: CheckBitTreeSet60 found %u of %u bits set!\n", load->name, fixed_check_sum, count);
+
+    double setbit_ns = setbit_time * 1e9 / count;
+    double checkbit_ns = checkbit_time * 1e9 / count;
+    double insert_ns = insert_time * 1e9 / count;
+    double fixed_setbit_ns = fixed_setbit_time * 1e9 / count;
+    double fixed_checkbit_ns = fixed_checkbit_time * 1e9 / count;
+    double bytes_per_bit = stats.bytes_per_set_bit;
+
+    printf ("%-18s %10.1f %10.1f %14.1f %10u %10u %12.2f %6u %10.1f %10.1f\n", load->name, setbit_ns, checkbit_ns, insert_ns, nodes, bits_set, bytes_per_bit, depth,
+            fixed_setbit_ns, fixed_checkbit_ns);
+    if (fp_results)
+    {
+        fprintf (fp_results, "{\"bench\":\"tree\",\"workload\":\"%s\",\"ops\":%u,\"seed\":%llu,\"setbit_ns\":%.2f,\"checkbit_ns\":%.2f,"
+                 "\"findorinsertnode_ns\":%.2f,\"nodes\":%u,\"bits_set\":%u,\"bytes\":%lu,\"bytes_per_set_bit\":%.3f,\"max_depth\":%u,"
+                 "\"fixed60_setbit_ns\":%.2f,\"fixed60_checkbit_ns\":%.2f",
+                 load->name, count, seed, setbit_ns, checkbit_ns, insert_ns, nodes, bits_set, (unsigned long) tree_memory, bytes_per_bit, depth,
+                 fixed_setbit_ns, fixed_checkbit_ns);
+#ifdef TESTSET_PROFILE
+        fprintf (fp_results, ",\"lookups\":%llu,\"hits\":%llu,\"finger_hits\":%llu,\"inserts\":%llu,\"rotations\":%llu,\"recolorings\":%llu",
+                 stats.lookups, stats.hits, stats.finger_hits, stats.inserts, stats.rotations, stats.recolorings);
+#endif
+        fprintf (fp_results, "}\n");
+    }
+}
+
+/* BenchNegativeLookups - CheckBit probes that almost all miss (random offsets against a tree of random offsets), with and without the
+   Bloom filter prefilter (TREE_OPTION_BLOOM_FILTER), reporting ns/op and the filter's measured false positive rate. */
+static void BenchNegativeLookups (unsigned long long *offsets, unsigned int count, unsigned long long seed, FILE *fp_results)
+{
+    TreeOptions options;
+    struct Tree *plain_tree = CreateTree(BENCH_BITS_PER_NODE);
+    struct Tree *bloom_tree;
+    unsigned int plain_found = 0, bloom_found = 0;
+
+    memset(&options, 0, sizeof(options));
+    options.flags = TREE_OPTION_BLOOM_FILTER;
+    options.expected_nodes = count;
+    bloom_tree = CreateTreeWithOptions(BENCH_BITS_PER_NODE, &options);
+    rng_state = seed;
+    GenerateMultiYearSparse(offsets, count);
+    for (unsigned int idx=0;idx<count;idx++)
+    {
+        SetBit64(plain_tree, offsets[idx], 1, NULL);
+        SetBit64(bloom_tree, offsets[idx], 1, NULL);
+    }
+
+    rng_state = seed ^ 0x9e3779b97f4a7c15ULL;
+    GenerateMultiYearSparse(offsets, count);
+
+    double start_time = NowSeconds();
+    for (unsigned int idx=0;idx<count;idx++)
+        plain_found += CheckBit64(plain_tree, offsets[idx]);
+    double plain_ns = (NowSeconds() - start_time) * 1e9 / count;
+
+    start_time = NowSeconds();
+    for (unsigned int idx=0;idx<count;idx++)
+        bloom_found += CheckBit64(bloom_tree, offsets[idx]);
+    double bloom_ns = (NowSeconds() - start_time) * 1e9 / count;
+
+    TreeStats stats;
+    GetTreeStats(bloom_tree, &stats);
+    if (plain_found != bloom_found)
+        fprintf(stderr, "negative_lookups: Bloom filtered tree found %u bits, plain tree %u!\n", bloom_found, plain_found);
+
+    printf ("\nNegative CheckBit: %.1f ns plain, %.1f ns with Bloom filter (%lu bytes, measured FPR %.4f, estimated %.4f, %u of %u probes hit)\n",
+            plain_ns, bloom_ns, (unsigned long) stats.bloom_bytes, stats.bloom_false_positive_rate, stats.bloom_estimated_fpr, plain_found, count);
+    if (fp_results)
+    {
+        fprintf (fp_results, "{\"bench\":\"negative_lookups\",\"workload\":\"multi_year_sparse\",\"ops\":%u,\"seed\":%llu,\"checkbit_ns\":%.2f,"
+                 "\"bloom_checkbit_ns\":%.2f,\"bloom_bytes\":%lu,\"bloom_fpr\":%.5f,\"bloom_estimated_fpr\":%.5f,\"hits\":%u}\n",
+                 count, seed, plain_ns, bloom_ns, (unsigned long) stats.bloom_bytes, stats.bloom_false_positive_rate, stats.bloom_estimated_fpr, plain_found);
+    }
+    DestroyTree(plain_tree);
+    DestroyTree(bloom_tree);
+}
+
+/* BenchInterleaved - random order CheckBit/SetBit one at a time against CheckBitsInterleaved/SetBitsInterleaved on the same uniform tree
+   (half the probes hit set offsets). With enough ops the tree is far larger than the last level cache, which is where interleaving pays. */
+static void BenchInterleaved (unsigned long long *offsets, unsigned int count, unsigned long long seed, FILE *fp_results)
+{
+    struct Tree *tree = CreateTree(BENCH_BITS_PER_NODE);
+    unsigned char *results = malloc(count);
+    unsigned int single_found = 0, interleaved_found = 0;
+
+    if (!tree || !results)
+    {
+        DestroyTree(tree);
+        free(results);
+        return;
+    }
+
+    rng_state = seed;
+    GenerateUniform(offsets, count);
+    for (unsigned int idx=0;idx<count;idx++)
+        SetBit64(tree, offsets[idx], 1, NULL);
+    for (unsigned int idx=0;idx<count;idx++)
+    {
+        if (NextRandom() & 1)
+            offsets[idx] = offsets[NextRandom() % count];
+        else
+            offsets[idx] = RandomOffset(40);
+    }
+
+    double start_time = NowSeconds();
+    for (unsigned int idx=0;idx<count;idx++)
+        single_found += CheckBit64(tree, offsets[idx]);
+    double check_ns = (NowSeconds() - start_time) * 1e9 / count;
+
+    start_time = NowSeconds();
+    CheckBitsInterleaved(tree, offsets, count, results);
+    double interleaved_check_ns = (NowSeconds() - start_time) * 1e9 / count;
+    for (unsigned int idx=0;idx<count;idx++)
+        interleaved_found += results[idx];
+
+    // Re-set the bits found above, so both passes do the same (insert free) work.
+    for (unsigned int idx=0, kept=0;idx<count;idx++)
+    {
+        if (results[idx])
+            offsets[kept++] = offsets[idx];
+    }
+    start_time = NowSeconds();
+    for (unsigned int idx=0;idx<interleaved_found;idx++)
+        SetBit64(tree, offsets[idx], 1, NULL);
+    double set_ns = (interleaved_found > 0)?((NowSeconds() - start_time) * 1e9 / interleaved_found):0.0;
+
+    start_time = NowSeconds();
+    SetBitsInterleaved(tree, offsets, interleaved_found, 1, NULL);
+    double interleaved_set_ns = (interleaved_found > 0)?((NowSeconds() - start_time) * 1e9 / interleaved_found):0.0;
+
+    if (single_found != interleaved_found)
+        fprintf(stderr, "interleaved: CheckBitsInterleaved found %u bits, CheckBit %u!\n", interleaved_found, single_found);
+
+    printf ("\nRandom probes: CheckBit %.1f ns, CheckBitsInterleaved %.1f ns; SetBit %.1f ns, SetBitsInterleaved %.1f ns\n",
+            check_ns, interleaved_check_ns, set_ns, interleaved_set_ns);
+    if (fp_results)
+    {
+        fprintf (fp_results, "{\"bench\":\"interleaved\",\"workload\":\"uniform\",\"ops\":%u,\"seed\":%llu,\"checkbit_ns\":%.2f,"
+                 "\"interleaved_checkbit_ns\":%.2f,\"setbit_ns\":%.2f,\"interleaved_setbit_ns\":%.2f,\"hits\":%u}\n",
+                 count, seed, check_ns, interleaved_check_ns, set_ns, interleaved_set_ns, single_found);
+    }
+    free(results);
+    DestroyTree(tree);
+}
+
+/* BenchSpill - SetBit over the time_ordered workload, with one in 16 offsets repeated from anywhere earlier (as duplicates in old logs are),
+   in a plain tree and in a TREE_OPTION_SPILL tree limited to an eighth of the plain tree's memory. */
+static void BenchSpill (unsigned long long *offsets, unsigned int count, unsigned long long seed, FILE *fp_results)
+{
+    struct Tree *plain_tree = CreateTree(BENCH_BITS_PER_NODE);
+    struct Tree *spill_tree;
+    TreeOptions options;
+    unsigned int plain_duplicates = 0, spill_duplicates = 0, already_set;
+    TreeStats stats;
+
+    rng_state = seed;
+    GenerateTimeOrdered(offsets, count);
+    for (unsigned int idx=1;idx<count;idx++)
+    {
+        if ((NextRandom() % 16) == 0)
+            offsets[idx] = offsets[NextRandom() % idx];
+    }
+
+    double start_time = NowSeconds();
+    for (unsigned int idx=0;idx<count;idx++)
+    {
+        SetBit64(plain_tree, offsets[idx], 1, &already_set);
+        plain_duplicates += already_set;
+    }
+    double plain_ns = (NowSeconds() - start_time) * 1e9 / count;
+    size_t plain_bytes = TreeMemoryUsage(plain_tree);
+    DestroyTree(plain_tree);
+
+    memset(&options, 0, sizeof(options));
+    options.flags = TREE_OPTION_SPILL;
+    options.memory_budget = plain_bytes / 8;
+    spill_tree = CreateTreeWithOptions(BENCH_BITS_PER_NODE, &options);
+    if (!spill_tree)
+        return;
+    start_time = NowSeconds();
+    for (unsigned int idx=0;idx<count;idx++)
+    {
+        SetBit64(spill_tree, offsets[idx], 1, &already_set);
+        spill_duplicates += already_set;
+    }
+    double spill_ns = (NowSeconds() - start_time) * 1e9 / count;
+    GetTreeStats(spill_tree, &stats);
+
+    if (plain_duplicates != spill_duplicates)
+        fprintf(stderr, "spill: spilling tree found %u duplicates, plain tree %u!\n", spill_duplicates, plain_duplicates);
+
+    printf ("\nSpill: SetBit %.1f ns in memory (%lu bytes), %.1f ns within a budget of %lu bytes (%lu bytes in memory, %u runs, %llu page reads)\n",
+            plain_ns, (unsigned long) plain_bytes, spill_ns, (unsigned long) options.memory_budget, (unsigned long) stats.bytes_allocated,
+            stats.spill_runs, stats.spill_page_reads);
+    if (fp_results)
+    {
+        fprintf (fp_results, "{\"bench\":\"spill\",\"workload\":\"time_ordered\",\"ops\":%u,\"seed\":%llu,\"setbit_ns\":%.2f,\"spill_setbit_ns\":%.2f,"
+                 "\"tree_bytes\":%lu,\"budget_bytes\":%lu,\"spill_runs\":%u,\"spill_page_reads\":%llu,\"duplicates\":%u}\n",
+                 count, seed, plain_ns, spill_ns, (unsigned long) plain_bytes, (unsigned long) options.memory_budget, stats.spill_runs,
+                 stats.spill_page_reads, plain_duplicates);
+    }
+    DestroyTree(spill_tree);
+}
+
+/* BenchFreeze - memory and CheckBit cost of a tree against its FreezeTree copy, over the multi_year_sparse workload probed in random order
+   (half the probes are offsets that were set). */
+static void BenchFreeze (unsigned long long *offsets, unsigned int count, unsigned long long seed, FILE *fp_results)
+{
+    struct Tree *tree = CreateTree(BENCH_BITS_PER_NODE);
+    struct FrozenTree *frozen;
+    unsigned int tree_found = 0, frozen_found = 0;
+
+    rng_state = seed;
+    GenerateMultiYearSparse(offsets, count);
+    for (unsigned int idx=0;idx<count;idx++)
+        SetBit64(tree, offsets[idx], 1, NULL);
+    frozen = FreezeTree(tree);
+    if (!frozen)
+    {
+        DestroyTree(tree);
+        return;
+    }
+
+    for (unsigned int idx=0;idx<count;idx++)
+    {
+        if (NextRandom() & 1)
+            offsets[idx] = RandomOffset(BENCH_YEAR_KEY_BITS + 8);
+        else
+            offsets[idx] = offsets[NextRandom() % count];
+    }
+
+    double start_time = NowSeconds();
+    for (unsigned int idx=0;idx<count;idx++)
+        tree_found += CheckBit64(tree, offsets[idx]);
+    double tree_ns = (NowSeconds() - start_time) * 1e9 / count;
+
+    start_time = NowSeconds();
+    for (unsigned int idx=0;idx<count;idx++)
+        frozen_found += FrozenCheckBit(frozen, offsets[idx]);
+    double frozen_ns = (NowSeconds() - start_time) * 1e9 / count;
+
+    TreeStats stats;
+    GetTreeStats(tree, &stats);
+    if (tree_found != frozen_found)
+        fprintf(stderr, "freeze: frozen tree found %u bits, tree %u!\n", frozen_found, tree_found);
+
+    printf ("\nFrozen: %lu bytes for %u nodes (tree %lu bytes), CheckBit %.1f ns frozen, %.1f ns tree\n", (unsigned long) FrozenTreeBytes(frozen),
+            FrozenTreeNodes(frozen), (unsigned long) stats.bytes_allocated, frozen_ns, tree_ns);
+    if (fp_results)
+    {
+        fprintf (fp_results, "{\"bench\":\"freeze\",\"workload\":\"multi_year_sparse\",\"ops\":%u,\"seed\":%llu,\"checkbit_ns\":%.2f,"
+                 "\"frozen_checkbit_ns\":%.2f,\"tree_bytes\":%lu,\"frozen_bytes\":%lu,\"nodes\":%u}\n",
+                 count, seed, tree_ns, frozen_ns, (unsigned long) stats.bytes_allocated, (unsigned long) FrozenTreeBytes(frozen), FrozenTreeNodes(frozen));
+    }
+    DestroyFrozenTree(frozen);
+    DestroyTree(tree);
+}
+
+/* BenchCompact - random order CheckBit over a tree built by random order inserts (so its nodes are scattered over the heap), before and
+   after CompactTree relocates them into one van Emde Boas ordered block. Every probe is an offset that was set. */
+static void BenchCompact (unsigned long long *offsets, unsigned int count, unsigned long long seed, FILE *fp_results)
+{
+    struct Tree *tree = CreateTree(BENCH_BITS_PER_NODE);
+    unsigned int *probes = malloc((size_t) count * sizeof(unsigned int));
+    unsigned int found = 0, compact_found = 0;
+
+    if (!tree || !probes)
+    {
+        DestroyTree(tree);
+        free(probes);
+        return;
+    }
+
+    rng_state = seed;
+    for (unsigned int idx=0;idx<count;idx++)
+    {
+        offsets[idx] = RandomOffset(BENCH_YEAR_KEY_BITS + 8);
+        SetBit64(tree, offsets[idx], 1, NULL);
+    }
+    for (unsigned int idx=0;idx<count;idx++)
+        probes[idx] = (unsigned int) (NextRandom() % count);
+    unsigned int depth = TreeDepth(tree);
+
+    double start_time = NowSeconds();
+    for (unsigned int idx=0;idx<count;idx++)
+        found += CheckBit64(tree, offsets[probes[idx]]);
+    double scattered_ns = (NowSeconds() - start_time) * 1e9 / count;
+
+    start_time = NowSeconds();
+    unsigned int nodes = CompactTree(tree);
+    double compact_ms = (NowSeconds() - start_time) * 1e3;
+
+    start_time = NowSeconds();
+    for (unsigned int idx=0;idx<count;idx++)
+        compact_found += CheckBit64(tree, offsets[probes[idx]]);
+    double compact_ns = (NowSeconds() - start_time) * 1e9 / count;
+
+    if ((found != count) || (compact_found != count))
+        fprintf(stderr, "compact: found %u bits before and %u after compaction, expected %u!\n", found, compact_found, count);
+
+    printf ("\nCompactTree: %u nodes in %.1f ms, CheckBit %.1f ns scattered (depth %u), %.1f ns compacted (depth %u)\n", nodes, compact_ms,
+            scattered_ns, depth, compact_ns, TreeDepth(tree));
+    if (fp_results)
+    {
+        fprintf (fp_results, "{\"bench\":\"compact\",\"workload\":\"uniform_sparse\",\"ops\":%u,\"seed\":%llu,\"checkbit_ns\":%.2f,"
+                 "\"compact_checkbit_ns\":%.2f,\"compact_ms\":%.2f,\"nodes\":%u,\"depth\":%u,\"compact_depth\":%u}\n",
+                 count, seed, scattered_ns, compact_ns, compact_ms, nodes, depth, TreeDepth(tree));
+    }
+    free(probes);
+    DestroyTree(tree);
+}
+
+/* BenchHashIndex - random order SetBit64 then CheckBit64 (half of them on offsets that were set) over the same sparse offsets, on a plain
+   tree and on one with TREE_OPTION_HASH_INDEX. */
+static void BenchHashIndex (unsigned long long *offsets, unsigned int count, unsigned long long seed, FILE *fp_results)
+{
+    TreeOptions options;
+    double set_ns[2], check_ns[2];
+    unsigned int found[2] = {0, 0};
+    TreeStats stats;
+
+    memset(&options, 0, sizeof(options));
+    options.flags = TREE_OPTION_HASH_INDEX;
+    rng_state = seed;
+    for (unsigned int idx=0;idx<count;idx++)
+        offsets[idx] = RandomOffset(BENCH_YEAR_KEY_BITS + 8);
+
+    for (int hashed=0;hashed<2;hashed++)
+    {
+        struct Tree *tree = (hashed)?CreateTreeWithOptions(BENCH_BITS_PER_NODE, &options):CreateTree(BENCH_BITS_PER_NODE);
+        if (!tree)
+            return;
+
+        double start_time = NowSeconds();
+        for (unsigned int idx=0;idx<count;idx++)
+            SetBit64(tree, offsets[idx], 1, NULL);
+        set_ns[hashed] = (NowSeconds() - start_time) * 1e9 / count;
+
+        rng_state = seed + 1;
+        start_time = NowSeconds();
+        for (unsigned int idx=0;idx<count;idx++)
+            found[hashed] += CheckBit64(tree, (NextRandom() & 1)?offsets[NextRandom() % count]:RandomOffset(BENCH_YEAR_KEY_BITS + 8));
+        check_ns[hashed] = (NowSeconds() - start_time) * 1e9 / count;
+
+        GetTreeStats(tree, &stats);
+        DestroyTree(tree);
+    }
+    if (found[0] != found[1])
+        fprintf(stderr, "hash_index: found %u bits with the index, %u without!\n", found[1], found[0]);
+
+    printf ("\nHash index: SetBit %.1f ns (tree %.1f ns), CheckBit %.1f ns (tree %.1f ns), %lu bytes of index at load %.2f\n", set_ns[1], set_ns[0],
+            check_ns[1], check_ns[0], (unsigned long) stats.hash_bytes, stats.hash_load_factor);
+    if (fp_results)
+    {
+        fprintf (fp_results, "{\"bench\":\"hash_index\",\"workload\":\"uniform_sparse\",\"ops\":%u,\"seed\":%llu,\"setbit_ns\":%.2f,\"checkbit_ns\":%.2f,"
+                 "\"hash_setbit_ns\":%.2f,\"hash_checkbit_ns\":%.2f,\"hash_bytes\":%lu,\"nodes\":%u}\n",
+                 count, seed, set_ns[0], check_ns[0], set_ns[1], check_ns[1], (unsigned long) stats.hash_bytes, stats.nodes);
+    }
+}
+
+/* BenchTrace - SetBit64 then CheckBit64 over the uniform workload with tracing off and then on (every lookup, insert, rotation and bit
+   access writing a TreeTraceRecord to this thread's ring), to show what the trace points cost in each state. */
+static void BenchTrace (unsigned long long *offsets, unsigned int count, unsigned long long seed, FILE *fp_results)
+{
+    double set_ns[2], check_ns[2];
+    unsigned int found[2] = {0, 0};
+
+    rng_state = seed;
+    GenerateUniform(offsets, count);
+
+    for (int traced=0;traced<2;traced++)
+    {
+        struct Tree *tree = CreateTree(BENCH_BITS_PER_NODE);
+        if (!tree)
+            return;
+        if (traced)
+            TreeTraceStart(0);
+
+        double start_time = NowSeconds();
+        for (unsigned int idx=0;idx<count;idx++)
+            SetBit64(tree, offsets[idx], 1, NULL);
+        set_ns[traced] = (NowSeconds() - start_time) * 1e9 / count;
+
+        start_time = NowSeconds();
+        for (unsigned int idx=0;idx<count;idx++)
+            found[traced] += CheckBit64(tree, offsets[count - 1 - idx]);
+        check_ns[traced] = (NowSeconds() - start_time) * 1e9 / count;
+
+        TreeTraceStop();
+        DestroyTree(tree);
+    }
+    TreeTraceRelease();
+    if (found[0] != found[1])
+        fprintf(stderr, "trace: found %u bits traced, %u untraced!\n", found[1], found[0]);
+
+    printf ("\nTrace: SetBit %.1f ns untraced, %.1f ns traced, CheckBit %.1f ns untraced, %.1f ns traced\n", set_ns[0], set_ns[1],
+            check_ns[0], check_ns[1]);
+    if (fp_results)
+    {
+        fprintf (fp_results, "{\"bench\":\"trace\",\"workload\":\"uniform\",\"ops\":%u,\"seed\":%llu,\"setbit_ns\":%.2f,\"checkbit_ns\":%.2f,"
+                 "\"traced_setbit_ns\":%.2f,\"traced_checkbit_ns\":%.2f}\n", count, seed, set_ns[0], check_ns[0], set_ns[1], check_ns[1]);
+    }
+}
+
+/* BenchRange - marks whole days as seen in DateFilter's key layout, a second per bit: one SetBit64 per second against one SetRange per hour
+   (a node per minute), then checks each hour with TestRangeAll. Uses max(1, ops / 86400) days. */
+#define BENCH_RANGE_KEY(month, day, hour, minute, second) \
+    (((unsigned long long) (month) << 22) + ((day) << 17) + ((hour) << 12) + ((minute) << 6) + (second))
+
+static void BenchRange (unsigned int count, unsigned long long seed, FILE *fp_results)
+{
+    unsigned int days = (count / 86400 > 0)?count / 86400:1;
+    double day_ns[2];
+    unsigned int nodes[2], full[2] = {0, 0};
+    TreeStats stats;
+
+    if (days > 12 * 28)
+        days = 12 * 28;
+    for (int ranged=0;ranged<2;ranged++)
+    {
+        struct Tree *tree = CreateTree(BENCH_BITS_PER_NODE);
+        if (!tree)
+            return;
+
+        double start_time = NowSeconds();
+        for (unsigned int day_idx=0;day_idx<days;day_idx++)
+        {
+            unsigned int month = 1 + (day_idx / 28), day = 1 + (day_idx % 28);
+            for (unsigned int hour=0;hour<24;hour++)
+            {
+                if (ranged)
+                {
+                    SetRange(tree, BENCH_RANGE_KEY(month, day, hour, 0, 0), BENCH_RANGE_KEY(month, day, hour, 59, 59), 1);
+                    continue;
+                }
+                for (unsigned int minute=0;minute<60;minute++)
+                    for (unsigned int second=0;second<60;second++)
+                        SetBit64(tree, BENCH_RANGE_KEY(month, day, hour, minute, second), 1, NULL);
+            }
+        }
+        day_ns[ranged] = (NowSeconds() - start_time) * 1e9 / days;
+
+        // By the hour, as a day's key span also covers minutes 60-63 and hours 24-31, which have no nodes.
+        for (unsigned int day_idx=0;day_idx<days;day_idx++)
+        {
+            unsigned int month = 1 + (day_idx / 28), day = 1 + (day_idx % 28), hour = 0;
+            while ((hour < 24) && TestRangeAll(tree, BENCH_RANGE_KEY(month, day, hour, 0, 0), BENCH_RANGE_KEY(month, day, hour, 59, 59)))
+                hour++;
+            full[ranged] += (hour == 24);
+        }
+        GetTreeStats(tree, &stats);
+        nodes[ranged] = stats.nodes;
+        DestroyTree(tree);
+    }
+    if ((nodes[0] != nodes[1]) || (full[0] != days) || (full[1] != days))
+        fprintf(stderr, "range: %u and %u nodes, %u and %u of %u days found full!\n", nodes[0], nodes[1], full[0], full[1], days);
+
+    printf ("\nRange: a day by SetBit %.1f us, by SetRange %.1f us, %u days in %u nodes\n", day_ns[0] / 1000.0, day_ns[1] / 1000.0, days, nodes[1]);
+    if (fp_results)
+    {
+        fprintf (fp_results, "{\"bench\":\"range\",\"workload\":\"whole_days\",\"ops\":%u,\"seed\":%llu,\"setbit_day_ns\":%.2f,\"setrange_day_ns\":%.2f,"
+                 "\"days\":%u,\"nodes\":%u}\n", count, seed, day_ns[0], day_ns[1], days, nodes[1]);
+    }
+}
+
+/* BenchTuned - SetBit64 over the uniform, time_ordered and multi_year_sparse workloads on trees of 60 and 4095 bits per node (a minute and
+   64 minutes of seconds in the bench's offset layout) and on one from CreateTreeTuned, sampling the first 1% of the offsets. Shows how close
+   the tuned tree comes to the better fixed width in time and memory. */
+static void BenchTuned (unsigned long long *offsets, unsigned int count, unsigned long long seed, FILE *fp_results)
+{
+    static const char *names[3] = {"uniform", "time_ordered", "multi_year_sparse"};
+    static void (*generators[3])(unsigned long long *offsets, unsigned int count) = {GenerateUniform, GenerateTimeOrdered, GenerateMultiYearSparse};
+    static const unsigned int widths[2] = {BENCH_BITS_PER_NODE, 4095};
+
+    printf ("\n%-18s %12s %12s %12s %12s %12s %12s %8s\n", "tuned workload", "60 ns", "60 bytes", "4095 ns", "4095 bytes", "tuned ns", "tuned bytes",
+            "tuned to");
+    for (int load=0;load<3;load++)
+    {
+        TreeTuningHints hints = {widths, 2, offsets, (count / 100 > 0)?count / 100:1, NULL, count, {0}};
+        TreeTuning tuning;
+        double set_ns[3];
+        size_t bytes[3];
+
+        rng_state = seed;
+        generators[load](offsets, count);
+        if (!TuneTree(&hints, &tuning))
+            return;
+        for (int variant=0;variant<3;variant++)
+        {
+            struct Tree *tree = (variant < 2)?CreateTree(widths[variant]):CreateTreeFromTuning(&tuning, NULL);
+            TreeStats stats;
+            if (!tree)
+                return;
+
+            double start_time = NowSeconds();
+            for (unsigned int idx=0;idx<count;idx++)
+                SetBit64(tree, offsets[idx], 1, NULL);
+            set_ns[variant] = (NowSeconds() - start_time) * 1e9 / count;
+            GetTreeStats(tree, &stats);
+            bytes[variant] = stats.bytes_allocated;
+            DestroyTree(tree);
+        }
+        printf ("%-18s %12.1f %12lu %12.1f %12lu %12.1f %12lu %6u%s\n", names[load], set_ns[0], (unsigned long) bytes[0], set_ns[1], (unsigned long) bytes[1],
+                set_ns[2], (unsigned long) bytes[2], tuning.bitmap_size_per_node, (tuning.flags & TREE_OPTION_HASH_INDEX)?"+h":"");
+        if (fp_results)
+        {
+            fprintf (fp_results, "{\"bench\":\"tuned\",\"workload\":\"%s\",\"ops\":%u,\"seed\":%llu,\"setbit60_ns\":%.2f,\"bytes60\":%lu,\"setbit4095_ns\":%.2f,"
+                     "\"bytes4095\":%lu,\"tuned_setbit_ns\":%.2f,\"tuned_bytes\":%lu,\"tuned_width\":%u,\"tuned_hash_index\":%d}\n", names[load], count,
+                     seed, set_ns[0], (unsigned long) bytes[0], set_ns[1], (unsigned long) bytes[1], set_ns[2], (unsigned long) bytes[2],
+                     tuning.bitmap_size_per_node, (tuning.flags & TREE_OPTION_HASH_INDEX) != 0);
+        }
+    }
+}
+
+#ifndef _WIN32
+/* BenchSharded - SetBit64 then CheckBit64 over sparse offsets on one tree, against ShardedSetBits/ShardedCheckBits in batches of SHARD_BATCH on
+   a sharded tree (one shard per NUMA node, pinned and bound where there are several). On a single node machine this shows the cost of the
+   hand over to the shard workers; on a multi socket one, the gain from keeping every node in local memory. */
+#define SHARD_BATCH 4096
+
+static void BenchSharded (unsigned long long *offsets, unsigned int count, unsigned long long seed, FILE *fp_results)
+{
+    struct Tree *tree = CreateTree(BENCH_BITS_PER_NODE);
+    struct ShardedTree *sharded = CreateShardedTree(BENCH_BITS_PER_NODE, NULL);
+    unsigned char *results = malloc(SHARD_BATCH);
+    unsigned int found = 0, sharded_found = 0;
+
+    if (!tree || !sharded || !results)
+    {
+        DestroyTree(tree);
+        DestroyShardedTree(sharded);
+        free(results);
+        return;
+    }
+
+    rng_state = seed;
+    for (unsigned int idx=0;idx<count;idx++)
+        offsets[idx] = RandomOffset(BENCH_YEAR_KEY_BITS + 8);
+
+    double start_time = NowSeconds();
+    for (unsigned int idx=0;idx<count;idx++)
+        SetBit64(tree, offsets[idx], 1, NULL);
+    double set_ns = (NowSeconds() - start_time) * 1e9 / count;
+    start_time = NowSeconds();
+    for (unsigned int idx=0;idx<count;idx++)
+        found += CheckBit64(tree, offsets[count - 1 - idx]);
+    double check_ns = (NowSeconds() - start_time) * 1e9 / count;
+
+    start_time = NowSeconds();
+    for (unsigned int first=0;first<count;first+=SHARD_BATCH)
+        ShardedSetBits(sharded, &offsets[first], ((count - first) < SHARD_BATCH)?(count - first):SHARD_BATCH, 1, NULL);
+    double sharded_set_ns = (NowSeconds() - start_time) * 1e9 / count;
+    start_time = NowSeconds();
+    for (unsigned int first=0;first<count;first+=SHARD_BATCH)
+    {
+        unsigned int batch = ((count - first) < SHARD_BATCH)?(count - first):SHARD_BATCH;
+        ShardedCheckBits(sharded, &offsets[first], batch, results);
+        for (unsigned int idx=0;idx<batch;idx++)
+            sharded_found += results[idx];
+    }
+    double sharded_check_ns = (NowSeconds() - start_time) * 1e9 / count;
+
+    if (found != sharded_found)
+        fprintf(stderr, "sharded: found %u bits in shards, %u in one tree!\n", sharded_found, found);
+
+    printf ("\nSharded: %u shards on %u NUMA nodes, SetBit %.1f ns (tree %.1f ns), CheckBit %.1f ns (tree %.1f ns)\n", ShardedTreeShards(sharded),
+            ShardedTreeNumaNodes(sharded), sharded_set_ns, set_ns, sharded_check_ns, check_ns);
+    if (fp_results)
+    {
+        fprintf (fp_results, "{\"bench\":\"sharded\",\"workload\":\"uniform_sparse\",\"ops\":%u,\"seed\":%llu,\"setbit_ns\":%.2f,\"checkbit_ns\":%.2f,"
+                 "\"sharded_setbit_ns\":%.2f,\"sharded_checkbit_ns\":%.2f,\"shards\":%u,\"numa_nodes\":%u}\n", count, seed, set_ns, check_ns,
+                 sharded_set_ns, sharded_check_ns, ShardedTreeShards(sharded), ShardedTreeNumaNodes(sharded));
+    }
+    free(results);
+    DestroyShardedTree(sharded);
+    DestroyTree(tree);
+}
+
+/* BenchSnapshotReaders - CheckBitSnapshot latency on a TREE_OPTION_SNAPSHOTS tree, first with no writer and then while a second thread keeps
+   setting bits (each one publishing a new version). Readers take a fresh snapshot every SNAPSHOT_BATCH probes; the mean and 99th percentile
+   batch latency show whether reads stay flat under writes. */
+#define SNAPSHOT_BATCH 256
+
+typedef struct snapshot_writer {
+    struct Tree        *tree;
+    unsigned long long *offsets;
+    unsigned int        count;
+    atomic_int          stop;
+    unsigned long long  writes;
+} snapshot_writer;
+
+static void *SnapshotWriterThread (void *arg)
+{
+    snapshot_writer *writer = arg;
+    unsigned int idx = 0;
+
+    while (!atomic_load(&writer->stop))
+    {
+        SetBit64(writer->tree, writer->offsets[idx], (unsigned int) (writer->writes & 1), NULL);
+        writer->writes++;
+        idx = (idx + 1 < writer->count)?(idx + 1):0;
+    }
+    return NULL;
+}
+
+static int CompareDouble (const void *a, const void *b)
+{
+    double lhs = *(const double *) a, rhs = *(const double *) b;
+    return (lhs > rhs) - (lhs < rhs);
+}
+
+// Time count probes in batches against snapshots of tree, returning mean ns/probe and the 99th percentile batch in *p99_ns.
+static double TimeSnapshotReads (struct Tree *tree, unsigned long long *offsets, unsigned int count, double *batch_ns, double *p99_ns, unsigned int *found)
+{
+    unsigned int batches = count / SNAPSHOT_BATCH;
+    double total_ns = 0.0;
+
+    for (unsigned int batch=0;batch<batches;batch++)
+    {
+        double start_time = NowSeconds();
+        struct TreeVersion *snapshot = TreeSnapshot(tree);
+        for (unsigned int idx=batch * SNAPSHOT_BATCH;idx<(batch + 1) * SNAPSHOT_BATCH;idx++)
+            *found += CheckBitSnapshot(snapshot, offsets[idx]);
+        ReleaseSnapshot(snapshot);
+        batch_ns[batch] = (NowSeconds() - start_time) * 1e9 / SNAPSHOT_BATCH;
+        total_ns += batch_ns[batch];
+    }
+    qsort(batch_ns, batches, sizeof(double), CompareDouble);
+    *p99_ns = (batches > 0)?batch_ns[(batches * 99) / 100]:0.0;
+    return (batches > 0)?(total_ns / batches):0.0;
+}
+
+static void BenchSnapshotReaders (unsigned long long *offsets, unsigned int count, unsigned long long seed, FILE *fp_results)
+{
+    TreeOptions options;
+    struct Tree *tree;
+    unsigned long long *write_offsets = malloc((size_t) count * sizeof(unsigned long long));
+    double *batch_ns = malloc((count / SNAPSHOT_BATCH + 1) * sizeof(double));
+    unsigned int found = 0;
+    double idle_p99_ns, busy_p99_ns;
+    snapshot_writer writer;
+    pthread_t writer_thread;
+
+    memset(&options, 0, sizeof(options));
+    options.flags = TREE_OPTION_SNAPSHOTS;
+    tree = CreateTreeWithOptions(BENCH_BITS_PER_NODE, &options);
+    if (!tree || !write_offsets || !batch_ns || (count < SNAPSHOT_BATCH))
+    {
+        DestroyTree(tree);
+        free(write_offsets);
+        free(batch_ns);
+        return;
+    }
+
+    rng_state = seed;
+    GenerateUniform(offsets, count);
+    for (unsigned int idx=0;idx<count;idx++)
+        SetBit64(tree, offsets[idx], 1, NULL);
+    memcpy(write_offsets, offsets, (size_t) count * sizeof(unsigned long long));
+
+    double idle_ns = TimeSnapshotReads(tree, offsets, count, batch_ns, &idle_p99_ns, &found);
+
+    writer.tree = tree;
+    writer.offsets = write_offsets;
+    writer.count = count;
+    writer.writes = 0;
+    atomic_init(&writer.stop, 0);
+    if (pthread_create(&writer_thread, NULL, SnapshotWriterThread, &writer) != 0)
+    {
+        fprintf(stderr, "snapshot_readers: cannot start writer thread.\n");
+        DestroyTree(tree);
+        free(write_offsets);
+        free(batch_ns);
+        return;
+    }
+    double busy_ns = TimeSnapshotReads(tree, offsets, count, batch_ns, &busy_p99_ns, &found);
+    atomic_store(&writer.stop, 1);
+    pthread_join(writer_thread, NULL);
+
+    printf ("\nSnapshot CheckBit: %.1f ns (p99 batch %.1f) idle, %.1f ns (p99 batch %.1f) with a writer doing %llu SetBits\n",
+            idle_ns, idle_p99_ns, busy_ns, busy_p99_ns, writer.writes);
+    if (fp_results)
+    {
+        fprintf (fp_results, "{\"bench\":\"snapshot_readers\",\"workload\":\"uniform\",\"ops\":%u,\"seed\":%llu,\"idle_checkbit_ns\":%.2f,"
+                 "\"idle_p99_ns\":%.2f,\"busy_checkbit_ns\":%.2f,\"busy_p99_ns\":%.2f,\"writes\":%llu}\n",
+                 count, seed, idle_ns, idle_p99_ns, busy_ns, busy_p99_ns, writer.writes);
+    }
+    DestroyTree(tree);
+    free(write_offsets);
+    free(batch_ns);
+}
+#endif
+
+/* BenchDateFilter - time DateFilter's parse_timestamp and CheckInsertTSPresent over generated input lines (mostly time ordered,
+   1 in 8 repeated, some with a time offset) spread across a few years. With fraction_digits the lines carry milliseconds and are
+   deduplicated at that resolution, starting at first_year so they do not share year trees with an earlier run. Output file writes are
+   not included. */
+static void BenchDateFilter (unsigned int count, unsigned long long seed, unsigned int fraction_digits, int first_year, FILE *fp_results)
+{
+    char (*lines)[32] = malloc((size_t) count * sizeof(*lines));
+    unsigned int duplicates = 0;
+    int year, month, day, hour, minute, second, microsecond, tz_adjusted;
+    char fraction[5] = "";
+
+    if (!lines)
+        return;
+
+    rng_state = seed;
+    unsigned long long seconds = 0;
+    for (unsigned int idx=0;idx<count;idx++)
+    {
+        if ((idx > 0) && ((NextRandom() % 8) == 0))
+        {
+            memcpy(lines[idx], lines[NextRandom() % idx], sizeof(lines[idx]));
+            continue;
+        }
+        seconds += NextRandom() % 4;
+        unsigned long long minutes = seconds / 60;
+        unsigned long long hours = minutes / 60;
+        unsigned long long days = hours / 24;
+        // Every field is kept within its printed width, so a line always fits (and the compiler can tell).
+        unsigned int line_year = (unsigned int) (first_year + (int) (days / 372)) % 10000;
+        unsigned int line_month = 1 + (unsigned int) ((days / 31) % 12);
+        unsigned int line_day = 1 + (unsigned int) (days % 31);
+
+        if (fraction_digits > 0)
+            snprintf(fraction, sizeof(fraction), ".%03u", (unsigned int) (NextRandom() % 1000));
+
+        if ((NextRandom() % 4) == 0)
+            snprintf(lines[idx], sizeof(lines[idx]), "%04u-%02u-%02uT%02u:%02u:%02u%s+01:00", line_year, line_month, line_day,
+                     (unsigned int) (hours % 24), (unsigned int) (minutes % 60), (unsigned int) (seconds % 60), fraction);
+        else
+            snprintf(lines[idx], sizeof(lines[idx]), "%04u-%02u-%02uT%02u:%02u:%02u%sZ", line_year, line_month, line_day,
+                     (unsigned int) (hours % 24), (unsigned int) (minutes % 60), (unsigned int) (seconds % 60), fraction);
+    }
+
+    SetFractionDigits(fraction_digits);
+    double start_time = NowSeconds();
+    for (unsigned int idx=0;idx<count;idx++)
+    {
+        if (!parse_timestamp(lines[idx], strlen(lines[idx]), &year, &month, &day, &hour, &minute, &second, &microsecond, &tz_adjusted))
+            duplicates += CheckInsertTSPresent(year, month, day, hour, minute, second, microsecond);
+    }
+    double run_time = NowSeconds() - start_time;
+    double lines_per_sec = (run_time > 0)?(count / run_time):0.0;
+
+    printf ("\nDateFilter%s: %u lines in %f s => %.0f lines/sec (%u duplicates)\n", (fraction_digits > 0)?" (ms)":"", count, run_time, lines_per_sec, duplicates);
+    if (fp_results)
+    {
+        fprintf (fp_results, "{\"bench\":\"datefilter\",\"workload\":\"%s\",\"lines\":%u,\"seed\":%llu,\"seconds\":%.6f,\"lines_per_sec\":%.0f,\"duplicates\":%u}\n",
+                 (fraction_digits > 0)?"synthetic_log_ms":"synthetic_log", count, seed, run_time, lines_per_sec, duplicates);
+    }
+    free(lines);
+}
+
+int main (int argc, char **argv)
+{
+    unsigned int ops = 1000000;
+    unsigned long long seed = 0x5eed;
+    const char *only_workload = NULL;
+    char results_filename[300] = "bench_output.txt";
+
+    for (int i = 1;i < argc; i++) {
+        if (argv[i][0] != '-')
+            continue;
+        if (argv[i][1] == 'n')
+            ops = (unsigned int) strtoul(&argv[i][2], NULL, 10);
+        else if (argv[i][1] == 's')
+            seed = strtoull(&argv[i][2], NULL, 0);
+        else if (argv[i][1] == 'w')
+            only_workload = &argv[i][2];
+        else if (argv[i][1] == 'o')
+            snprintf(results_filename, sizeof(results_filename), "%s", &argv[i][2]);
+    }
+
+    if ((ops == 0) || (seed == 0))
+    {
+        fprintf(stderr, "Usage: TreeSetBench [-n<ops>] [-s<non zero seed>] [-w<workload>] [-o<results file>]\n");
+        return 1;
+    }
+
+    unsigned long long *offsets = malloc((size_t) ops * sizeof(unsigned long long));
+    FILE *fp_results = fopen(results_filename, "a");
+    if (!offsets)
+    {
+        fprintf(stderr, "Cannot allocate %u offsets.\n", ops);
+        return 1;
+    }
+    if (!fp_results)
+        fprintf(stderr, "Results file %s cannot be opened, printing only.\n", results_filename);
+
+    printf ("TreeSetBench: %u ops per workload, seed %llu, %d bits per node.\n\n", ops, seed, BENCH_BITS_PER_NODE);
+    printf ("%-18s %10s %10s %14s %10s %10s %12s %6s %10s %10s\n", "workload", "SetBit ns", "CheckBit ns", "FindOrInsert ns", "nodes", "bits set", "bytes/bit", "depth",
+            "Set60 ns", "Check60 ns");
+    for (unsigned int idx=0;idx<WORKLOAD_COUNT;idx++)
+    {
+        if (!only_workload || (strcmp(only_workload, workloads[idx].name) == 0))
+            BenchTreeWorkload(&workloads[idx], offsets, ops, seed, fp_results);
+    }
+    if (!only_workload || (strcmp(only_workload, "negative_lookups") == 0))
+        BenchNegativeLookups(offsets, ops, seed, fp_results);
+    if (!only_workload || (strcmp(only_workload, "interleaved") == 0))
+        BenchInterleaved(offsets, ops, seed, fp_results);
+    if (!only_workload || (strcmp(only_workload, "spill") == 0))
+        BenchSpill(offsets, ops, seed, fp_results);
+    if (!only_workload || (strcmp(only_workload, "freeze") == 0))
+        BenchFreeze(offsets, ops, seed, fp_results);
+    if (!only_workload || (strcmp(only_workload, "compact") == 0))
+        BenchCompact(offsets, ops, seed, fp_results);
+    if (!only_workload || (strcmp(only_workload, "hash_index") == 0))
+        BenchHashIndex(offsets, ops, seed, fp_results);
+    if (!only_workload || (strcmp(only_workload, "trace") == 0))
+        BenchTrace(offsets, ops, seed, fp_results);
+    if (!only_workload || (strcmp(only_workload, "range") == 0))
+        BenchRange(ops, seed, fp_results);
+    if (!only_workload || (strcmp(only_workload, "tuned") == 0))
+        BenchTuned(offsets, ops, seed, fp_results);
+#ifndef _WIN32
+    if (!only_workload || (strcmp(only_workload, "snapshot_readers") == 0))
+        BenchSnapshotReaders(offsets, ops, seed, fp_results);
+    if (!only_workload || (strcmp(only_workload, "sharded") == 0))
+        BenchSharded(offsets, ops, seed, fp_results);
+#endif
+    if (!only_workload || (strcmp(only_workload, "datefilter") == 0))
+        BenchDateFilter(ops, seed, 0, 2000, fp_results);
+    if (!only_workload || (strcmp(only_workload, "datefilter_ms") == 0))
+        BenchDateFilter(ops, seed, 3, 5000, fp_results);
+
+    free(offsets);
+    if (fp_results)
+        fclose(fp_results);
+    return 0;
+}
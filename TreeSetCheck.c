@@ -0,0 +1,891 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "TreeSet.h"
+#include "TreeSetFixed.h"
+#ifndef _WIN32
+#include <pthread.h>
+#include "TreeShards.h"
+#endif
+
+/* TreeSetCheck - drives every tree option over a range of bitmap_size_per_node values with a reproducible random mix of SetBit64,
+   SetBitsInterleaved, SetRange, IncrementBit and SpillTree calls, and compares each answer (and finally every offset of the range) with a
+   plain array of counts, and TreeSet60 call for call with CreateTree(60). Trees bulk loaded by BuildTreeFromSorted(Bits) are checked the same
+   way, as are the ordered access patterns the finger serves and frozen trees (FrozenCheckBit, FrozenForEachSetBit) and the trees thawed
+   from them. Trees compacted by CompactTree and sharded trees (TreeShards) are compared with a plain tree, and TuneTree choices with the
+   nodes each width needs for the sample. Run by ctest; build with -fsanitize=address to also catch nodes used after a spill, snapshot or
+   compaction freed them.
+
+   Usage: TreeSetCheck [-s<seed>] */
+
+#define CHECK_RANGE        (1u << 14) // offsets checked, 0..CHECK_RANGE-1
+#define CHECK_OPS          3000       // random operations per tree
+#define CHECK_BATCH        40         // offsets per SetBitsInterleaved call, more than one interleaved group
+#define CHECK_MAX_FAILURES 20         // mismatches printed before the rest are only counted
+
+typedef struct check_config {
+    const char  *name;
+    unsigned int flags;
+    size_t       memory_budget;
+    unsigned int counter_bits;
+} check_config;
+
+static const check_config configs[] = {
+    {"plain",          0,                                          0,    0},
+    {"bloom",          TREE_OPTION_BLOOM_FILTER,                   0,    0},
+    {"hash_index",     TREE_OPTION_HASH_INDEX,                     0,    0},
+    {"spill",          TREE_OPTION_SPILL,                          0,    0},
+    {"spill_budget",   TREE_OPTION_SPILL,                          8192, 0},
+    {"snapshots",      TREE_OPTION_SNAPSHOTS,                      0,    0},
+    {"counters4",      TREE_OPTION_COUNTERS,                       0,    4},
+    {"counters8_hash", TREE_OPTION_COUNTERS | TREE_OPTION_HASH_INDEX, 0, 8},
+    {"counters_spill", TREE_OPTION_COUNTERS | TREE_OPTION_SPILL,   8192, 4},
+};
+#define CONFIG_COUNT (sizeof(configs) / sizeof(configs[0]))
+
+static const unsigned int widths[] = {1, 7, 8, 60, 64, 200};
+#define WIDTH_COUNT (sizeof(widths) / sizeof(widths[0]))
+
+/* Utilities*/
+
+static unsigned long long rng_state = 0;
+
+// xorshift64*, as in TreeSetBench, so a failing seed reproduces on every platform.
+static unsigned long long NextRandom (void)
+{
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return rng_state * 2685821657736338717ULL;
+}
+
+static unsigned char reference[CHECK_RANGE]; // count per offset (0 or 1 on bit trees)
+static unsigned int check_width, check_idx_size, check_count_max;
+static unsigned long failures = 0;
+
+static void Mismatch (const check_config *config, const char *what, unsigned long long first, unsigned long long last, unsigned int got,
+                      unsigned int expected)
+{
+    if (failures++ < CHECK_MAX_FAILURES)
+        printf ("%s, %u bits per node: %s %llu..%llu gave %u, expected %u\n", config->name, check_width, what, first, last, got, expected);
+}
+
+// Offsets whose sub bit offset is past the node's bitmap are not part of the set.
+static int Addressable (unsigned long long offset)
+{
+    return (offset & ((1ULL << check_idx_size) - 1)) < check_width;
+}
+
+static unsigned int CountBits (unsigned int value)
+{
+    unsigned int bits = 0;
+    for (;value;value >>= 1)
+        bits++;
+    return bits;
+}
+
+static void ReferenceSet (unsigned long long offset, unsigned int value)
+{
+    if (!Addressable(offset))
+        return;
+    if (!value)
+        reference[offset] = 0;
+    else if (reference[offset] == 0)
+        reference[offset] = 1;
+}
+
+/* CheckWholeRange - every offset of the range of tree against the reference. */
+static void CheckWholeRange (const check_config *config, struct Tree *tree)
+{
+    for (unsigned long long offset=0;offset<CHECK_RANGE;offset++)
+    {
+        unsigned int expected = (Addressable(offset))?reference[offset]:0;
+        unsigned int got;
+
+        if ((config->flags & TREE_OPTION_COUNTERS) && ((got = GetCount(tree, offset)) != expected))
+            Mismatch(config, "GetCount", offset, offset, got, expected);
+        if ((got = CheckBit64(tree, offset)) != (expected != 0))
+            Mismatch(config, "CheckBit64", offset, offset, got, expected != 0);
+    }
+}
+
+/* SetCheckedBit - SetBit64 on a bit tree, its already_set checked and the change applied to the reference. */
+static void SetCheckedBit (const check_config *config, struct Tree *tree, unsigned long long offset, unsigned int value)
+{
+    unsigned int already_set;
+
+    SetBit64(tree, offset, value, &already_set);
+    if (already_set != (value && Addressable(offset) && (reference[offset] != 0)))
+        Mismatch(config, "SetBit64 already_set", offset, offset, already_set, !already_set);
+    ReferenceSet(offset, value);
+}
+
+/* SetRandomBits - count SetCheckedBit calls (two sets to one clear) at random offsets. */
+static void SetRandomBits (const check_config *config, struct Tree *tree, unsigned int count)
+{
+    for (unsigned int op=0;op<count;op++)
+    {
+        unsigned long long offset = NextRandom() % CHECK_RANGE;
+        SetCheckedBit(config, tree, offset, (unsigned int) ((NextRandom() % 3) != 0));
+    }
+}
+
+/* CheckTree - one tree with the given option set and width against the reference. */
+static void CheckTree (const check_config *config, unsigned int width)
+{
+    TreeOptions options;
+    struct Tree *tree;
+    unsigned long long batch[CHECK_BATCH];
+    unsigned char batch_set[CHECK_BATCH];
+
+    memset(&options, 0, sizeof(options));
+    options.flags = config->flags;
+    options.memory_budget = config->memory_budget;
+    options.counter_bits = config->counter_bits;
+    options.expected_nodes = CHECK_RANGE / width;
+    tree = CreateTreeWithOptions(width, &options);
+    if (!tree)
+    {
+        Mismatch(config, "CreateTreeWithOptions", 0, 0, 0, 1);
+        return;
+    }
+
+    check_width = width;
+    check_idx_size = CountBits(width);
+    check_count_max = (config->flags & TREE_OPTION_COUNTERS)?((1u << ((config->counter_bits)?config->counter_bits:8)) - 1):1;
+    memset(reference, 0, sizeof(reference));
+
+    for (unsigned int op=0;op<CHECK_OPS;op++)
+    {
+        unsigned long long first = NextRandom() % CHECK_RANGE;
+        unsigned long long last = first + (((NextRandom() % 4) != 0)?(NextRandom() % 200):(NextRandom() % 3000));
+        unsigned int value = (unsigned int) ((NextRandom() % 3) != 0);
+        unsigned int already_set, got, any = 0, all = 1, addressable = 0;
+
+        if (last >= CHECK_RANGE)
+            last = CHECK_RANGE - 1;
+        switch (NextRandom() % 7)
+        {
+        case 0:
+            SetBit64(tree, first, value, &already_set);
+            if (already_set != (value && Addressable(first) && (reference[first] != 0)))
+                Mismatch(config, "SetBit64 already_set", first, first, already_set, !already_set);
+            ReferenceSet(first, value);
+            break;
+        case 1:
+            for (unsigned int idx=0;idx<CHECK_BATCH;idx++)
+                batch[idx] = (first + (NextRandom() % 2000)) % CHECK_RANGE;
+            SetBitsInterleaved(tree, batch, CHECK_BATCH, value, batch_set);
+            for (unsigned int idx=0;idx<CHECK_BATCH;idx++)
+            {
+                unsigned int expected = (value && Addressable(batch[idx]) && (reference[batch[idx]] != 0));
+                if (batch_set[idx] != expected)
+                    Mismatch(config, "SetBitsInterleaved already_set", batch[idx], batch[idx], batch_set[idx], expected);
+                ReferenceSet(batch[idx], value);
+            }
+            break;
+        case 2:
+            SetRange(tree, first, last, value);
+            for (unsigned long long offset=first;offset<=last;offset++)
+                ReferenceSet(offset, value);
+            break;
+        case 3:
+            for (unsigned long long offset=first;offset<=last;offset++)
+            {
+                if (!Addressable(offset))
+                    continue;
+                addressable++;
+                any |= (reference[offset] != 0);
+                all &= (reference[offset] != 0);
+            }
+            if (!addressable)
+                all = 0;
+            if ((got = TestRangeAny(tree, first, last)) != any)
+                Mismatch(config, "TestRangeAny", first, last, got, any);
+            if ((got = TestRangeAll(tree, first, last)) != all)
+                Mismatch(config, "TestRangeAll", first, last, got, all);
+            break;
+        case 4:
+            if ((got = CheckBit64(tree, first)) != (Addressable(first) && (reference[first] != 0)))
+                Mismatch(config, "CheckBit64", first, first, got, !got);
+            break;
+        case 5:
+            if (config->flags & TREE_OPTION_COUNTERS)
+            {
+                unsigned int expected = (Addressable(first))?reference[first]:0;
+                if ((got = IncrementBit(tree, first)) != expected)
+                    Mismatch(config, "IncrementBit", first, first, got, expected);
+                if (Addressable(first) && (reference[first] < check_count_max))
+                    reference[first]++;
+            }
+            break;
+        case 6:
+            if ((config->flags & TREE_OPTION_SPILL) && ((NextRandom() % 8) == 0))
+                SpillTree(tree, 50);
+            break;
+        }
+    }
+
+    CheckWholeRange(config, tree);
+
+    if (config->flags & TREE_OPTION_SNAPSHOTS)
+    {
+        struct TreeVersion *snapshot = TreeSnapshot(tree);
+        for (unsigned long long offset=0;offset<CHECK_RANGE;offset++)
+        {
+            unsigned int expected = (Addressable(offset) && (reference[offset] != 0));
+            unsigned int got = CheckBitSnapshot(snapshot, offset);
+            if (got != expected)
+                Mismatch(config, "CheckBitSnapshot", offset, offset, got, expected);
+        }
+        ReleaseSnapshot(snapshot);
+    }
+    DestroyTree(tree);
+}
+
+static int CompareOffset (const void *a, const void *b)
+{
+    unsigned long long offset_a = *(const unsigned long long *) a;
+    unsigned long long offset_b = *(const unsigned long long *) b;
+    return (offset_a < offset_b)?-1:(offset_a > offset_b);
+}
+
+/* CheckBulkLoad - BuildTreeFromSortedBits from sorted random offsets (with repeats and unaddressable sub bits), and BuildTreeFromSorted from
+   the keys and bitmaps of the reference, each against the reference before and after more SetBit64 calls on the built tree. Input out of
+   order must be refused. */
+static void CheckBulkLoad (unsigned int width)
+{
+    static const check_config config = {"bulk_load", 0, 0, 0};
+    static unsigned long long offsets[CHECK_OPS];
+    static unsigned long long keys[CHECK_RANGE];
+    static unsigned char payloads[CHECK_RANGE * 8];
+    unsigned int bytes_per_node = (width + 7) / 8;
+    unsigned int key_count = 0;
+    struct Tree *tree;
+
+    check_width = width;
+    check_idx_size = CountBits(width);
+    memset(reference, 0, sizeof(reference));
+    for (unsigned int idx=0;idx<CHECK_OPS;idx++)
+        offsets[idx] = ((idx > 0) && ((NextRandom() % 8) == 0))?offsets[idx-1]:(NextRandom() % CHECK_RANGE);
+    qsort(offsets, CHECK_OPS, sizeof(offsets[0]), CompareOffset);
+    for (unsigned int idx=0;idx<CHECK_OPS;idx++)
+        ReferenceSet(offsets[idx], 1);
+
+    if (!(tree = BuildTreeFromSortedBits(offsets, CHECK_OPS, width)))
+        Mismatch(&config, "BuildTreeFromSortedBits", offsets[0], offsets[CHECK_OPS-1], 0, 1);
+    else
+    {
+        CheckWholeRange(&config, tree);
+        SetRandomBits(&config, tree, CHECK_OPS);
+        CheckWholeRange(&config, tree);
+        DestroyTree(tree);
+    }
+
+    // The reference after those SetBit64 calls, as keys and bitmaps.
+    memset(payloads, 0, sizeof(payloads));
+    for (unsigned long long offset=0;offset<CHECK_RANGE;offset++)
+    {
+        unsigned long long key = offset >> check_idx_size;
+        unsigned int sub_bit = (unsigned int) (offset & ((1ULL << check_idx_size) - 1));
+
+        if (!reference[offset])
+            continue;
+        if ((key_count == 0) || (keys[key_count-1] != key))
+            keys[key_count++] = key;
+        payloads[(size_t) (key_count-1) * bytes_per_node + sub_bit / 8] |= (unsigned char) (1u << (sub_bit % 8));
+    }
+    if (!(tree = BuildTreeFromSorted(keys, payloads, key_count, width)))
+        Mismatch(&config, "BuildTreeFromSorted", 0, key_count, 0, 1);
+    else
+    {
+        CheckWholeRange(&config, tree);
+        SetRandomBits(&config, tree, CHECK_OPS);
+        CheckWholeRange(&config, tree);
+        DestroyTree(tree);
+    }
+
+    // Out of order (both print why they refuse).
+    if (key_count > 1)
+    {
+        unsigned long long unsorted[2] = {keys[1], keys[0]};
+        if ((tree = BuildTreeFromSorted(unsorted, NULL, 2, width)) != NULL)
+            Mismatch(&config, "BuildTreeFromSorted out of order", unsorted[0], unsorted[1], 1, 0);
+        DestroyTree(tree);
+        if ((tree = BuildTreeFromSortedBits(unsorted, 2, width)) != NULL)
+            Mismatch(&config, "BuildTreeFromSortedBits out of order", unsorted[0], unsorted[1], 1, 0);
+        DestroyTree(tree);
+    }
+}
+
+/* CheckFinger - the access patterns the finger (the last node found or inserted) serves without a descent: ascending and descending runs,
+   each offset checked again right after its neighbours, and ascending with jitter of a few nodes either way, mixed with random offsets that
+   move the finger away. With TESTSET_PROFILE the runs must also be seen to hit the finger. */
+static void CheckFinger (const check_config *config, unsigned int width)
+{
+    TreeOptions options;
+    struct Tree *tree;
+    unsigned long long offset;
+
+    memset(&options, 0, sizeof(options));
+    options.flags = config->flags;
+    options.expected_nodes = CHECK_RANGE / width;
+    if (!(tree = CreateTreeWithOptions(width, &options)))
+    {
+        Mismatch(config, "CreateTreeWithOptions", 0, 0, 0, 1);
+        return;
+    }
+    check_width = width;
+    check_idx_size = CountBits(width);
+    memset(reference, 0, sizeof(reference));
+
+    for (offset=NextRandom() % 64;offset<CHECK_RANGE / 2;offset+=1 + (NextRandom() % 3))
+    {
+        SetCheckedBit(config, tree, offset, (unsigned int) ((NextRandom() % 8) != 0));
+        if (offset >= 2 * width)
+        {
+            unsigned long long behind = offset - (NextRandom() % (2 * width));
+            unsigned int got = CheckBit64(tree, behind);
+            if (got != (Addressable(behind) && (reference[behind] != 0)))
+                Mismatch(config, "CheckBit64 behind the finger", behind, offset, got, !got);
+        }
+    }
+    for (offset=CHECK_RANGE-1;offset>=CHECK_RANGE / 2;offset-=1 + (NextRandom() % 3))
+        SetCheckedBit(config, tree, offset, (unsigned int) ((NextRandom() % 8) != 0));
+    CheckWholeRange(config, tree);
+
+    for (unsigned int op=0;op<CHECK_OPS;op++)
+    {
+        unsigned long long jittered = (op * (unsigned long long) CHECK_RANGE) / CHECK_OPS + (NextRandom() % (4 * width));
+        if (jittered >= 2 * width)
+            jittered -= 2 * width;
+        if (jittered >= CHECK_RANGE)
+            jittered = CHECK_RANGE - 1;
+        SetCheckedBit(config, tree, ((NextRandom() % 16) == 0)?(NextRandom() % CHECK_RANGE):jittered, (unsigned int) ((NextRandom() % 3) != 0));
+    }
+    CheckWholeRange(config, tree);
+
+#ifdef TESTSET_PROFILE
+    TreeStats stats;
+    GetTreeStats(tree, &stats);
+    if (stats.finger_hits == 0)
+        Mismatch(config, "finger hits", 0, CHECK_RANGE - 1, 0, 1);
+#endif
+    DestroyTree(tree);
+}
+
+typedef struct frozen_visit {
+    const check_config *config;
+    unsigned long long  first, last, previous;
+    unsigned long long  visited, stop_after;
+} frozen_visit;
+
+static int CheckFrozenVisit (void *context, unsigned long long offset)
+{
+    frozen_visit *visit = context;
+
+    if ((offset < visit->first) || (offset > visit->last) || ((visit->visited > 0) && (offset <= visit->previous)) || !Addressable(offset) ||
+        (reference[offset] == 0))
+        Mismatch(visit->config, "FrozenForEachSetBit visited", visit->first, visit->last, (unsigned int) offset, (unsigned int) visit->previous);
+    visit->previous = offset;
+    return (++visit->visited == visit->stop_after);
+}
+
+/* CheckFreeze - FreezeTree of a tree with the given option set against the tree and the reference: FrozenCheckBit on every offset (after the
+   tree is destroyed), FrozenForEachSetBit over random ranges (some stopped early by the visitor), and ThawTree into the same options, compared
+   with the tree and then written further. A tree with spilled nodes must be refused. */
+static void CheckFreeze (const check_config *config, unsigned int width)
+{
+    TreeOptions options;
+    struct Tree *tree, *thawed;
+    struct FrozenTree *frozen;
+
+    memset(&options, 0, sizeof(options));
+    options.flags = config->flags;
+    options.memory_budget = config->memory_budget;
+    options.counter_bits = config->counter_bits;
+    options.expected_nodes = CHECK_RANGE / width;
+    if (!(tree = CreateTreeWithOptions(width, &options)))
+    {
+        Mismatch(config, "CreateTreeWithOptions", 0, 0, 0, 1);
+        return;
+    }
+    check_width = width;
+    check_idx_size = CountBits(width);
+    check_count_max = (config->flags & TREE_OPTION_COUNTERS)?((1u << ((config->counter_bits)?config->counter_bits:8)) - 1):1;
+    memset(reference, 0, sizeof(reference));
+
+    SetRandomBits(config, tree, CHECK_OPS);
+    for (unsigned int op=0;(config->flags & TREE_OPTION_COUNTERS) && (op<CHECK_OPS);op++)
+    {
+        unsigned long long offset = NextRandom() % CHECK_RANGE;
+        IncrementBit(tree, offset);
+        if (Addressable(offset) && (reference[offset] < check_count_max))
+            reference[offset]++;
+    }
+    if (config->flags & TREE_OPTION_SPILL)
+    {
+        SpillTree(tree, 50);
+        if (TreeSpillRuns(tree) > 0)
+        {
+            if ((frozen = FreezeTree(tree)) != NULL)
+                Mismatch(config, "FreezeTree of a spilled tree", 0, CHECK_RANGE - 1, 1, 0);
+            DestroyFrozenTree(frozen);
+            DestroyTree(tree);
+            return;
+        }
+    }
+
+    if (!(frozen = FreezeTree(tree)) || !(thawed = ThawTree(frozen, &options)))
+    {
+        Mismatch(config, "FreezeTree/ThawTree", 0, CHECK_RANGE - 1, 0, 1);
+        DestroyFrozenTree(frozen);
+        DestroyTree(tree);
+        return;
+    }
+    for (unsigned long long offset=0;offset<CHECK_RANGE;offset++)
+    {
+        unsigned int got, expected;
+        if ((config->flags & TREE_OPTION_COUNTERS) && ((got = GetCount(thawed, offset)) != (expected = GetCount(tree, offset))))
+            Mismatch(config, "GetCount thawed against the tree", offset, offset, got, expected);
+        if ((got = CheckBit64(thawed, offset)) != (expected = CheckBit64(tree, offset)))
+            Mismatch(config, "CheckBit64 thawed against the tree", offset, offset, got, expected);
+    }
+    DestroyTree(tree);
+
+    for (unsigned long long offset=0;offset<CHECK_RANGE;offset++)
+    {
+        unsigned int got = FrozenCheckBit(frozen, offset);
+        if (got != (Addressable(offset) && (reference[offset] != 0)))
+            Mismatch(config, "FrozenCheckBit", offset, offset, got, !got);
+    }
+    for (unsigned int range=0;range<20;range++)
+    {
+        frozen_visit visit = {config, NextRandom() % CHECK_RANGE, 0, 0, 0, 0};
+        unsigned long long expected = 0, got;
+
+        visit.last = visit.first + (NextRandom() % 3000);
+        if (visit.last >= CHECK_RANGE)
+            visit.last = CHECK_RANGE - 1;
+        for (unsigned long long offset=visit.first;offset<=visit.last;offset++)
+            expected += (Addressable(offset) && (reference[offset] != 0));
+        if ((range % 4) == 3)
+        {
+            visit.stop_after = 1 + (NextRandom() % 5);
+            if (expected > visit.stop_after)
+                expected = visit.stop_after;
+        }
+        if (((got = FrozenForEachSetBit(frozen, visit.first, visit.last, CheckFrozenVisit, &visit)) != expected) || (visit.visited != expected))
+            Mismatch(config, "FrozenForEachSetBit count", visit.first, visit.last, (unsigned int) got, (unsigned int) expected);
+    }
+    DestroyFrozenTree(frozen);
+
+    CheckWholeRange(config, thawed);
+    SetRandomBits(config, thawed, CHECK_OPS);
+    CheckWholeRange(config, thawed);
+    DestroyTree(thawed);
+}
+
+/* CheckCompact - a tree with the given option set compacted (CompactTree) between rounds of random writes, against a plain tree given the same
+   writes and the reference. After each compaction the tree must be as shallow as a perfectly balanced one, and later writes (new nodes outside
+   the compacted block, spills) must keep it equal to the plain tree. Snapshot trees are left as they are. */
+static void CheckCompact (const check_config *config, unsigned int width)
+{
+    TreeOptions options;
+    struct Tree *tree, *plain;
+
+    memset(&options, 0, sizeof(options));
+    options.flags = config->flags;
+    options.memory_budget = config->memory_budget;
+    options.counter_bits = config->counter_bits;
+    options.expected_nodes = CHECK_RANGE / width;
+    tree = CreateTreeWithOptions(width, &options);
+    plain = CreateTree(width);
+    if (!tree || !plain)
+    {
+        Mismatch(config, "CreateTreeWithOptions", 0, 0, 0, 1);
+        DestroyTree(tree);
+        DestroyTree(plain);
+        return;
+    }
+    check_width = width;
+    check_idx_size = CountBits(width);
+    memset(reference, 0, sizeof(reference));
+
+    for (unsigned int round=0;round<3;round++)
+    {
+        unsigned int count, got, expected;
+
+        for (unsigned int op=0;op<CHECK_OPS / 3;op++)
+        {
+            unsigned long long offset = NextRandom() % CHECK_RANGE;
+            unsigned int value = (unsigned int) ((NextRandom() % 3) != 0);
+
+            SetCheckedBit(config, tree, offset, value);
+            SetBit64(plain, offset, value, NULL);
+        }
+        if ((config->flags & TREE_OPTION_SPILL) && (round == 1))
+            SpillTree(tree, 50);
+
+        count = CompactTree(tree);
+        if (config->flags & TREE_OPTION_SNAPSHOTS)
+        {
+            if (count != 0)
+                Mismatch(config, "CompactTree of a snapshot tree", 0, CHECK_RANGE - 1, count, 0);
+        }
+        else if (count == 0)
+            Mismatch(config, "CompactTree", 0, CHECK_RANGE - 1, 0, 1);
+        else if (((got = TreeDepth(tree)) > (expected = CountBits(count))) || (CompactTree(tree) != count))
+            Mismatch(config, "TreeDepth after CompactTree", 0, CHECK_RANGE - 1, got, expected);
+
+        for (unsigned long long offset=0;offset<CHECK_RANGE;offset++)
+        {
+            if ((got = CheckBit64(tree, offset)) != (expected = CheckBit64(plain, offset)))
+                Mismatch(config, "CheckBit64 compacted against the plain tree", offset, offset, got, expected);
+        }
+        CheckWholeRange(config, tree);
+    }
+    DestroyTree(tree);
+    DestroyTree(plain);
+}
+
+#ifndef _WIN32
+#define SHARD_THREADS 3 // threads submitting batches to one sharded tree at once
+
+typedef struct shard_batch {
+    struct ShardedTree *sharded;
+    unsigned long long  offsets[CHECK_OPS];
+    unsigned char       already_set[CHECK_OPS];
+    unsigned int        count;
+    int                 done;
+} shard_batch;
+
+static void *SubmitShardBatch (void *context)
+{
+    shard_batch *batch = context;
+    batch->done = ShardedSetBits(batch->sharded, batch->offsets, batch->count, 1, batch->already_set);
+    return NULL;
+}
+
+/* CheckSharded - a sharded tree (shards on keys ranges of two nodes, so every batch spreads over all of them) against a plain tree given the
+   same calls and the reference: batches of ShardedSetBits with repeated offsets, then batches from several threads at once (each on its own
+   offsets, so the plain tree can replay them in any order), and finally ShardedCheckBits over the whole range. */
+static void CheckSharded (const check_config *config, unsigned int width)
+{
+    static shard_batch batches[SHARD_THREADS];
+    static unsigned char results[CHECK_OPS];
+    ShardedTreeOptions options;
+    struct ShardedTree *sharded;
+    struct Tree *plain;
+    pthread_t threads[SHARD_THREADS];
+    int created[SHARD_THREADS];
+
+    memset(&options, 0, sizeof(options));
+    options.shards_per_node = 3;
+    options.range_bits = 1;
+    options.tree_options.flags = config->flags;
+    options.tree_options.counter_bits = config->counter_bits;
+    options.tree_options.expected_nodes = CHECK_RANGE / width;
+    sharded = CreateShardedTree(width, &options);
+    plain = CreateTree(width);
+    if (!sharded || !plain)
+    {
+        Mismatch(config, "CreateShardedTree", 0, 0, 0, 1);
+        DestroyShardedTree(sharded);
+        DestroyTree(plain);
+        return;
+    }
+    check_width = width;
+    check_idx_size = CountBits(width);
+    memset(reference, 0, sizeof(reference));
+
+    for (unsigned int round=0;round<4;round++)
+    {
+        shard_batch *batch = &batches[0];
+        unsigned int value = (round != 2);
+
+        batch->count = CHECK_OPS;
+        for (unsigned int idx=0;idx<batch->count;idx++)
+            batch->offsets[idx] = ((idx > 0) && ((NextRandom() % 8) == 0))?batch->offsets[NextRandom() % idx]:(NextRandom() % CHECK_RANGE);
+        if (!ShardedSetBits(sharded, batch->offsets, batch->count, value, batch->already_set))
+            Mismatch(config, "ShardedSetBits", 0, CHECK_RANGE - 1, 0, 1);
+        for (unsigned int idx=0;idx<batch->count;idx++)
+        {
+            unsigned int expected;
+            SetBit64(plain, batch->offsets[idx], value, &expected);
+            if (batch->already_set[idx] != expected)
+                Mismatch(config, "ShardedSetBits already_set", batch->offsets[idx], batch->offsets[idx], batch->already_set[idx], expected);
+            ReferenceSet(batch->offsets[idx], value);
+        }
+    }
+
+    for (unsigned int thread=0;thread<SHARD_THREADS;thread++)
+    {
+        batches[thread].sharded = sharded;
+        batches[thread].count = CHECK_OPS;
+        batches[thread].done = 0;
+        for (unsigned int idx=0;idx<CHECK_OPS;idx++)
+            batches[thread].offsets[idx] = (NextRandom() % (CHECK_RANGE / SHARD_THREADS)) * SHARD_THREADS + thread;
+        created[thread] = (pthread_create(&threads[thread], NULL, SubmitShardBatch, &batches[thread]) == 0);
+        if (!created[thread])
+            SubmitShardBatch(&batches[thread]);
+    }
+    for (unsigned int thread=0;thread<SHARD_THREADS;thread++)
+    {
+        if (created[thread])
+            pthread_join(threads[thread], NULL);
+        if (!batches[thread].done)
+            Mismatch(config, "ShardedSetBits from a thread", thread, thread, 0, 1);
+        for (unsigned int idx=0;idx<CHECK_OPS;idx++)
+        {
+            unsigned long long offset = batches[thread].offsets[idx];
+            unsigned int expected;
+            SetBit64(plain, offset, 1, &expected);
+            if (batches[thread].already_set[idx] != expected)
+                Mismatch(config, "ShardedSetBits already_set from a thread", offset, offset, batches[thread].already_set[idx], expected);
+            ReferenceSet(offset, 1);
+        }
+    }
+
+    for (unsigned long long first=0;first<CHECK_RANGE;first+=CHECK_OPS)
+    {
+        unsigned int count = (first + CHECK_OPS <= CHECK_RANGE)?CHECK_OPS:(unsigned int) (CHECK_RANGE - first);
+        for (unsigned int idx=0;idx<count;idx++)
+            batches[0].offsets[idx] = first + ((idx * 7919ULL) % count); // every offset of the slice once, out of order
+        if (!ShardedCheckBits(sharded, batches[0].offsets, count, results))
+            Mismatch(config, "ShardedCheckBits", first, first + count - 1, 0, 1);
+        for (unsigned int idx=0;idx<count;idx++)
+        {
+            unsigned long long offset = batches[0].offsets[idx];
+            unsigned int expected = CheckBit64(plain, offset);
+            if ((results[idx] != expected) || (expected != (Addressable(offset) && (reference[offset] != 0))))
+                Mismatch(config, "ShardedCheckBits against the plain tree", offset, offset, results[idx], expected);
+        }
+    }
+    if (ShardedCheckBits(sharded, NULL, 1, results) || ShardedSetBits(NULL, batches[0].offsets, 1, 1, NULL))
+        Mismatch(config, "Sharded calls without offsets or tree", 0, 0, 1, 0);
+
+    DestroyShardedTree(sharded);
+    DestroyTree(plain);
+}
+#endif
+
+/* CheckTuning - TuneTree over the widths checked here, for a sample of offsets laid out in units (keys of 2^CountBits(unit) offsets of
+   which the first unit are used), in time order or at random, optionally with earlier data through a frozen tree. Every width's sampled
+   nodes must be the distinct keys of the sample (0 for a width that cannot hold one of its offsets), the choice the cheapest projection of
+   the widths kept, and the tree CreateTreeTuned makes must hold the sample and further offsets of the layout like the reference. */
+static void CheckTuning (const char *name, unsigned int unit, int in_order, int frozen_sample)
+{
+    static unsigned long long sample[CHECK_OPS / 4];
+    check_config config = {name, 0, 0, 0};
+    TreeTuningHints hints;
+    TreeTuning tuning;
+    struct Tree *tree, *history = NULL;
+    unsigned int unit_bits = CountBits(unit);
+    unsigned long long key_count = CHECK_RANGE >> unit_bits;
+    unsigned int sample_count = CHECK_OPS / 4;
+    int chosen = -1;
+
+    for (unsigned int idx=0;idx<sample_count;idx++)
+    {
+        unsigned long long key = (in_order)?((idx * key_count) / sample_count):(NextRandom() % key_count);
+        sample[idx] = (key << unit_bits) + (NextRandom() % unit);
+    }
+    memset(&hints, 0, sizeof(hints));
+    hints.widths = widths;
+    hints.width_count = WIDTH_COUNT;
+    hints.sample_offsets = sample;
+    hints.sample_count = sample_count;
+    hints.expected_offsets = CHECK_OPS;
+    if (frozen_sample)
+    {
+        // Earlier data of the same layout in the first half of the keys.
+        if ((history = CreateTree(unit)) != NULL)
+        {
+            for (unsigned int idx=0;idx<sample_count;idx++)
+                SetBit64(history, ((NextRandom() % (key_count / 2)) << unit_bits) + (NextRandom() % unit), 1, NULL);
+        }
+        hints.sample_frozen = FreezeTree(history);
+    }
+    if (!TuneTree(&hints, &tuning))
+    {
+        Mismatch(&config, "TuneTree", 0, CHECK_RANGE - 1, 0, 1);
+        DestroyFrozenTree(hints.sample_frozen);
+        DestroyTree(history);
+        return;
+    }
+
+    for (unsigned int width_idx=0;width_idx<WIDTH_COUNT;width_idx++)
+    {
+        unsigned long long nodes = 0, previous_key = ~0ULL;
+        int keep = 1;
+
+        check_width = widths[width_idx];
+        check_idx_size = CountBits(check_width);
+        memset(reference, 0, sizeof(reference));
+        for (unsigned int idx=0;idx<sample_count;idx++)
+            reference[sample[idx]] = 1;
+        for (unsigned long long offset=0;history && (offset<CHECK_RANGE);offset++)
+            reference[offset] |= (unsigned char) CheckBit64(history, offset);
+        for (unsigned long long offset=0;keep && (offset<CHECK_RANGE);offset++)
+        {
+            if (!reference[offset])
+                continue;
+            keep = Addressable(offset);
+            nodes += ((offset >> check_idx_size) != previous_key);
+            previous_key = offset >> check_idx_size;
+        }
+        if (!keep)
+            nodes = 0;
+        if (tuning.sampled_nodes[width_idx] != nodes)
+            Mismatch(&config, "TuneTree sampled nodes", 0, CHECK_RANGE - 1, (unsigned int) tuning.sampled_nodes[width_idx], (unsigned int) nodes);
+        if ((nodes > 0) && ((chosen < 0) || (tuning.projected_bytes[width_idx] < tuning.projected_bytes[chosen]) ||
+                            ((tuning.projected_bytes[width_idx] == tuning.projected_bytes[chosen]) &&
+                             (tuning.projected_nodes[width_idx] < tuning.projected_nodes[chosen]))))
+            chosen = (int) width_idx;
+    }
+    check_width = unit;
+    if ((chosen < 0) || (tuning.bitmap_size_per_node != widths[chosen]))
+        Mismatch(&config, "TuneTree width", 0, CHECK_RANGE - 1, tuning.bitmap_size_per_node, (chosen < 0)?0:widths[chosen]);
+    if ((tuning.flags & ~TREE_OPTION_HASH_INDEX) || (in_order && tuning.flags))
+        Mismatch(&config, "TuneTree flags", 0, CHECK_RANGE - 1, tuning.flags, 0);
+
+    tree = CreateTreeTuned(&hints);
+    DestroyFrozenTree(hints.sample_frozen);
+    DestroyTree(history);
+    if (!tree)
+    {
+        Mismatch(&config, "CreateTreeTuned", 0, CHECK_RANGE - 1, 0, 1);
+        return;
+    }
+    check_width = tuning.bitmap_size_per_node;
+    check_idx_size = CountBits(check_width);
+    memset(reference, 0, sizeof(reference));
+    for (unsigned int idx=0;idx<sample_count;idx++)
+        SetCheckedBit(&config, tree, sample[idx], 1);
+    for (unsigned int op=0;op<CHECK_OPS;op++)
+        SetCheckedBit(&config, tree, ((NextRandom() % key_count) << unit_bits) + (NextRandom() % unit), (unsigned int) ((NextRandom() % 3) != 0));
+    CheckWholeRange(&config, tree);
+    DestroyTree(tree);
+}
+
+/* CheckTuningHints - hints TuneTree must refuse: no widths, a width of 0, and widths none of which holds the sample. */
+static void CheckTuningHints (void)
+{
+    static const check_config config = {"tuning_hints", 0, 0, 0};
+    static const unsigned int zero_width[] = {60, 0};
+    static const unsigned int narrow_widths[] = {1, 7};
+    unsigned long long sample[2] = {7, 2 * 64 + 59};
+    TreeTuningHints hints;
+    TreeTuning tuning;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.sample_offsets = sample;
+    hints.sample_count = 2;
+    hints.widths = widths;
+    if (TuneTree(&hints, &tuning))
+        Mismatch(&config, "TuneTree without widths", 0, 0, 1, 0);
+    hints.widths = zero_width;
+    hints.width_count = 2;
+    if (TuneTree(&hints, &tuning))
+        Mismatch(&config, "TuneTree with a width of 0", 0, 0, 1, 0);
+    hints.widths = narrow_widths;
+    if (TuneTree(&hints, &tuning) || CreateTreeTuned(&hints))
+        Mismatch(&config, "TuneTree with no width holding the sample", sample[0], sample[1], 1, 0);
+}
+
+/* CheckTreeSet60 - the compile time specialised TreeSet60 (TreeSet.hpp through TreeSetFixed.h) against CreateTree(60), call for call. Node
+   counts are not compared, see TreeSetFixed.h. */
+static void CheckTreeSet60 (void)
+{
+    static const check_config config = {"TreeSet60", 0, 0, 0};
+    struct Tree *tree = CreateTree(60);
+    struct TreeSet60 *fixed = CreateTreeSet60();
+
+    if (!tree || !fixed)
+    {
+        Mismatch(&config, "CreateTreeSet60", 0, 0, 0, 1);
+        DestroyTree(tree);
+        DestroyTreeSet60(fixed);
+        return;
+    }
+    check_width = 60;
+    for (unsigned int op=0;op<CHECK_OPS * 4;op++)
+    {
+        unsigned long long offset = NextRandom() % CHECK_RANGE;
+        unsigned int value = (unsigned int) ((NextRandom() % 3) != 0);
+        unsigned int tree_set, fixed_set;
+
+        SetBit64(tree, offset, value, &tree_set);
+        SetBitTreeSet60(fixed, offset, value, &fixed_set);
+        if (fixed_set != tree_set)
+            Mismatch(&config, "SetBitTreeSet60 already_set", offset, offset, fixed_set, tree_set);
+    }
+    for (unsigned long long offset=0;offset<CHECK_RANGE;offset++)
+    {
+        unsigned int got = CheckBitTreeSet60(fixed, offset);
+        if (got != CheckBit64(tree, offset))
+            Mismatch(&config, "CheckBitTreeSet60", offset, offset, got, !got);
+    }
+    DestroyTree(tree);
+    DestroyTreeSet60(fixed);
+}
+
+int main (int argc, char **argv)
+{
+    unsigned long long seed = 0x5eed;
+
+    for (int i = 1;i < argc; i++) {
+        if ((argv[i][0] == '-') && (argv[i][1] == 's'))
+            seed = strtoull(&argv[i][2], NULL, 0);
+    }
+    if (seed == 0)
+    {
+        fprintf(stderr, "Usage: TreeSetCheck [-s<non zero seed>]\n");
+        return 1;
+    }
+
+    rng_state = seed;
+    for (unsigned int config_idx=0;config_idx<CONFIG_COUNT;config_idx++)
+    {
+        for (unsigned int width_idx=0;width_idx<WIDTH_COUNT;width_idx++)
+            CheckTree(&configs[config_idx], widths[width_idx]);
+    }
+    for (unsigned int width_idx=0;width_idx<WIDTH_COUNT;width_idx++)
+    {
+        CheckBulkLoad(widths[width_idx]);
+        CheckFinger(&configs[0], widths[width_idx]);
+        CheckFinger(&configs[1], widths[width_idx]);
+    }
+    for (unsigned int config_idx=0;config_idx<CONFIG_COUNT;config_idx++)
+    {
+        if (configs[config_idx].flags & TREE_OPTION_SNAPSHOTS)
+            continue;
+        for (unsigned int width_idx=0;width_idx<WIDTH_COUNT;width_idx++)
+            CheckFreeze(&configs[config_idx], widths[width_idx]);
+    }
+    for (unsigned int config_idx=0;config_idx<CONFIG_COUNT;config_idx++)
+    {
+        for (unsigned int width_idx=0;width_idx<WIDTH_COUNT;width_idx++)
+            CheckCompact(&configs[config_idx], widths[width_idx]);
+    }
+#ifndef _WIN32
+    for (unsigned int config_idx=0;config_idx<CONFIG_COUNT;config_idx++)
+    {
+        if (configs[config_idx].flags & (TREE_OPTION_SPILL | TREE_OPTION_SNAPSHOTS))
+            continue;
+        for (unsigned int width_idx=0;width_idx<WIDTH_COUNT;width_idx++)
+            CheckSharded(&configs[config_idx], widths[width_idx]);
+    }
+#endif
+    CheckTuning("tuning_in_order", 60, 1, 0);
+    CheckTuning("tuning_random", 8, 0, 0);
+    CheckTuning("tuning_frozen", 60, 0, 1);
+    CheckTuning("tuning_in_order_frozen", 7, 1, 1);
+    CheckTuningHints();
+    CheckTreeSet60();
+
+    printf ("TreeSetCheck: %u option sets x %u widths, seed %llu, %lu mismatches.\n", (unsigned int) CONFIG_COUNT, (unsigned int) WIDTH_COUNT,
+            seed, failures);
+    return (failures == 0)?0:1;
+}
@@ -0,0 +1,35 @@
+#include <new>
+#include "TreeSet.hpp"
+#include "TreeSetFixed.h"
+
+/* C shim over treeset::TreeSet specialisations. The opaque C type simply derives from the template instance. */
+
+struct TreeSet60 : public treeset::TreeSet<60> {};
+
+struct TreeSet60 *CreateTreeSet60 (void)
+{
+    return new (std::nothrow) TreeSet60();
+}
+
+void DestroyTreeSet60 (struct TreeSet60 *tree)
+{
+    delete tree;
+}
+
+unsigned int CheckBitTreeSet60 (struct TreeSet60 *tree, unsigned long long total_bit_offset)
+{
+    return (tree && tree->CheckBit(total_bit_offset)) ? 1 : 0;
+}
+
+// As with the C SetBit, already_set is only reported when setting; clearing always reports 0.
+void SetBitTreeSet60 (struct TreeSet60 *tree, unsigned long long total_bit_offset, unsigned int value, unsigned int *already_set)
+{
+    bool was_set = tree && tree->SetBit(total_bit_offset, (value % 2) == 1);
+    if (already_set)
+        *already_set = (was_set && ((value % 2) == 1)) ? 1 : 0;
+}
+
+unsigned int TreeSet60Nodes (struct TreeSet60 *tree)
+{
+    return tree ? (unsigned int) tree->size() : 0;
+}
@@ -0,0 +1,34 @@
+/* TreeSetFixed
+ * ============
+ *  C interface to the compile time specialised TreeSet in TreeSet.hpp. Each supported geometry gets its own opaque type and functions, named after
+ *  its bits per node; offsets map onto nodes exactly as for a C tree made with CreateTree of the same size, so the two can be swapped freely.
+ *  TreeSet60 matches DataFilter's CreateTree(60) (a minute of seconds per node) with 64 bit offsets.
+ *
+ *  Every CheckBit answer and every already_set result is the same as the C tree's (TreeSetCheck compares them). What differs:
+ *   - Clearing a bit of a node that does not exist, or setting a sub bit offset at or past the bits per node, leaves the tree as it is;
+ *     the C tree inserts an empty node for both, so TreeSet60Nodes can be lower than the C tree's node count for the same calls.
+ *   - There are no TreeOptions (Bloom filter, spill, snapshots, counters, hash index) and no 32 bit offset functions.
+ *   - Running out of memory while inserting a node ends the program (std::bad_alloc cannot pass through the C interface); the C tree skips the
+ *     insert and returns.
+ */
+
+#ifndef TREESETFIXED_H
+#define TREESETFIXED_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct TreeSet60;
+
+struct TreeSet60 *CreateTreeSet60 (void);
+void DestroyTreeSet60 (struct TreeSet60 *tree);
+unsigned int CheckBitTreeSet60 (struct TreeSet60 *tree, unsigned long long total_bit_offset);
+void SetBitTreeSet60 (struct TreeSet60 *tree, unsigned long long total_bit_offset, unsigned int value, unsigned int *already_set);
+unsigned int TreeSet60Nodes (struct TreeSet60 *tree);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // TREESETFIXED_H
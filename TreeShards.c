@@ -0,0 +1,656 @@
+#define _GNU_SOURCE // cpu_set_t, pthread_setaffinity_np and MAP_HUGETLB
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sched.h>
+#include <sys/syscall.h>
+#endif
+#include "TreeShards.h"
+
+/* TreeShards - NUMA aware sharding of a TreeSet, see TreeShards.h. */
+
+#define SHARD_DEFAULT_RANGE_BITS 10
+#define SHARD_MAX_NUMA_NODES     64
+#define SHARD_MAX_CPUS           1024
+
+// Arena sizes: chunks are whole huge pages; requests up to ARENA_MAX_CLASS_SIZE are carved from chunks in 16 byte classes and recycled per class,
+// larger ones (hash indexes, node blocks) get mappings of their own.
+#define ARENA_HUGE_PAGE       (2u << 20)
+#define ARENA_SMALL_PAGE      4096u
+#define ARENA_DEFAULT_CHUNK   (32u << 20)
+#define ARENA_CLASS_BYTES     16u
+#define ARENA_MAX_CLASS_SIZE  4096u
+#define ARENA_CLASSES         ((ARENA_MAX_CLASS_SIZE / ARENA_CLASS_BYTES) + 1)
+
+#define MPOL_BIND_MODE 2 // MPOL_BIND from linux/mempolicy.h
+
+typedef struct ArenaChunk {
+    struct ArenaChunk *next;
+    size_t             size;
+} ArenaChunk;
+
+typedef struct ShardArena {
+    int            numa_node;         // node the memory is bound to, -1 for no binding
+    int            hugetlb;           // SHARDED_TREE_HUGETLB asked for, cleared once explicit huge pages fail
+    const char    *page_kind;         // what the last mapping got
+    size_t         chunk_bytes;
+    ArenaChunk    *chunks;
+    unsigned char *next;              // unused part of the newest chunk
+    unsigned char *end;
+    void          *free_lists[ARENA_CLASSES];
+    size_t         bytes_mapped;
+    unsigned int   bind_failures;
+} ShardArena;
+
+enum { SHARD_CREATE, SHARD_CHECK, SHARD_SET, SHARD_STATS, SHARD_DESTROY };
+
+typedef struct ShardBatch {
+    pthread_mutex_t lock;
+    pthread_cond_t  done;
+    unsigned int    pending;          // requests of the batch not yet answered
+} ShardBatch;
+
+typedef struct ShardRequest {
+    struct ShardRequest      *next;
+    int                       op;
+    unsigned int              value;
+    const unsigned long long *offsets;
+    const unsigned int       *indexes;    // positions in offsets (and results) owned by the shard, in batch order
+    unsigned int              count;
+    unsigned char            *results;
+    ShardBatch               *batch;
+} ShardRequest;
+
+typedef struct Shard {
+    struct ShardedTree *sharded;
+    unsigned int        index;
+    int                 numa_node;        // -1 when not pinned or bound
+    unsigned int        cpu_count;        // CPUs the worker is pinned to, 0 for none
+#ifdef __linux__
+    cpu_set_t           cpus;
+#endif
+    ShardArena          arena;
+    TreeAllocator       allocator;
+    struct Tree        *tree;             // only touched by the worker
+    TreeStats           stats;            // filled in by SHARD_STATS
+    pthread_t           thread;
+    int                 started;
+    pthread_mutex_t     lock;
+    pthread_cond_t      work;
+    ShardRequest       *queue_head;
+    ShardRequest       *queue_tail;
+} Shard;
+
+typedef struct ShardedTree {
+    unsigned int bitmap_size_per_node;
+    unsigned int bitmap_idx_size;
+    unsigned int range_bits;
+    unsigned int shard_count;
+    unsigned int numa_nodes;
+    TreeOptions  tree_options;
+    Shard       *shards;
+} ShardedTree;
+
+/* Topology */
+
+/* ParseList - expand a sysfs list such as "0-3,8-11" into values. Returns how many there were (at most max). */
+static unsigned int ParseList (const char *text, unsigned int *values, unsigned int max)
+{
+    unsigned int count = 0;
+
+    while (*text && (count < max))
+    {
+        char *end;
+        unsigned long first = strtoul(text, &end, 10), last;
+        if (end == text)
+            break;
+        last = first;
+        text = end;
+        if (*text == '-')
+        {
+            last = strtoul(text + 1, &end, 10);
+            text = end;
+        }
+        for (unsigned long value=first;(value<=last) && (count<max);value++)
+            values[count++] = (unsigned int) value;
+        while (*text && ((*text == ',') || (*text == '\n')))
+            text++;
+    }
+    return count;
+}
+
+static unsigned int ReadList (const char *path, unsigned int *values, unsigned int max)
+{
+    char text[4096];
+    FILE *fp = fopen(path, "r");
+    unsigned int count = 0;
+
+    if (fp)
+    {
+        if (fgets(text, sizeof(text), fp))
+            count = ParseList(text, values, max);
+        fclose(fp);
+    }
+    return count;
+}
+
+/* NumaTopology - ids of the NUMA nodes that have CPUs, and their CPUs. Returns 0 when there is only one such node (or no way to tell), in which
+   case nothing is pinned or bound. */
+static unsigned int NumaTopology (int *node_ids, unsigned int (*node_cpus)[SHARD_MAX_CPUS], unsigned int *cpu_counts)
+{
+    unsigned int online[SHARD_MAX_NUMA_NODES];
+    unsigned int nodes = 0;
+
+#ifdef __linux__
+    unsigned int online_count = ReadList("/sys/devices/system/node/online", online, SHARD_MAX_NUMA_NODES);
+    for (unsigned int idx=0;idx<online_count;idx++)
+    {
+        char path[128];
+        if (online[idx] >= SHARD_MAX_NUMA_NODES)
+            continue;
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%u/cpulist", online[idx]);
+        cpu_counts[nodes] = ReadList(path, node_cpus[nodes], SHARD_MAX_CPUS);
+        if (cpu_counts[nodes] > 0)
+            node_ids[nodes++] = (int) online[idx];
+    }
+#else
+    (void) online;
+    (void) node_ids;
+    (void) node_cpus;
+    (void) cpu_counts;
+#endif
+    return (nodes > 1)?nodes:0;
+}
+
+/* Arena */
+
+static void ArenaBind (ShardArena *arena, void *memory, size_t size)
+{
+#if defined(__linux__) && defined(SYS_mbind)
+    unsigned long mask[SHARD_MAX_NUMA_NODES / (8 * sizeof(unsigned long))] = {0};
+
+    if (arena->numa_node < 0)
+        return;
+    mask[arena->numa_node / (8 * sizeof(unsigned long))] |= 1UL << (arena->numa_node % (8 * sizeof(unsigned long)));
+    if (syscall(SYS_mbind, memory, size, MPOL_BIND_MODE, mask, (unsigned long) SHARD_MAX_NUMA_NODES + 1, 0) != 0)
+        arena->bind_failures++;
+#else
+    (void) arena;
+    (void) memory;
+    (void) size;
+#endif
+}
+
+/* ArenaMap - map size bytes (a multiple of the page size) bound to the arena's node, on huge pages where size allows. Pages are only touched
+   (and so placed) after the binding is in force. */
+static void *ArenaMap (ShardArena *arena, size_t size)
+{
+    void *memory = MAP_FAILED;
+    int huge = ((size % ARENA_HUGE_PAGE) == 0);
+
+#ifdef MAP_HUGETLB
+    if (huge && arena->hugetlb)
+    {
+        memory = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (memory != MAP_FAILED)
+            arena->page_kind = "explicit huge";
+        else
+            arena->hugetlb = 0;
+    }
+#endif
+    if ((memory == MAP_FAILED) && huge)
+    {
+        // Over map by a huge page and trim, so the mapping is huge page aligned and transparent huge pages can back all of it.
+        unsigned char *raw = mmap(NULL, size + ARENA_HUGE_PAGE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (raw != MAP_FAILED)
+        {
+            unsigned char *aligned = (unsigned char *) (((uintptr_t) raw + ARENA_HUGE_PAGE - 1) & ~((uintptr_t) ARENA_HUGE_PAGE - 1));
+            if (aligned > raw)
+                munmap(raw, (size_t) (aligned - raw));
+            if ((aligned + size) < (raw + size + ARENA_HUGE_PAGE))
+                munmap(aligned + size, (size_t) ((raw + size + ARENA_HUGE_PAGE) - (aligned + size)));
+            memory = aligned;
+            arena->page_kind = "normal";
+#ifdef MADV_HUGEPAGE
+            if (madvise(memory, size, MADV_HUGEPAGE) == 0)
+                arena->page_kind = "transparent huge";
+#endif
+        }
+    }
+    else if (memory == MAP_FAILED)
+    {
+        memory = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    }
+    if (memory == MAP_FAILED)
+        return NULL;
+
+    ArenaBind(arena, memory, size);
+    arena->bytes_mapped += size;
+    return memory;
+}
+
+static size_t ArenaLargeSize (size_t size)
+{
+    size_t page = (size >= ARENA_HUGE_PAGE)?ARENA_HUGE_PAGE:ARENA_SMALL_PAGE;
+    return (size + page - 1) & ~(page - 1);
+}
+
+static void *ArenaAllocate (void *context, size_t size)
+{
+    ShardArena *arena = context;
+    size_t rounded = (size + ARENA_CLASS_BYTES - 1) & ~((size_t) ARENA_CLASS_BYTES - 1);
+    void *memory;
+
+    if (rounded > ARENA_MAX_CLASS_SIZE)
+        return ArenaMap(arena, ArenaLargeSize(size));
+
+    memory = arena->free_lists[rounded / ARENA_CLASS_BYTES];
+    if (memory)
+    {
+        arena->free_lists[rounded / ARENA_CLASS_BYTES] = *(void **) memory;
+        return memory;
+    }
+
+    if ((arena->next == NULL) || ((size_t) (arena->end - arena->next) < rounded))
+    {
+        ArenaChunk *chunk = ArenaMap(arena, arena->chunk_bytes);
+        if (!chunk)
+            return NULL;
+        chunk->next = arena->chunks;
+        chunk->size = arena->chunk_bytes;
+        arena->chunks = chunk;
+        arena->next = (unsigned char *) chunk + ((sizeof(ArenaChunk) + ARENA_CLASS_BYTES - 1) & ~((size_t) ARENA_CLASS_BYTES - 1));
+        arena->end = (unsigned char *) chunk + chunk->size;
+    }
+    memory = arena->next;
+    arena->next += rounded;
+    return memory;
+}
+
+static void ArenaRelease (void *context, void *memory, size_t size)
+{
+    ShardArena *arena = context;
+    size_t rounded = (size + ARENA_CLASS_BYTES - 1) & ~((size_t) ARENA_CLASS_BYTES - 1);
+
+    if (rounded > ARENA_MAX_CLASS_SIZE)
+    {
+        munmap(memory, ArenaLargeSize(size));
+        arena->bytes_mapped -= ArenaLargeSize(size);
+        return;
+    }
+    *(void **) memory = arena->free_lists[rounded / ARENA_CLASS_BYTES];
+    arena->free_lists[rounded / ARENA_CLASS_BYTES] = memory;
+}
+
+static void ArenaDestroy (ShardArena *arena)
+{
+    while (arena->chunks)
+    {
+        ArenaChunk *next = arena->chunks->next;
+        arena->bytes_mapped -= arena->chunks->size;
+        munmap(arena->chunks, arena->chunks->size);
+        arena->chunks = next;
+    }
+}
+
+/* Workers */
+
+static void *ShardWorker (void *arg)
+{
+    Shard *shard = arg;
+    int running = 1;
+
+#ifdef __linux__
+    if (shard->cpu_count > 0)
+        pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &shard->cpus);
+#endif
+
+    while (running)
+    {
+        pthread_mutex_lock(&shard->lock);
+        while (!shard->queue_head)
+            pthread_cond_wait(&shard->work, &shard->lock);
+        ShardRequest *request = shard->queue_head;
+        shard->queue_head = request->next;
+        if (!shard->queue_head)
+            shard->queue_tail = NULL;
+        pthread_mutex_unlock(&shard->lock);
+
+        switch (request->op)
+        {
+            case SHARD_CREATE:
+            {
+                // Created on the worker, so even the tree's first allocations are made where it will be used.
+                TreeOptions options = shard->sharded->tree_options;
+                options.allocator = &shard->allocator;
+                shard->tree = CreateTreeWithOptions(shard->sharded->bitmap_size_per_node, &options);
+                break;
+            }
+            case SHARD_CHECK:
+                for (unsigned int idx=0;idx<request->count;idx++)
+                    request->results[request->indexes[idx]] = (unsigned char) CheckBit64(shard->tree, request->offsets[request->indexes[idx]]);
+                break;
+            case SHARD_SET:
+                for (unsigned int idx=0;idx<request->count;idx++)
+                {
+                    unsigned int was_set;
+                    SetBit64(shard->tree, request->offsets[request->indexes[idx]], request->value, &was_set);
+                    if (request->results)
+                        request->results[request->indexes[idx]] = (unsigned char) was_set;
+                }
+                break;
+            case SHARD_STATS:
+                GetTreeStats(shard->tree, &shard->stats);
+                break;
+            case SHARD_DESTROY:
+                DestroyTree(shard->tree);
+                shard->tree = NULL;
+                running = 0;
+                break;
+        }
+
+        pthread_mutex_lock(&request->batch->lock);
+        if (--request->batch->pending == 0)
+            pthread_cond_signal(&request->batch->done);
+        pthread_mutex_unlock(&request->batch->lock);
+    }
+    return NULL;
+}
+
+static void ShardSubmit (Shard *shard, ShardRequest *request)
+{
+    request->next = NULL;
+    pthread_mutex_lock(&shard->lock);
+    if (shard->queue_tail)
+        shard->queue_tail->next = request;
+    else
+        shard->queue_head = request;
+    shard->queue_tail = request;
+    pthread_cond_signal(&shard->work);
+    pthread_mutex_unlock(&shard->lock);
+}
+
+/* ShardBroadcast - run op on every started shard and wait for all of them. */
+static void ShardBroadcast (ShardedTree *sharded, int op)
+{
+    ShardBatch batch;
+    ShardRequest *requests = calloc(sharded->shard_count, sizeof(ShardRequest));
+
+    if (!requests)
+        return;
+    pthread_mutex_init(&batch.lock, NULL);
+    pthread_cond_init(&batch.done, NULL);
+    batch.pending = 0;
+    for (unsigned int idx=0;idx<sharded->shard_count;idx++)
+        batch.pending += sharded->shards[idx].started;
+
+    for (unsigned int idx=0;idx<sharded->shard_count;idx++)
+    {
+        if (!sharded->shards[idx].started)
+            continue;
+        requests[idx].op = op;
+        requests[idx].batch = &batch;
+        ShardSubmit(&sharded->shards[idx], &requests[idx]);
+    }
+
+    pthread_mutex_lock(&batch.lock);
+    while (batch.pending > 0)
+        pthread_cond_wait(&batch.done, &batch.lock);
+    pthread_mutex_unlock(&batch.lock);
+    pthread_mutex_destroy(&batch.lock);
+    pthread_cond_destroy(&batch.done);
+    free(requests);
+}
+
+/* ShardRun - split a batch of offsets by owning shard (keeping batch order within each shard), hand each part to its worker and wait. Returns
+   0, with nothing applied, if the batch's index arrays cannot be allocated. */
+static int ShardRun (ShardedTree *sharded, int op, const unsigned long long *offsets, unsigned int count, unsigned int value, unsigned char *results)
+{
+    ShardBatch batch;
+    unsigned int *indexes = malloc((size_t) count * sizeof(unsigned int));
+    unsigned int *starts = calloc(sharded->shard_count + 1, sizeof(unsigned int));
+    unsigned int *fill = calloc(sharded->shard_count, sizeof(unsigned int));
+    ShardRequest *requests = calloc(sharded->shard_count, sizeof(ShardRequest));
+
+    if (!indexes || !starts || !fill || !requests)
+    {
+        free(indexes);
+        free(starts);
+        free(fill);
+        free(requests);
+        return 0;
+    }
+
+    for (unsigned int idx=0;idx<count;idx++)
+        starts[((offsets[idx] >> sharded->bitmap_idx_size) >> sharded->range_bits) % sharded->shard_count + 1]++;
+    for (unsigned int shard_idx=0;shard_idx<sharded->shard_count;shard_idx++)
+        starts[shard_idx + 1] += starts[shard_idx];
+    for (unsigned int idx=0;idx<count;idx++)
+    {
+        unsigned int shard_idx = (unsigned int) (((offsets[idx] >> sharded->bitmap_idx_size) >> sharded->range_bits) % sharded->shard_count);
+        indexes[starts[shard_idx] + fill[shard_idx]++] = idx;
+    }
+
+    pthread_mutex_init(&batch.lock, NULL);
+    pthread_cond_init(&batch.done, NULL);
+    batch.pending = 0;
+    for (unsigned int shard_idx=0;shard_idx<sharded->shard_count;shard_idx++)
+        batch.pending += (starts[shard_idx + 1] > starts[shard_idx]);
+
+    for (unsigned int shard_idx=0;shard_idx<sharded->shard_count;shard_idx++)
+    {
+        ShardRequest *request = &requests[shard_idx];
+        if (starts[shard_idx + 1] == starts[shard_idx])
+            continue;
+        request->op = op;
+        request->value = value;
+        request->offsets = offsets;
+        request->indexes = &indexes[starts[shard_idx]];
+        request->count = starts[shard_idx + 1] - starts[shard_idx];
+        request->results = results;
+        request->batch = &batch;
+        ShardSubmit(&sharded->shards[shard_idx], request);
+    }
+
+    pthread_mutex_lock(&batch.lock);
+    while (batch.pending > 0)
+        pthread_cond_wait(&batch.done, &batch.lock);
+    pthread_mutex_unlock(&batch.lock);
+    pthread_mutex_destroy(&batch.lock);
+    pthread_cond_destroy(&batch.done);
+    free(indexes);
+    free(starts);
+    free(fill);
+    free(requests);
+    return 1;
+}
+
+/* ShardRunPieces - ShardRun, retried in two halves (in batch order) while memory is too short for the whole batch. Returns 0 if a single
+   offset cannot be run, with the offsets from it on not applied. */
+static int ShardRunPieces (ShardedTree *sharded, int op, const unsigned long long *offsets, unsigned int count, unsigned int value,
+                           unsigned char *results)
+{
+    unsigned int half = count / 2;
+
+    if (ShardRun(sharded, op, offsets, count, value, results))
+        return 1;
+    if (count == 1)
+    {
+        printf("TreeShards: cannot allocate a batch of one offset, the rest of the batch is not applied.\n");
+        return 0;
+    }
+    return ShardRunPieces(sharded, op, offsets, half, value, results) &&
+           ShardRunPieces(sharded, op, offsets + half, count - half, value, (results)?results + half:NULL);
+}
+
+/* Interfaces */
+
+struct ShardedTree *CreateShardedTree (unsigned int bitmap_size_per_node, const ShardedTreeOptions *options)
+{
+    static int node_ids[SHARD_MAX_NUMA_NODES];
+    static unsigned int node_cpus[SHARD_MAX_NUMA_NODES][SHARD_MAX_CPUS];
+    static unsigned int cpu_counts[SHARD_MAX_NUMA_NODES];
+    static pthread_mutex_t topology_lock = PTHREAD_MUTEX_INITIALIZER;
+    ShardedTreeOptions defaults;
+    ShardedTree *sharded = calloc(1, sizeof(ShardedTree));
+    unsigned int shards_per_node;
+    size_t chunk_bytes;
+    int failed = 0;
+
+    if (!sharded)
+        return NULL;
+    memset(&defaults, 0, sizeof(defaults));
+    if (!options)
+        options = &defaults;
+
+    shards_per_node = (options->shards_per_node > 0)?options->shards_per_node:1;
+    chunk_bytes = (options->arena_chunk_bytes > 0)?options->arena_chunk_bytes:ARENA_DEFAULT_CHUNK;
+    chunk_bytes = (chunk_bytes + ARENA_HUGE_PAGE - 1) & ~((size_t) ARENA_HUGE_PAGE - 1);
+    sharded->bitmap_size_per_node = bitmap_size_per_node;
+    while ((sharded->bitmap_idx_size < 32) && ((bitmap_size_per_node >> sharded->bitmap_idx_size) > 0))
+        sharded->bitmap_idx_size++;
+    sharded->range_bits = (options->range_bits > 0)?options->range_bits:SHARD_DEFAULT_RANGE_BITS;
+    sharded->tree_options = options->tree_options;
+    sharded->tree_options.allocator = NULL;
+
+    pthread_mutex_lock(&topology_lock);
+    sharded->numa_nodes = NumaTopology(node_ids, node_cpus, cpu_counts);
+    sharded->shard_count = ((sharded->numa_nodes > 0)?sharded->numa_nodes:1) * shards_per_node;
+    sharded->shards = calloc(sharded->shard_count, sizeof(Shard));
+    for (unsigned int idx=0;sharded->shards && (idx<sharded->shard_count);idx++)
+    {
+        Shard *shard = &sharded->shards[idx];
+        unsigned int node = idx / shards_per_node;
+
+        shard->sharded = sharded;
+        shard->index = idx;
+        shard->numa_node = -1;
+#ifdef __linux__
+        if (sharded->numa_nodes > 0)
+        {
+            shard->numa_node = node_ids[node];
+            CPU_ZERO(&shard->cpus);
+            for (unsigned int cpu=0;cpu<cpu_counts[node];cpu++)
+            {
+                if (node_cpus[node][cpu] < CPU_SETSIZE)
+                {
+                    CPU_SET(node_cpus[node][cpu], &shard->cpus);
+                    shard->cpu_count++;
+                }
+            }
+        }
+#else
+        (void) node;
+#endif
+        shard->arena.numa_node = shard->numa_node;
+        shard->arena.hugetlb = ((options->flags & SHARDED_TREE_HUGETLB) != 0);
+        shard->arena.page_kind = "none yet";
+        shard->arena.chunk_bytes = chunk_bytes;
+        shard->allocator.allocate = ArenaAllocate;
+        shard->allocator.release = ArenaRelease;
+        shard->allocator.context = &shard->arena;
+        pthread_mutex_init(&shard->lock, NULL);
+        pthread_cond_init(&shard->work, NULL);
+        shard->started = (pthread_create(&shard->thread, NULL, ShardWorker, shard) == 0);
+        failed |= !shard->started;
+    }
+    pthread_mutex_unlock(&topology_lock);
+
+    if (sharded->shards && !failed)
+    {
+        ShardBroadcast(sharded, SHARD_CREATE);
+        for (unsigned int idx=0;idx<sharded->shard_count;idx++)
+            failed |= (sharded->shards[idx].tree == NULL);
+    }
+    if (!sharded->shards || failed)
+    {
+        printf("CreateShardedTree: cannot start %u shards.\n", sharded->shard_count);
+        DestroyShardedTree(sharded);
+        return NULL;
+    }
+    return sharded;
+}
+
+void DestroyShardedTree (struct ShardedTree *sharded)
+{
+    if (!sharded)
+        return;
+    if (sharded->shards)
+    {
+        ShardBroadcast(sharded, SHARD_DESTROY);
+        for (unsigned int idx=0;idx<sharded->shard_count;idx++)
+        {
+            Shard *shard = &sharded->shards[idx];
+            if (shard->started)
+                pthread_join(shard->thread, NULL);
+            ArenaDestroy(&shard->arena);
+            pthread_mutex_destroy(&shard->lock);
+            pthread_cond_destroy(&shard->work);
+        }
+        free(sharded->shards);
+    }
+    free(sharded);
+}
+
+int ShardedCheckBits (struct ShardedTree *sharded, const unsigned long long *offsets, unsigned int count, unsigned char *results)
+{
+    if (!sharded || !offsets || !results)
+        return 0;
+    return (count == 0) || ShardRunPieces(sharded, SHARD_CHECK, offsets, count, 0, results);
+}
+
+int ShardedSetBits (struct ShardedTree *sharded, const unsigned long long *offsets, unsigned int count, unsigned int value, unsigned char *already_set)
+{
+    if (!sharded || !offsets)
+        return 0;
+    return (count == 0) || ShardRunPieces(sharded, SHARD_SET, offsets, count, value, already_set);
+}
+
+unsigned int ShardedTreeShards (struct ShardedTree *sharded)
+{
+    return (sharded)?sharded->shard_count:0;
+}
+
+unsigned int ShardedTreeNumaNodes (struct ShardedTree *sharded)
+{
+    return (sharded)?((sharded->numa_nodes > 0)?sharded->numa_nodes:1):0;
+}
+
+unsigned long long ShardedTreeNodes (struct ShardedTree *sharded)
+{
+    unsigned long long nodes = 0;
+
+    if (!sharded)
+        return 0;
+    ShardBroadcast(sharded, SHARD_STATS);
+    for (unsigned int idx=0;idx<sharded->shard_count;idx++)
+        nodes += sharded->shards[idx].stats.nodes;
+    return nodes;
+}
+
+void ShardedTreeInfo (struct ShardedTree *sharded)
+{
+    if (!sharded)
+        return;
+    ShardBroadcast(sharded, SHARD_STATS);
+    printf("Sharded tree: %u shards over %u NUMA nodes%s, ranges of %u node keys.\n", sharded->shard_count, ShardedTreeNumaNodes(sharded),
+           (sharded->numa_nodes > 0)?"":" (single node, not pinned or bound)", 1u << sharded->range_bits);
+    for (unsigned int idx=0;idx<sharded->shard_count;idx++)
+    {
+        Shard *shard = &sharded->shards[idx];
+        if (shard->numa_node >= 0)
+            printf(" shard %u: NUMA node %d on %u CPUs,", idx, shard->numa_node, shard->cpu_count);
+        else
+            printf(" shard %u: unbound,", idx);
+        printf(" %u nodes, %lu bytes in use, %lu bytes mapped on %s pages", shard->stats.nodes, (unsigned long) shard->stats.bytes_allocated,
+               (unsigned long) shard->arena.bytes_mapped, shard->arena.page_kind);
+        if (shard->arena.bind_failures > 0)
+            printf(" (%u mappings could not be bound)", shard->arena.bind_failures);
+        printf("\n");
+    }
+}
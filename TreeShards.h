@@ -0,0 +1,50 @@
+/* TreeShards
+ * ==========
+ *  A TreeSet split into shards for multi socket machines. Node keys are cut into ranges of 2^range_bits keys, dealt round robin to the shards, and
+ *  each shard's tree is only ever touched by its own worker thread: the worker is pinned to the CPUs of one NUMA node and the tree's nodes and
+ *  bitmaps come from an arena of memory bound to that node, backed by huge pages (explicit ones if asked for and available, otherwise transparent).
+ *  Batches of offsets are split by owning shard, handed to the workers and answered in the caller's order, so each SetBit is served from local
+ *  memory and the shards need no locks.
+ *
+ *  NUMA nodes are read from /sys/devices/system/node on Linux. On a single node machine (or elsewhere) the shards are neither pinned nor bound,
+ *  which keeps the same code paths testable anywhere.
+ */
+
+#ifndef TREESHARDS_H
+#define TREESHARDS_H
+
+#include <stddef.h>
+#include "TreeSet.h"
+
+struct ShardedTree;
+
+#define SHARDED_TREE_HUGETLB 0x1   // try explicit huge pages (MAP_HUGETLB) for the arenas before transparent ones
+
+typedef struct ShardedTreeOptions {
+    unsigned int flags;             // SHARDED_TREE_ values
+    unsigned int shards_per_node;   // shards (and worker threads) per NUMA node, 0 for 1
+    unsigned int range_bits;        // node keys per range owned by a shard = 2^range_bits, 0 for 10
+    size_t       arena_chunk_bytes; // arena growth step, 0 for 32 MiB (rounded up to 2 MiB)
+    TreeOptions  tree_options;      // for every shard's tree (its allocator is replaced by the shard's arena)
+} ShardedTreeOptions;
+
+/* CreateShardedTree starts a worker per shard and creates its tree on it; options may be NULL. Returns NULL if a tree or worker cannot be
+   created. DestroyShardedTree stops the workers and releases the trees and arenas. */
+struct ShardedTree *CreateShardedTree (unsigned int bitmap_size_per_node, const ShardedTreeOptions *options);
+void DestroyShardedTree (struct ShardedTree *sharded);
+
+/* Batched CheckBit64/SetBit64: results[i] (and already_set[i], which may be NULL) get what CheckBit64/SetBit64 on a single tree would give for
+   offsets[i], as the offsets of each shard are applied in batch order. Returns once the whole batch is done. Several threads may submit batches
+   at once; a batch pays a hand over to each worker involved, so batches of a few thousand offsets amortise it. If memory is short the batch is
+   run in smaller pieces. Both return 1 once every offset is done, or 0 if some could not be (with a NULL tree or offsets, or out of memory even
+   for a single offset); the results of those are then not written. */
+int ShardedCheckBits (struct ShardedTree *sharded, const unsigned long long *offsets, unsigned int count, unsigned char *results);
+int ShardedSetBits (struct ShardedTree *sharded, const unsigned long long *offsets, unsigned int count, unsigned int value, unsigned char *already_set);
+
+/* Shards, NUMA nodes in use, nodes over all shards, and a per shard summary (NUMA node, nodes, bytes, arena and page size). */
+unsigned int ShardedTreeShards (struct ShardedTree *sharded);
+unsigned int ShardedTreeNumaNodes (struct ShardedTree *sharded);
+unsigned long long ShardedTreeNodes (struct ShardedTree *sharded);
+void ShardedTreeInfo (struct ShardedTree *sharded);
+
+#endif // TREESHARDS_H
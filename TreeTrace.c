@@ -0,0 +1,181 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <stdatomic.h>
+#include "TreeTrace.h"
+
+/* TreeTrace - per thread rings of binary trace records, see TreeTrace.h. */
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define TRACE_TSC() __rdtsc()
+#elif defined(_M_X64) || defined(_M_IX86)
+#include <intrin.h>
+#define TRACE_TSC() __rdtsc()
+#else
+#define TRACE_TSC() TraceNanoseconds()
+#endif
+
+#ifdef _MSC_VER
+#define TRACE_THREAD_LOCAL __declspec(thread)
+#else
+#define TRACE_THREAD_LOCAL _Thread_local
+#endif
+
+#define TRACE_DEFAULT_RECORDS 65536
+
+typedef struct TraceRing {
+    struct TraceRing *next;
+    uint32_t          thread_index;
+    uint32_t          mask;          // capacity - 1, the capacity being a power of two
+    uint64_t          written;
+    TreeTraceRecord   records[];
+} TraceRing;
+
+volatile int tree_trace_enabled = 0;
+
+static _Atomic(TraceRing *) trace_rings = NULL;
+static atomic_uint trace_thread_count = 0;
+static atomic_uint trace_generation = 1;     // bumped by TreeTraceRelease, so threads drop rings that were freed
+static unsigned int trace_capacity = TRACE_DEFAULT_RECORDS;
+static uint64_t trace_start_tsc = 0;
+static uint64_t trace_start_ns = 0;
+
+static TRACE_THREAD_LOCAL TraceRing *thread_ring = NULL;
+static TRACE_THREAD_LOCAL unsigned int thread_ring_generation = 0;
+
+static uint64_t TraceNanoseconds (void)
+{
+    struct timespec now;
+    timespec_get(&now, TIME_UTC);
+    return ((uint64_t) now.tv_sec * 1000000000ULL) + (uint64_t) now.tv_nsec;
+}
+
+/* TraceNewRing - allocate the calling thread's ring and push it onto the list of rings. */
+static TraceRing *TraceNewRing (void)
+{
+    TraceRing *ring = malloc(sizeof(TraceRing) + ((size_t) trace_capacity * sizeof(TreeTraceRecord)));
+    if (!ring)
+    {
+        tree_trace_enabled = 0;
+        printf ("TreeTrace: cannot allocate a ring of %u records, tracing stopped.\n", trace_capacity);
+        return NULL;
+    }
+    ring->thread_index = atomic_fetch_add(&trace_thread_count, 1);
+    ring->mask = trace_capacity - 1;
+    ring->written = 0;
+    ring->next = atomic_load(&trace_rings);
+    while (!atomic_compare_exchange_weak(&trace_rings, &ring->next, ring))
+        ;
+    thread_ring = ring;
+    thread_ring_generation = atomic_load_explicit(&trace_generation, memory_order_relaxed);
+    return ring;
+}
+
+void TreeTraceWrite (unsigned int event, unsigned long long key, unsigned int depth, unsigned int outcome)
+{
+    TraceRing *ring = thread_ring;
+
+    if (!ring || (thread_ring_generation != atomic_load_explicit(&trace_generation, memory_order_relaxed)))
+    {
+        ring = TraceNewRing();
+        if (!ring)
+            return;
+    }
+
+    TreeTraceRecord *record = &ring->records[ring->written++ & ring->mask];
+    record->tsc = TRACE_TSC();
+    record->key = key;
+    record->depth = depth;
+    record->event = (uint16_t) event;
+    record->outcome = (uint16_t) outcome;
+}
+
+void TreeTraceStart (unsigned int records_per_thread)
+{
+    unsigned int capacity = 1;
+
+    if (records_per_thread == 0)
+        records_per_thread = TRACE_DEFAULT_RECORDS;
+    while ((capacity < records_per_thread) && (capacity < (1u << 30)))
+        capacity <<= 1;
+    trace_capacity = capacity;
+    trace_start_tsc = TRACE_TSC();
+    trace_start_ns = TraceNanoseconds();
+    tree_trace_enabled = 1;
+}
+
+void TreeTraceStop (void)
+{
+    tree_trace_enabled = 0;
+}
+
+unsigned long long TreeTraceSave (const char *filename)
+{
+    TreeTraceFileHeader header;
+    unsigned long long saved = 0;
+    uint64_t elapsed_ns = TraceNanoseconds() - trace_start_ns;
+    uint64_t elapsed_ticks = TRACE_TSC() - trace_start_tsc;
+    FILE *fp = fopen(filename, "wb");
+
+    if (!fp)
+    {
+        printf ("TreeTrace: cannot open %s to save the trace.\n", filename);
+        return 0;
+    }
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, TREE_TRACE_MAGIC, sizeof(header.magic));
+    header.record_size = sizeof(TreeTraceRecord);
+    header.ticks_per_ns = (elapsed_ns > 0)?((double) elapsed_ticks / (double) elapsed_ns):1.0;
+    header.start_tsc = trace_start_tsc;
+    for (TraceRing *ring = atomic_load(&trace_rings); ring; ring = ring->next)
+        header.ring_count++;
+    int failed = (fwrite(&header, sizeof(header), 1, fp) != 1);
+
+    for (TraceRing *ring = atomic_load(&trace_rings); ring && !failed; ring = ring->next)
+    {
+        TreeTraceRingHeader ring_header;
+        uint64_t capacity = (uint64_t) ring->mask + 1;
+
+        memset(&ring_header, 0, sizeof(ring_header));
+        ring_header.thread_index = ring->thread_index;
+        ring_header.capacity = (uint32_t) capacity;
+        ring_header.written = ring->written;
+        ring_header.stored = (ring->written < capacity)?ring->written:capacity;
+        failed = (fwrite(&ring_header, sizeof(ring_header), 1, fp) != 1);
+
+        // Oldest first: once the ring has wrapped, the oldest record is the one the next write would overwrite.
+        uint64_t first = (ring->written < capacity)?0:(ring->written & ring->mask);
+        uint64_t head = capacity - first;
+        if (head > ring_header.stored)
+            head = ring_header.stored;
+        failed = failed || (fwrite(&ring->records[first], sizeof(TreeTraceRecord), (size_t) head, fp) != head);
+        failed = failed || (fwrite(&ring->records[0], sizeof(TreeTraceRecord), (size_t) (ring_header.stored - head), fp) != (ring_header.stored - head));
+        saved += ring_header.stored;
+    }
+
+    if (fclose(fp) != 0)
+        failed = 1;
+    if (failed)
+    {
+        printf ("TreeTrace: failed writing the trace to %s.\n", filename);
+        return 0;
+    }
+    return saved;
+}
+
+void TreeTraceRelease (void)
+{
+    TraceRing *ring = atomic_exchange(&trace_rings, NULL);
+
+    atomic_fetch_add(&trace_generation, 1);
+    atomic_store(&trace_thread_count, 0);
+    while (ring)
+    {
+        TraceRing *next = ring->next;
+        free(ring);
+        ring = next;
+    }
+}
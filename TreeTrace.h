@@ -0,0 +1,79 @@
+/* TreeTrace
+ * =========
+ *  Binary event tracing for the hot paths of TreeSet and DateFilter, in place of formatted verbose output. Each event is a fixed size record (event,
+ *  key, depth, outcome and a cycle counter timestamp) appended to a ring buffer owned by the calling thread, so writers never share a cache line or
+ *  take a lock, and the newest records of every thread survive however long the run. TREE_TRACE costs one predictable branch on a global flag
+ *  while tracing is off. TreeTraceSave writes all rings to a file, which TreeTraceDump decodes offline, merged across threads in time order.
+ *
+ *  Define TREESET_NO_TRACE to compile the trace points out altogether.
+ */
+
+#ifndef TREETRACE_H
+#define TREETRACE_H
+
+#include <stdint.h>
+
+/* Trace events, with what each record's key, depth and outcome hold. */
+#define TREE_TRACE_EVENTS(EVENT) \
+    EVENT(TREE_TRACE_FIND,      "find")       /* node key, nodes visited on the descent (0 if the finger, hash index or Bloom filter answered), 1 if found */ \
+    EVENT(TREE_TRACE_INSERT,    "insert")     /* node key, tree size after the insert, 1 if the RedBlack fix up changed the tree */ \
+    EVENT(TREE_TRACE_ROTATE,    "rotate")     /* key of the node rotated about, 0, 0 for a left rotation and 1 for a right */ \
+    EVENT(TREE_TRACE_RECOLOR,   "recolor")    /* key of the grandparent recolored, 0, 0 */ \
+    EVENT(TREE_TRACE_CHECK_BIT, "check_bit")  /* node key, sub bit offset, 1 if set */ \
+    EVENT(TREE_TRACE_SET_BIT,   "set_bit")    /* node key, sub bit offset, value written | 2 if it was already set */ \
+    EVENT(TREE_TRACE_TS_CHECK,  "ts_check")   /* DateFilter timestamp key, year, 1 if already present | 2 from history | 4 from a cold year */ \
+    EVENT(TREE_TRACE_PARSE,     "parse")      /* DateFilter line length, year, 0 if parsed | 1 if the time zone was adjusted, 2 if the parse failed */ \
+    EVENT(TREE_TRACE_LINE,      "line")       /* DateFilter timestamp key, year, 0 written, 1 duplicate discarded, 2 parse failure discarded */
+
+#define TREE_TRACE_ENUM(id, name) id,
+enum TreeTraceEvent { TREE_TRACE_EVENTS(TREE_TRACE_ENUM) TREE_TRACE_EVENT_COUNT };
+#undef TREE_TRACE_ENUM
+
+typedef struct TreeTraceRecord {
+    uint64_t tsc;       // cycle counter (or nanoseconds where there is none), see ticks_per_ns in the file header
+    uint64_t key;
+    uint32_t depth;
+    uint16_t event;     // TreeTraceEvent
+    uint16_t outcome;
+} TreeTraceRecord;
+
+/* Trace file layout: a TreeTraceFileHeader, then for each thread a TreeTraceRingHeader followed by its stored records, oldest first. */
+#define TREE_TRACE_MAGIC   "TREETRC1"
+
+typedef struct TreeTraceFileHeader {
+    char     magic[8];
+    uint32_t record_size;      // sizeof(TreeTraceRecord)
+    uint32_t ring_count;
+    double   ticks_per_ns;     // tsc ticks per nanosecond over the traced interval
+    uint64_t start_tsc;        // tsc at TreeTraceStart
+} TreeTraceFileHeader;
+
+typedef struct TreeTraceRingHeader {
+    uint32_t thread_index;     // order in which threads wrote their first record
+    uint32_t capacity;         // records the ring holds
+    uint64_t written;          // records written, more than stored once the ring has wrapped
+    uint64_t stored;
+} TreeTraceRingHeader;
+
+/* TreeTraceStart enables tracing with a ring of records_per_thread records (rounded up to a power of two, 0 for 65536) for each thread that
+   writes one, allocated on its first event. TreeTraceStop disables it. TreeTraceSave writes every ring to filename and returns the number of
+   records written, or 0 on failure; TreeTraceRelease frees the rings. Rings are written without locks, so save and release only once the writing
+   threads are done or stopped (threads that keep running after a release start a new ring on their next event if tracing is restarted). */
+void TreeTraceStart (unsigned int records_per_thread);
+void TreeTraceStop (void);
+unsigned long long TreeTraceSave (const char *filename);
+void TreeTraceRelease (void);
+
+extern volatile int tree_trace_enabled;
+void TreeTraceWrite (unsigned int event, unsigned long long key, unsigned int depth, unsigned int outcome);
+
+#ifdef TREESET_NO_TRACE
+// The arguments are still evaluated (for nothing), so values computed only to be traced do not become unused variables.
+#define TREE_TRACE(event, key, depth, outcome) do { (void) (event); (void) (key); (void) (depth); (void) (outcome); } while (0)
+#elif defined(__GNUC__) || defined(__clang__)
+#define TREE_TRACE(event, key, depth, outcome) do { if (__builtin_expect(tree_trace_enabled, 0)) TreeTraceWrite((event), (key), (depth), (outcome)); } while (0)
+#else
+#define TREE_TRACE(event, key, depth, outcome) do { if (tree_trace_enabled) TreeTraceWrite((event), (key), (depth), (outcome)); } while (0)
+#endif
+
+#endif // TREETRACE_H
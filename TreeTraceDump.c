@@ -0,0 +1,125 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "TreeTrace.h"
+
+/* TreeTraceDump - decodes a trace file saved by TreeTraceSave. The records of all threads are merged in time order and printed one per line,
+   with the time since TreeTraceStart in microseconds, followed by a count of each event and of the records each thread's ring dropped.
+
+   Usage: TreeTraceDump [-s] [-e<event name>] <trace file>
+     -s  summary only
+     -e  print only records of one event (find, insert, set_bit, ...) */
+
+#define TREE_TRACE_NAME(id, name) name,
+static const char *event_names[TREE_TRACE_EVENT_COUNT] = { TREE_TRACE_EVENTS(TREE_TRACE_NAME) };
+#undef TREE_TRACE_NAME
+
+typedef struct dump_record {
+    TreeTraceRecord record;
+    uint32_t        thread_index;
+} dump_record;
+
+static int CompareDumpRecord (const void *a, const void *b)
+{
+    const dump_record *left = a, *right = b;
+
+    if (left->record.tsc != right->record.tsc)
+        return (left->record.tsc < right->record.tsc)?-1:1;
+    return (left->thread_index > right->thread_index) - (left->thread_index < right->thread_index);
+}
+
+static const char *EventName (unsigned int event)
+{
+    return (event < TREE_TRACE_EVENT_COUNT)?event_names[event]:"unknown";
+}
+
+int main (int argc, char **argv)
+{
+    const char *filename = NULL;
+    const char *only_event = NULL;
+    int summary_only = 0;
+    TreeTraceFileHeader header;
+    unsigned long long event_counts[TREE_TRACE_EVENT_COUNT + 1] = {0};
+
+    for (int i = 1;i < argc; i++) {
+        if (argv[i][0] != '-')
+            filename = argv[i];
+        else if (argv[i][1] == 's')
+            summary_only = 1;
+        else if (argv[i][1] == 'e')
+            only_event = &argv[i][2];
+    }
+    if (!filename)
+    {
+        fprintf(stderr, "Usage: TreeTraceDump [-s] [-e<event name>] <trace file>\n");
+        return 1;
+    }
+
+    FILE *fp = fopen(filename, "rb");
+    if (!fp)
+    {
+        fprintf(stderr, "Trace file %s cannot be opened.\n", filename);
+        return 1;
+    }
+    if ((fread(&header, sizeof(header), 1, fp) != 1) || (memcmp(header.magic, TREE_TRACE_MAGIC, sizeof(header.magic)) != 0) ||
+        (header.record_size != sizeof(TreeTraceRecord)))
+    {
+        fprintf(stderr, "%s is not a trace file of this version.\n", filename);
+        fclose(fp);
+        return 1;
+    }
+
+    dump_record *records = NULL;
+    size_t record_count = 0;
+    printf ("Trace %s: %u threads, %.3f ticks per ns.\n", filename, header.ring_count, header.ticks_per_ns);
+    for (uint32_t ring_idx=0;ring_idx<header.ring_count;ring_idx++)
+    {
+        TreeTraceRingHeader ring_header;
+        if (fread(&ring_header, sizeof(ring_header), 1, fp) != 1)
+        {
+            fprintf(stderr, "%s is truncated after %u threads.\n", filename, ring_idx);
+            break;
+        }
+        printf (" thread %u: %llu records written, %llu kept", ring_header.thread_index, (unsigned long long) ring_header.written,
+                (unsigned long long) ring_header.stored);
+        if (ring_header.written > ring_header.stored)
+            printf (" (the oldest %llu dropped by its ring of %u)", (unsigned long long) (ring_header.written - ring_header.stored), ring_header.capacity);
+        printf ("\n");
+
+        dump_record *grown = realloc(records, (record_count + (size_t) ring_header.stored) * sizeof(dump_record));
+        if (!grown)
+        {
+            fprintf(stderr, "Cannot allocate %llu more records.\n", (unsigned long long) ring_header.stored);
+            break;
+        }
+        records = grown;
+        for (uint64_t idx=0;idx<ring_header.stored;idx++)
+        {
+            if (fread(&records[record_count].record, sizeof(TreeTraceRecord), 1, fp) != 1)
+                break;
+            records[record_count++].thread_index = ring_header.thread_index;
+        }
+    }
+    fclose(fp);
+
+    qsort(records, record_count, sizeof(dump_record), CompareDumpRecord);
+    for (size_t idx=0;idx<record_count;idx++)
+    {
+        const TreeTraceRecord *record = &records[idx].record;
+        event_counts[(record->event < TREE_TRACE_EVENT_COUNT)?record->event:TREE_TRACE_EVENT_COUNT]++;
+        if (summary_only || (only_event && (strcmp(only_event, EventName(record->event)) != 0)))
+            continue;
+        printf ("%14.3f us t%-3u %-10s key=%llu depth=%u outcome=%u\n", (double) (int64_t) (record->tsc - header.start_tsc) / header.ticks_per_ns / 1000.0,
+                records[idx].thread_index, EventName(record->event), (unsigned long long) record->key, record->depth, record->outcome);
+    }
+
+    printf ("%llu records:", (unsigned long long) record_count);
+    for (unsigned int event=0;event<=TREE_TRACE_EVENT_COUNT;event++)
+    {
+        if (event_counts[event])
+            printf (" %s %llu", EventName(event), event_counts[event]);
+    }
+    printf ("\n");
+    free(records);
+    return 0;
+}